@@ -1,105 +1,343 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "erode.h"
+#include "image.h"
 
-#define BMP_WIDTH 20
-#define BMP_HEIGTH 20
-#define BMP_CHANNELS 1
-
-void erode (volatile unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], volatile unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS]) {
-    int se_size = 3;
-    int se_center = 1;
-    int structuringElement[3][3] = {
-        {0, 1, 0},
-        {1, 1, 1},
-        {0, 1, 0}
-    };
-    volatile unsigned char temp_image[BMP_WIDTH][BMP_HEIGTH];
-    for (int x = 0; x < BMP_WIDTH; x++) {
-        for (int y = 0; y < BMP_HEIGTH; y++) {
-            temp_image[x][y] = binary_image[x][y];
-        }
+// Erosion benchmark. Every kernel is timed on every pattern and size with
+// warmup runs, serialised TSC reads and repeated samples, and one CSV row per
+// (kernel, pattern, size) is written for python/regression.py and
+// python/distribution.py. The *_tsc_ticks columns count ticks of the
+// constant-rate TSC, not core clock cycles (the two differ whenever turbo or
+// frequency scaling moves the core clock); the *_ns columns are the same
+// samples converted with the calibrated TSC rate.
+//
+// Build: gcc -O2 -pthread -DERODE_NO_MAIN -o bench asm/RDTSC.c asm/erode*.c asm/image.c
+
+#define DEFAULT_WARMUP      3
+#define DEFAULT_MIN_REPS    5
+#define DEFAULT_MAX_REPS    1000
+#define DEFAULT_TIME_MS     200
+
+// Offset of the work image inside its allocation. Both images start on a page
+// boundary otherwise, and reading row x of one while writing row x of the
+// other then stalls on 4K aliasing between the loads and stores.
+#define WORK_STAGGER        1088
+
+static const int default_sizes[] = {5, 10, 15, 20, 64, 256, 950, 2048, 4096, 8192, 16384};
+
+// Start of a timed region: earlier instructions must finish before the TSC
+// is read, and the read must finish before the region starts
+static inline uint64_t tsc_begin(void) {
+    unsigned int lo, hi;
+    __asm__ __volatile__ (
+        "lfence\n\t"
+        "rdtsc\n\t"
+        "lfence"
+        : "=a" (lo), "=d" (hi)
+        :
+        : "memory"
+    );
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// End of a timed region: rdtscp waits for the region to finish, the lfence
+// keeps later instructions from starting before the read
+static inline uint64_t tsc_end(void) {
+    unsigned int lo, hi, aux;
+    __asm__ __volatile__ (
+        "rdtscp\n\t"
+        "lfence"
+        : "=a" (lo), "=d" (hi), "=c" (aux)
+        :
+        : "memory"
+    );
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// TSC ticks per nanosecond, measured against the monotonic clock
+static double calibrate_tsc(void) {
+    uint64_t ns0 = now_ns();
+    uint64_t t0 = tsc_begin();
+    while (now_ns() - ns0 < 100000000ull) {
     }
-    for (int x = 1; x < BMP_WIDTH - 1; x++) {
-        for (int y = 1; y < BMP_HEIGTH - 1; y++) {
-            int erosion_result = 0;
-            if (temp_image[x][y]) {
-                erosion_result = 1;
-                for (int i = 0; i < se_size; i++) {
-                    for (int j = 0; j < se_size; j++) {
-                        if (structuringElement[i][j] == 1) {
-                            int entry_x = x + i - 1;
-                            int entry_y = y + j - 1;
-                            if (temp_image[entry_x][entry_y] == 0) {
-                                erosion_result = 0;
-                            }
+    uint64_t t1 = tsc_end();
+    uint64_t ns1 = now_ns();
+    return (double)(t1 - t0) / (double)(ns1 - ns0);
+}
+
+typedef struct {
+    int width;
+    int height;
+    image_t input;
+    image_t work;
+    packed_image_t packed_src;
+    packed_image_t packed_dst;
+    rle_image_t rle_src;
+    rle_image_t rle_dst;
+    erode_pool_t* pool;
+} bench_ctx_t;
+
+typedef struct {
+    const char* name;
+    int in_place;       // overwrites its input, restored (untimed) before every run
+    void (*run)(bench_ctx_t* ctx);
+} bench_kernel_t;
+
+static void run_reference(bench_ctx_t* ctx) {
+    erode(ctx->width, ctx->height, 0, IMAGE_PIXELS(&ctx->work), NULL);
+}
+
+static void run_packed(bench_ctx_t* ctx) {
+    erode_packed(&ctx->packed_src, &ctx->packed_dst);
+}
+
+static void run_rle(bench_ctx_t* ctx) {
+    erode_rle(&ctx->rle_src, &ctx->rle_dst);
+}
+
+static void run_simd(bench_ctx_t* ctx) {
+    erode_simd(ctx->width, ctx->height, IMAGE_PIXELS(&ctx->input), IMAGE_PIXELS(&ctx->work));
+}
+
+static void run_inplace(bench_ctx_t* ctx) {
+    erode_inplace(ctx->width, ctx->height, IMAGE_PIXELS(&ctx->work));
+}
+
+static void run_parallel(bench_ctx_t* ctx) {
+    erode_parallel(ctx->pool, ctx->width, ctx->height, IMAGE_PIXELS(&ctx->work));
+}
+
+static const bench_kernel_t kernels[] = {
+    {"reference", 1, run_reference},
+    {"packed", 0, run_packed},
+    {"rle", 0, run_rle},
+    {"simd", 0, run_simd},
+    {"inplace", 1, run_inplace},
+    {"parallel", 1, run_parallel},
+};
+
+// Test patterns of the Chisel tests (Images.scala), at any size
+static const char* patterns[] = {"black", "white", "cells", "border_cells"};
+
+static void fill_pattern(int pattern, int width, int height, unsigned char binary_image[width][height]) {
+    switch (pattern) {
+        case 0:
+            memset(binary_image, 0, (size_t)width * height);
+            break;
+        case 1:
+            memset(binary_image, 255, (size_t)width * height);
+            break;
+        case 2:
+            fill_cells(width, height, binary_image, width * height / 2250 + 1, 1);
+            break;
+        case 3:
+            // Cells plus a frame of cells cut by the image border
+            fill_cells(width, height, binary_image, width * height / 2250 + 1, 2);
+            for (int x = 0; x < width; x += 8) {
+                for (int y = 0; y < height; y += 8) {
+                    if (x < 4 || y < 4 || x >= width - 4 || y >= height - 4) {
+                        for (int i = x; i < x + 4 && i < width; i++) {
+                            for (int j = y; j < y + 4 && j < height; j++) binary_image[i][j] = 255;
                         }
                     }
-                }             
+                }
             }
-            binary_image[x][y] = erosion_result;
-        }
+            break;
     }
-    for (int x = 0; x < BMP_WIDTH; x++) {
-        for (int i = 0; i < se_center; i++) {
-            binary_image[x][i] = 0;
-            binary_image[x][BMP_HEIGTH - 1 - i] = 0;
-        }
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+typedef struct {
+    int warmup;
+    int min_reps;
+    int max_reps;
+    int time_ms;
+} bench_config_t;
+
+static int bench_kernel(const bench_kernel_t* kernel, bench_ctx_t* ctx, const bench_config_t* config,
+                        uint64_t* samples, int* reps) {
+    size_t size = (size_t)ctx->width * ctx->height;
+    for (int i = 0; i < config->warmup; i++) {
+        if (kernel->in_place) memcpy(ctx->work.data, ctx->input.data, size);
+        kernel->run(ctx);
+    }
+
+    uint64_t budget = (uint64_t)config->time_ms * 1000000ull;
+    uint64_t start = now_ns();
+    int n = 0;
+    while (n < config->max_reps && (n < config->min_reps || now_ns() - start < budget)) {
+        if (kernel->in_place) memcpy(ctx->work.data, ctx->input.data, size);
+        uint64_t t0 = tsc_begin();
+        kernel->run(ctx);
+        uint64_t t1 = tsc_end();
+        samples[n++] = t1 - t0;
     }
-    for (int y = 0; y < BMP_HEIGTH; y++) {
-        for (int i = 0; i < se_center; i++) {
-            binary_image[i][y] = 0;
-            binary_image[BMP_WIDTH - 1 - i][y] = 0;
+    *reps = n;
+    qsort(samples, n, sizeof(uint64_t), compare_u64);
+    return 0;
+}
+
+static int parse_list(const char* arg, const char* names[], int count, int* enabled) {
+    memset(enabled, 0, count * sizeof(int));
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "%s", arg);
+    for (char* tok = strtok(buffer, ","); tok; tok = strtok(NULL, ",")) {
+        int found = 0;
+        for (int i = 0; i < count; i++) {
+            if (strcmp(tok, names[i]) == 0) {
+                enabled[i] = 1;
+                found = 1;
+            }
+        }
+        if (!found) {
+            printf("Error: Unknown name '%s'\n", tok);
+            return -1;
         }
     }
+    return 0;
 }
 
-uint64_t rdtsc() {
-    unsigned int lo, hi;
-    __asm__ __volatile__ (
-        "rdtsc"
-        : "=a" (lo), "=d" (hi)
-    );
-    return ((uint64_t)hi << 32) | lo;
+static void usage(const char* prog) {
+    printf("Usage: %s [options]\n", prog);
+    printf("  --min <n>         smallest image size (default 5)\n");
+    printf("  --max <n>         largest image size (default 16384)\n");
+    printf("  --kernels <list>  comma separated: reference,packed,rle,simd,inplace,parallel\n");
+    printf("  --patterns <list> comma separated: black,white,cells,border_cells\n");
+    printf("  --warmup <n>      untimed runs before sampling (default %d)\n", DEFAULT_WARMUP);
+    printf("  --reps <n>        minimum timed runs (default %d)\n", DEFAULT_MIN_REPS);
+    printf("  --time-ms <ms>    keep sampling until this much time has passed (default %d)\n", DEFAULT_TIME_MS);
+    printf("  --csv <file>      write results to file instead of stdout\n");
 }
 
-int main() {
-    volatile unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH] = {
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0, 255,   0,   0,   0,   0,
-        0,   0,   0,   0, 255,   0,   0,   0,   0,   0,   0,   0,   0,   0, 255, 255, 255,   0,   0,   0,
-        0,   0,   0, 255, 255, 255,   0,   0,   0,   0,   0,   0,   0, 255, 255, 255, 255, 255,   0,   0,
-        0,   0, 255, 255, 255, 255, 255,   0,   0,   0,   0,   0,   0,   0, 255, 255, 255,   0,   0,   0,
-        0,   0, 255, 255, 255, 255, 255, 255,   0,   0,   0,   0,   0,   0,   0, 255,   0,   0,   0,   0,
-        0,   0, 255, 255, 255, 255, 255, 255,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        0,   0, 255, 255, 255, 255, 255, 255,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        0,   0,   0, 255, 255, 255, 255,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0, 255, 255,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0, 255,   0,   0,   0,   0,   0,   0, 255, 255, 255,   0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0, 255, 255, 255,   0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0, 255, 255, 255,   0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0, 255, 255, 255,   0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0
-    };
-    volatile unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS];
-
-    for (int x = 0; x < BMP_WIDTH; x++) {
-        for (int y = 0; y < BMP_HEIGTH; y++) {
-            binary_image[x][y] = 1; // or random values
-            for (int c = 0; c < BMP_CHANNELS; c++)
-                bmp_image[x][y][c] = 0;
+int main(int argc, char* argv[]) {
+    const int kernel_count = sizeof(kernels) / sizeof(kernels[0]);
+    const int pattern_count = sizeof(patterns) / sizeof(patterns[0]);
+    const char* kernel_names[sizeof(kernels) / sizeof(kernels[0])];
+    for (int i = 0; i < kernel_count; i++) kernel_names[i] = kernels[i].name;
+
+    int kernel_enabled[sizeof(kernels) / sizeof(kernels[0])];
+    int pattern_enabled[sizeof(patterns) / sizeof(patterns[0])];
+    for (int i = 0; i < kernel_count; i++) kernel_enabled[i] = 1;
+    for (int i = 0; i < pattern_count; i++) pattern_enabled[i] = 1;
+
+    bench_config_t config = {DEFAULT_WARMUP, DEFAULT_MIN_REPS, DEFAULT_MAX_REPS, DEFAULT_TIME_MS};
+    int min_size = 5, max_size = 16384;
+    const char* csv_file = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!value) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (strcmp(argv[i], "--min") == 0) min_size = atoi(value);
+        else if (strcmp(argv[i], "--max") == 0) max_size = atoi(value);
+        else if (strcmp(argv[i], "--warmup") == 0) config.warmup = atoi(value);
+        else if (strcmp(argv[i], "--reps") == 0) config.min_reps = atoi(value);
+        else if (strcmp(argv[i], "--time-ms") == 0) config.time_ms = atoi(value);
+        else if (strcmp(argv[i], "--csv") == 0) csv_file = value;
+        else if (strcmp(argv[i], "--kernels") == 0) {
+            if (parse_list(value, kernel_names, kernel_count, kernel_enabled)) return 1;
+        } else if (strcmp(argv[i], "--patterns") == 0) {
+            if (parse_list(value, patterns, pattern_count, pattern_enabled)) return 1;
+        } else {
+            usage(argv[0]);
+            return 1;
         }
+        i++;
     }
+    if (config.min_reps < 1) config.min_reps = 1;
+    if (config.max_reps < config.min_reps) config.max_reps = config.min_reps;
 
-    uint64_t start, end;
-    start = rdtsc();
+    FILE* csv = csv_file ? fopen(csv_file, "w") : stdout;
+    if (!csv) {
+        printf("Error: Cannot create output file %s\n", csv_file);
+        return 1;
+    }
+
+    double ticks_per_ns = calibrate_tsc();
+    fprintf(stderr, "TSC: %.3f GHz, SIMD kernel: %s\n", ticks_per_ns, erode_row_isa());
+    fprintf(csv, "kernel,pattern,width,height,pixels,reps,min_tsc_ticks,median_tsc_ticks,p99_tsc_ticks,mean_tsc_ticks,max_tsc_ticks,"
+                 "min_ns,median_ns,p99_ns,tsc_ticks_per_pixel\n");
+
+    uint64_t* samples = malloc(config.max_reps * sizeof(uint64_t));
+    bench_ctx_t ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.pool = erode_pool_create(0);
+    if (!samples || !ctx.pool) {
+        printf("Error: Cannot allocate benchmark state\n");
+        return 1;
+    }
 
-    erode(binary_image, bmp_image);
+    for (size_t s = 0; s < sizeof(default_sizes) / sizeof(default_sizes[0]); s++) {
+        int size = default_sizes[s];
+        if (size < min_size || size > max_size) continue;
+        ctx.width = ctx.height = size;
+        if (image_alloc(&ctx.input, size, size, 1, IMAGE_HUGE_PAGES) ||
+            image_alloc(&ctx.work, 1, size * size + WORK_STAGGER, 1, IMAGE_HUGE_PAGES) ||
+            packed_image_alloc(&ctx.packed_src, size, size) || packed_image_alloc(&ctx.packed_dst, size, size) ||
+            rle_image_alloc(&ctx.rle_src, size, size, size) || rle_image_alloc(&ctx.rle_dst, size, size, size)) {
+            printf("Error: Cannot allocate %dx%d images\n", size, size);
+            return 1;
+        }
+        ctx.work.rows = ctx.work.cols = size;
+        ctx.work.stride = size;
+        ctx.work.data += WORK_STAGGER;
+
+        for (int p = 0; p < pattern_count; p++) {
+            if (!pattern_enabled[p]) continue;
+            fill_pattern(p, size, size, IMAGE_PIXELS(&ctx.input));
+            pack_image(size, size, IMAGE_PIXELS(&ctx.input), &ctx.packed_src);
+            if (rle_encode(size, size, IMAGE_PIXELS(&ctx.input), &ctx.rle_src)) {
+                printf("Error: Cannot allocate run-length image\n");
+                return 1;
+            }
+
+            for (int k = 0; k < kernel_count; k++) {
+                if (!kernel_enabled[k]) continue;
+                int reps;
+                bench_kernel(&kernels[k], &ctx, &config, samples, &reps);
+                uint64_t sum = 0;
+                for (int i = 0; i < reps; i++) sum += samples[i];
+                uint64_t min = samples[0];
+                uint64_t median = samples[reps / 2];
+                uint64_t p99 = samples[(int)((reps - 1) * 0.99 + 0.5)];
+                double pixels = (double)size * size;
+                fprintf(csv, "%s,%s,%d,%d,%.0f,%d,%llu,%llu,%llu,%.1f,%llu,%.1f,%.1f,%.1f,%.4f\n",
+                        kernels[k].name, patterns[p], size, size, pixels, reps,
+                        (unsigned long long)min, (unsigned long long)median, (unsigned long long)p99,
+                        (double)sum / reps, (unsigned long long)samples[reps - 1],
+                        min / ticks_per_ns, median / ticks_per_ns, p99 / ticks_per_ns, median / pixels);
+                fflush(csv);
+                fprintf(stderr, "%-10s %-13s %6dx%-6d median %12llu ticks  %8.3f ticks/pixel\n",
+                        kernels[k].name, patterns[p], size, size, (unsigned long long)median, median / pixels);
+            }
+        }
+
+        image_free(&ctx.input);
+        image_free(&ctx.work);
+        packed_image_free(&ctx.packed_src);
+        packed_image_free(&ctx.packed_dst);
+        rle_image_free(&ctx.rle_src);
+        rle_image_free(&ctx.rle_dst);
+    }
 
-    end = rdtsc();
-    printf("CPU cycles: %llu\n", (end - start));
+    erode_pool_destroy(ctx.pool);
+    free(samples);
+    if (csv != stdout) fclose(csv);
+    return 0;
 }
@@ -1,23 +1,20 @@
+#include <ctype.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include "assembler.h"
 
-#define MAX_INSTRUCTIONS 100
-#define MAX_LINE_LENGTH 256
-#define MAX_LABELS 100
-
-// Instruction opcodes
-#define OP_ADD      0b010000    // 010000 (R-Type)
-#define OP_LOAD     0b100000    // 100000 (I-Type)
-#define OP_STORE    0b100001    // 100001 (I-Type)
-#define OP_ADDI     0b100010    // 100010 (I-Type)
-#define OP_SUBI     0b100011    // 100011 (I-Type)
-#define OP_BEQ      0b100100    // 100100 (I-Type)
-#define OP_BGE      0b100101    // 100101 (I-Type)
-#define OP_JUMP     0b110000    // 110000 (J-Type)
-#define OP_END      0b000000    // 000000 (Special Type)
-
+// Single-pass assembler. Each line is encoded as soon as it is read; a branch
+// or jump to a label that is not defined yet is emitted with a zero target
+// and recorded as a fixup, and all fixups are patched once the source ends.
+// Mnemonics and labels are looked up in hash tables, and the output grows as
+// needed, so program size is only limited by the 16-bit program counter.
+//
+// Branch and jump targets are absolute instruction addresses, which is how
+// CPUTop uses the immediate: a label resolves to its address, and a number is
+// taken as the address itself.
 
 // Instruction types
 typedef enum {
@@ -34,20 +31,8 @@ typedef struct {
     instruction_type_t type;
 } instruction_info_t;
 
-// Label structure for jump/branch targets
-typedef struct {
-    char name[32];
-    uint16_t address;
-} label_t;
-
-// Global arrays
-uint32_t instructions[MAX_INSTRUCTIONS];
-label_t labels[MAX_LABELS];
-int instruction_count = 0;
-int label_count = 0;
-
 // Instruction lookup table
-instruction_info_t instruction_table[] = {
+static const instruction_info_t instruction_table[] = {
     {"ADD",     OP_ADD,     R_TYPE},
     {"LOAD",    OP_LOAD,    I_TYPE},
     {"STORE",   OP_STORE,   I_TYPE},
@@ -59,30 +44,78 @@ instruction_info_t instruction_table[] = {
     {"END",     OP_END,     SPECIAL}
 };
 
-// Function prototypes
-instruction_info_t* find_instruction(const char* mnemonic);
-uint32_t encode_r_type(uint8_t opcode, uint8_t rd, uint8_t rs1, uint8_t rs2);
-uint32_t encode_i_type(uint8_t opcode, uint8_t rs, uint8_t rt, uint16_t immediate);
-uint32_t encode_j_type(uint8_t opcode, uint16_t address);
-int parse_register(const char* reg_str);
-int add_label(const char* name, uint16_t address);
-int find_label(const char* name);
-void compile_file(const char* input_file, const char* output_file);
-
-// Find instruction info by mnemonic
-instruction_info_t* find_instruction(const char* mnemonic) {
-    int table_size = sizeof(instruction_table) / sizeof(instruction_info_t);
-    for (int i = 0; i < table_size; i++) {
-        if (strcmp(instruction_table[i].mnemonic, mnemonic) == 0) {
-            return &instruction_table[i];
-        }
+#define INSTRUCTION_COUNT   (int)(sizeof(instruction_table) / sizeof(instruction_table[0]))
+#define OPCODE_SLOTS        32      // power of two, well above INSTRUCTION_COUNT
+
+// Slice of the source text
+typedef struct {
+    const char* text;
+    int length;
+} token_t;
+
+// Label: `address` is -1 while the label is only referenced
+typedef struct {
+    token_t name;
+    int address;
+} label_t;
+
+// Instruction whose target is a label, patched at the end
+typedef struct {
+    int index;
+    int label;
+} fixup_t;
+
+typedef struct {
+    asm_program_t* program;
+    int opcode_slots[OPCODE_SLOTS];     // instruction_table index + 1, 0 if empty
+    label_t* labels;
+    int label_count;
+    int label_capacity;
+    int* label_slots;                   // labels index + 1, 0 if empty
+    int label_slot_count;
+    fixup_t* fixups;
+    int fixup_count;
+    int fixup_capacity;
+    int line_number;
+    int errors;
+    int overflow;
+} assembler_t;
+
+// FNV-1a, optionally case-folded
+static uint32_t hash_token(token_t token, int fold) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < token.length; i++) {
+        unsigned char c = token.text[i];
+        hash = (hash ^ (fold ? toupper(c) : c)) * 16777619u;
     }
-    return NULL;
+    return hash;
+}
+
+static int token_equals(token_t a, token_t b) {
+    return a.length == b.length && memcmp(a.text, b.text, a.length) == 0;
+}
+
+// Grow an array to hold at least `needed` elements
+static int grow(void** data, int* capacity, int needed, size_t element) {
+    if (needed <= *capacity) return 0;
+    int new_capacity = *capacity ? *capacity : 64;
+    while (new_capacity < needed) new_capacity *= 2;
+    void* grown = realloc(*data, (size_t)new_capacity * element);
+    if (!grown) return -1;
+    *data = grown;
+    *capacity = new_capacity;
+    return 0;
+}
+
+static void error(assembler_t* as, const char* message, token_t token) {
+    if (token.length) printf("Error: %s '%.*s' at line %d\n", message, token.length, token.text, as->line_number);
+    else printf("Error: %s at line %d\n", message, as->line_number);
+    as->errors++;
 }
 
 // Encode R-type instruction
 uint32_t encode_r_type(uint8_t opcode, uint8_t rd, uint8_t rs1, uint8_t rs2) {
-    return ((uint32_t)opcode << 26) | ((uint32_t)rd << 21) | ((uint32_t)rs1 << 16) | 
+    return ((uint32_t)opcode << 26) | ((uint32_t)rd << 21) | ((uint32_t)rs1 << 16) |
            ((uint32_t)rs2 << 11);
 }
 
@@ -96,247 +129,458 @@ uint32_t encode_j_type(uint8_t opcode, uint16_t address) {
     return ((uint32_t)opcode << 26) | address;
 }
 
-// Clean argument string
-void clean_arg(char* arg) {
-    int len = strlen(arg);
-    while (len > 0 && (arg[len-1] == ',' || arg[len-1] == ' ' || arg[len-1] == '\t')) {
-        arg[len-1] = '\0';
-        len--;
+static void build_opcode_table(assembler_t* as) {
+    memset(as->opcode_slots, 0, sizeof(as->opcode_slots));
+    for (int i = 0; i < INSTRUCTION_COUNT; i++) {
+        token_t name = {instruction_table[i].mnemonic, (int)strlen(instruction_table[i].mnemonic)};
+        uint32_t slot = hash_token(name, 1) & (OPCODE_SLOTS - 1);
+        while (as->opcode_slots[slot]) slot = (slot + 1) & (OPCODE_SLOTS - 1);
+        as->opcode_slots[slot] = i + 1;
     }
 }
 
+// Find instruction info by mnemonic, ignoring case
+static const instruction_info_t* find_instruction(const assembler_t* as, token_t mnemonic) {
+    uint32_t slot = hash_token(mnemonic, 1) & (OPCODE_SLOTS - 1);
+    while (as->opcode_slots[slot]) {
+        const instruction_info_t* info = &instruction_table[as->opcode_slots[slot] - 1];
+        if ((int)strlen(info->mnemonic) == mnemonic.length && strncasecmp(info->mnemonic, mnemonic.text, mnemonic.length) == 0) {
+            return info;
+        }
+        slot = (slot + 1) & (OPCODE_SLOTS - 1);
+    }
+    return NULL;
+}
+
+static int rehash_labels(assembler_t* as, int slot_count) {
+    int* slots = calloc(slot_count, sizeof(int));
+    if (!slots) return -1;
+    for (int i = 0; i < as->label_count; i++) {
+        uint32_t slot = hash_token(as->labels[i].name, 0) & (slot_count - 1);
+        while (slots[slot]) slot = (slot + 1) & (slot_count - 1);
+        slots[slot] = i + 1;
+    }
+    free(as->label_slots);
+    as->label_slots = slots;
+    as->label_slot_count = slot_count;
+    return 0;
+}
+
+// Find a label, creating an undefined one on first use. Returns its index,
+// or -1 on allocation failure.
+static int intern_label(assembler_t* as, token_t name) {
+    uint32_t slot = hash_token(name, 0) & (as->label_slot_count - 1);
+    while (as->label_slots[slot]) {
+        int index = as->label_slots[slot] - 1;
+        if (token_equals(as->labels[index].name, name)) return index;
+        slot = (slot + 1) & (as->label_slot_count - 1);
+    }
+
+    if (grow((void**)&as->labels, &as->label_capacity, as->label_count + 1, sizeof(label_t))) return -1;
+    int index = as->label_count++;
+    as->labels[index].name = name;
+    as->labels[index].address = -1;
+    as->label_slots[slot] = index + 1;
+
+    // Keep the table at most half full
+    if (2 * as->label_count > as->label_slot_count && rehash_labels(as, 2 * as->label_slot_count)) return -1;
+    return index;
+}
+
+// Split the next operand off the line: operands are separated by whitespace
+// and/or commas
+static token_t next_token(const char** cursor, const char* end) {
+    const char* p = *cursor;
+    while (p < end && (isspace((unsigned char)*p) || *p == ',')) p++;
+    const char* start = p;
+    while (p < end && !isspace((unsigned char)*p) && *p != ',') p++;
+    *cursor = p;
+    token_t token = {start, (int)(p - start)};
+    return token;
+}
+
+// Parse a decimal (or 0x hexadecimal) integer filling the whole token
+static int parse_number(token_t token, int* value) {
+    if (token.length == 0 || token.length > 31) return 0;
+    char text[32];
+    memcpy(text, token.text, token.length);
+    text[token.length] = '\0';
+    char* end;
+    int base = (text[0] == '0' && (text[1] == 'x' || text[1] == 'X')) ||
+               (text[0] == '-' && text[1] == '0' && (text[2] == 'x' || text[2] == 'X')) ? 16 : 10;
+    long parsed = strtol(text, &end, base);
+    if (*end != '\0') return 0;
+    // Saturate, so that the callers' range checks see huge values as such
+    *value = parsed < INT_MIN ? INT_MIN : parsed > INT_MAX ? INT_MAX : (int)parsed;
+    return 1;
+}
+
+// An immediate is stored in 16 bits and sign-extended: -1 and 0xFFFF are the
+// same word, so both ranges are accepted. Addresses are unsigned.
+#define IMMEDIATE_MIN -32768
+#define IMMEDIATE_MAX 65535
+#define ADDRESS_MAX   65535
+
 // Parse register string (R0, R1, $r0, $zero, etc.) to register number
-int parse_register(const char* reg_str) {
-    // Create clean copy of the register string
-    char clean_reg[32];
-    strcpy(clean_reg, reg_str);
-    clean_arg(clean_reg);
-    
-    // Handle $zero register (maps to R0)
-    if (strcmp(clean_reg, "$zero") == 0) {
-        return 0;
+static int parse_register(token_t token) {
+    if (token.length == 5 && memcmp(token.text, "$zero", 5) == 0) return 0;
+    const char* p = token.text;
+    int length = token.length;
+    if (length > 0 && *p == '$') {
+        p++;
+        length--;
     }
-    
-    // Handle $r0-$r7 format
-    if (clean_reg[0] == '$' && (clean_reg[1] == 'r' || clean_reg[1] == 'R')) {
-        int reg_num = atoi(&clean_reg[2]);
-        if (reg_num >= 0 && reg_num <= 7) {
-            return reg_num;
-        }
+    if (length == 2 && (p[0] == 'R' || p[0] == 'r') && p[1] >= '0' && p[1] <= '7') {
+        return p[1] - '0';
     }
-    
-    // Handle R0-R7 format
-    if (clean_reg[0] == 'R' || clean_reg[0] == 'r') {
-        int reg_num = atoi(&clean_reg[1]);
-        if (reg_num >= 0 && reg_num <= 7) {
-            return reg_num;
+    return -1; // Invalid register
+}
+
+// Branch or jump target: a number is the address itself, anything else is a
+// label that is patched in later
+static int parse_target(assembler_t* as, token_t token, int* target) {
+    if (parse_number(token, target)) {
+        if (*target < 0 || *target > ADDRESS_MAX) {
+            error(as, "Address out of range", token);
+            *target = 0;
         }
+        return 0;
     }
-    
-    return -1; // Invalid register
+    int label = intern_label(as, token);
+    if (label < 0) return -1;
+    *target = 0;
+    // A word past the end of program memory is rejected by emit(), so it
+    // must not be patched either
+    if (as->program->count >= ASM_MAX_INSTRUCTIONS) return 0;
+    if (grow((void**)&as->fixups, &as->fixup_capacity, as->fixup_count + 1, sizeof(fixup_t))) return -1;
+    as->fixups[as->fixup_count].index = as->program->count;
+    as->fixups[as->fixup_count].label = label;
+    as->fixup_count++;
+    return 0;
 }
 
-// Add label to label table
-int add_label(const char* name, uint16_t address) {
-    if (label_count >= MAX_LABELS) return -1;
-    strcpy(labels[label_count].name, name);
-    labels[label_count].address = address;
-    label_count++;
+static int emit(assembler_t* as, uint32_t word) {
+    asm_program_t* program = as->program;
+    if (program->count >= ASM_MAX_INSTRUCTIONS) {
+        token_t none = {NULL, 0};
+        if (!as->overflow) error(as, "Program exceeds 65536 instructions", none);
+        as->overflow = 1;
+        return 0;
+    }
+    if (grow((void**)&program->words, &program->capacity, program->count + 1, sizeof(uint32_t)) ||
+        grow((void**)&program->lines, &program->line_capacity, program->count + 1, sizeof(int))) {
+        return -1;
+    }
+    program->words[program->count] = word;
+    program->lines[program->count] = as->line_number;
+    program->count++;
     return 0;
 }
 
-// Find label address by name
-int find_label(const char* name) {
-    for (int i = 0; i < label_count; i++) {
-        if (strcmp(labels[i].name, name) == 0) {
-            return labels[i].address;
+// Assemble one line with comments removed. Returns -1 on allocation failure.
+static int assemble_line(assembler_t* as, const char* p, const char* end) {
+    token_t none = {NULL, 0};
+
+    // Labels end with a colon and may be followed by an instruction
+    const char* colon = memchr(p, ':', end - p);
+    if (colon) {
+        const char* cursor = p;
+        token_t name = next_token(&cursor, colon);
+        token_t rest = next_token(&cursor, colon);
+        if (name.length == 0 || rest.length != 0) {
+            error(as, "Invalid label", name);
+        } else {
+            int label = intern_label(as, name);
+            if (label < 0) return -1;
+            if (as->labels[label].address >= 0) error(as, "Duplicate label", name);
+            else as->labels[label].address = as->program->count;
         }
+        p = colon + 1;
     }
-    return -1; // Label not found
-}
 
-// Main compilation function
-void compile_file(const char* input_file, const char* output_file) {
-    FILE* input = fopen(input_file, "r");
-    if (!input) {
-        printf("Error: Cannot open input file %s\n", input_file);
-        return;
+    token_t mnemonic = next_token(&p, end);
+    if (mnemonic.length == 0) return 0; // Empty line
+    token_t arg[4];
+    int args = 1;
+    for (int i = 0; i < 4; i++) {
+        arg[i] = next_token(&p, end);
+        if (arg[i].length) args++;
     }
-    
-    char line[MAX_LINE_LENGTH];
-    int line_number = 0;
-    
-    // First pass: collect labels
-    while (fgets(line, sizeof(line), input)) {
-        line_number++;
-        
-        // Remove newline and comments
-        char* comment = strchr(line, ';');
-        if (comment) *comment = '\0';
-        comment = strchr(line, '#');
-        if (comment) *comment = '\0';
-        
-        // Check for label
-        char* colon = strchr(line, ':');
-        if (colon) {
-            *colon = '\0';
-            // Remove leading/trailing whitespace
-            char label_name[32];
-            sscanf(line, "%s", label_name);
-            add_label(label_name, instruction_count);
-            continue;
-        }
-        
-        // Skip empty lines
-        char temp[MAX_LINE_LENGTH];
-        if (sscanf(line, "%s", temp) != 1) continue;
-        
-        instruction_count++;
+
+    const instruction_info_t* instr = find_instruction(as, mnemonic);
+    if (!instr) {
+        error(as, "Unknown instruction", mnemonic);
+        return 0;
     }
-    
-    // Reset for second pass
-    rewind(input);
-    instruction_count = 0;
-    line_number = 0;
-    
-    // Second pass: generate instructions
-    while (fgets(line, sizeof(line), input)) {
-        line_number++;
-        
-        // Remove newline and comments
-        char* comment = strchr(line, ';');
-        if (comment) *comment = '\0';
-        comment = strchr(line, '#');
-        if (comment) *comment = '\0';
-        
-        // Skip labels
-        if (strchr(line, ':')) continue;
-        
-        char mnemonic[10], arg1[32], arg2[32], arg3[32], arg4[32];
-        int args = sscanf(line, "%s %s %s %s %s", mnemonic, arg1, arg2, arg3, arg4);
-        
-        if (args < 1) continue; // Empty line
-        
-        instruction_info_t* instr = find_instruction(mnemonic);
-        if (!instr) {
-            printf("Error: Unknown instruction '%s' at line %d\n", mnemonic, line_number);
-            continue;
+
+    uint32_t encoded = 0;
+    switch (instr->type) {
+        case SPECIAL: // END instruction
+            encoded = 0; // All zeros
+            break;
+
+        case R_TYPE: { // ADD
+            if (args < 4) {
+                error(as, "R-type instruction needs 3 registers", none);
+                return 0;
+            }
+            int rd = parse_register(arg[0]);
+            int rs1 = parse_register(arg[1]);
+            int rs2 = parse_register(arg[2]);
+            if (rd < 0 || rs1 < 0 || rs2 < 0) {
+                error(as, "Invalid register", none);
+                return 0;
+            }
+            encoded = encode_r_type(instr->opcode, rd, rs1, rs2);
+            break;
         }
-        
-        uint32_t encoded = 0;
-        
-        switch (instr->type) {
-            case SPECIAL: // END instruction
-                encoded = 0; // All zeros
-                break;
-                
-            case R_TYPE: // ADD
-                if (args < 4) {
-                    printf("Error: R-type instruction needs 3 registers at line %d\n", line_number);
-                    continue;
-                }
-                int rd = parse_register(arg1);
-                int rs1 = parse_register(arg2);
-                int rs2 = parse_register(arg3);
-                
-                if (rd < 0 || rs1 < 0 || rs2 < 0) {
-                    printf("Error: Invalid register at line %d\n", line_number);
-                    continue;
-                }
-                
-                encoded = encode_r_type(instr->opcode, rd, rs1, rs2);
-                break;
-                
-            case I_TYPE: // LOAD, STORE, ADDI, BEQ, SUBI, BGE
-                if (args < 3) {
-                    printf("Error: I-type instruction needs at least 2 arguments at line %d\n", line_number);
-                    continue;
-                }
-                
-                int rs = parse_register(arg2);
-                int rt = parse_register(arg1);
-                int immediate = 0;
-                
-                // Handle different I-type formats
-                if (strcmp(mnemonic, "LOAD") == 0 || strcmp(mnemonic, "STORE") == 0) {
-                    // Format: LOAD R1, 100(R2) or STORE R1, 100(R2)
-                    char* paren = strchr(arg2, '(');
-                    if (paren) {
-                        *paren = '\0';
-                        immediate = atoi(arg2);
-                        rs = parse_register(paren + 1);
-                        char* close_paren = strchr(paren + 1, ')');
-                        if (close_paren) *close_paren = '\0';
-                    } else {
-                        immediate = atoi(arg2);
-                        rs = 0; // Default to R0
-                    }
-                } else if (strcmp(mnemonic, "BEQ") == 0 || strcmp(mnemonic, "BGE") == 0) {
-                    // Format: BEQ R1, R2, label or BGE R1, R2, label
-                    if (args >= 4) {
-                        rs = parse_register(arg1);
-                        rt = parse_register(arg2);
-                        int label_addr = find_label(arg3);
-                        immediate = (label_addr >= 0) ? label_addr - instruction_count - 1 : atoi(arg3);
-                    } else {
-                        rs = parse_register(arg1);
-                        rt = 0; // Compare with R0 for single register format
-                        int label_addr = find_label(arg2);
-                        immediate = (label_addr >= 0) ? label_addr - instruction_count - 1 : atoi(arg2);
-                    }
-                } else {
-                    // ADDI, SUBI: Format: ADDI R1, R2, immediate
-                    rs = parse_register(arg2);
-                    rt = parse_register(arg1);
-                    immediate = atoi(arg3);
-                }
-                
-                if (rs < 0 || rt < 0) {
-                    printf("Error: Invalid register at line %d\n", line_number);
-                    continue;
+
+        case I_TYPE: { // LOAD, STORE, ADDI, BEQ, SUBI, BGE
+            if (args < 3) {
+                error(as, "I-type instruction needs at least 2 arguments", none);
+                return 0;
+            }
+            int rs, rt, immediate = 0, ok = 1;
+
+            if (instr->opcode == OP_LOAD || instr->opcode == OP_STORE) {
+                // Format: LOAD R1, 100(R2) or STORE R1, 100(R2)
+                rt = parse_register(arg[0]);
+                rs = 0; // Default to R0
+                const char* paren = memchr(arg[1].text, '(', arg[1].length);
+                token_t offset = arg[1];
+                if (paren) {
+                    offset.length = (int)(paren - arg[1].text);
+                    token_t base = {paren + 1, arg[1].length - offset.length - 1};
+                    if (base.length > 0 && base.text[base.length - 1] == ')') base.length--;
+                    rs = parse_register(base);
                 }
-                
-                encoded = encode_i_type(instr->opcode, rs, rt, immediate & 0xFFFF);
-                break;
-                
-            case J_TYPE: // JUMP
-                if (args < 2) {
-                    printf("Error: J-type instruction needs address at line %d\n", line_number);
-                    continue;
+                if (offset.length == 0) immediate = 0;
+                else ok = parse_number(offset, &immediate);
+            } else if (instr->opcode == OP_BEQ || instr->opcode == OP_BGE) {
+                // Format: BEQ R1, R2, label or BEQ R1, label (compare with R0)
+                rs = parse_register(arg[0]);
+                rt = args >= 4 ? parse_register(arg[1]) : 0;
+                if (rs >= 0 && rt >= 0 && parse_target(as, args >= 4 ? arg[2] : arg[1], &immediate)) return -1;
+            } else {
+                // ADDI, SUBI: Format: ADDI R1, R2, immediate
+                if (args < 4) {
+                    error(as, "I-type instruction needs 3 arguments", none);
+                    return 0;
                 }
-                
-                int target_addr = find_label(arg1);
-                if (target_addr < 0) target_addr = atoi(arg1);
-                
-                encoded = encode_j_type(instr->opcode, target_addr & 0xFFFF);
-                break;
+                rt = parse_register(arg[0]);
+                rs = parse_register(arg[1]);
+                ok = parse_number(arg[2], &immediate);
+            }
+
+            if (rs < 0 || rt < 0) {
+                error(as, "Invalid register", none);
+                return 0;
+            }
+            if (!ok) {
+                error(as, "Invalid immediate", none);
+                return 0;
+            }
+            if (immediate < IMMEDIATE_MIN || immediate > IMMEDIATE_MAX) {
+                error(as, "Immediate out of 16-bit range", none);
+                return 0;
+            }
+            encoded = encode_i_type(instr->opcode, rs, rt, immediate & 0xFFFF);
+            break;
+        }
+
+        case J_TYPE: { // JUMP
+            if (args < 2) {
+                error(as, "J-type instruction needs address", none);
+                return 0;
+            }
+            int target_addr;
+            if (parse_target(as, arg[0], &target_addr)) return -1;
+            encoded = encode_j_type(instr->opcode, target_addr & 0xFFFF);
+            break;
+        }
+    }
+    return emit(as, encoded);
+}
+
+// Assemble `length` bytes of source into `program`, which must be zeroed or
+// freshly released. Returns the number of errors; messages are printed.
+int asm_assemble(const char* source, size_t length, asm_program_t* program) {
+    assembler_t as;
+    memset(&as, 0, sizeof(as));
+    memset(program, 0, sizeof(*program));
+    as.program = program;
+    build_opcode_table(&as);
+
+    int result = rehash_labels(&as, 64);
+    const char* end = source + length;
+    for (const char* line = source; line < end && result == 0;) {
+        const char* line_end = memchr(line, '\n', end - line);
+        if (!line_end) line_end = end;
+        as.line_number++;
+
+        // Remove comments
+        const char* code_end = line;
+        while (code_end < line_end && *code_end != ';' && *code_end != '#') code_end++;
+        result = assemble_line(&as, line, code_end);
+        line = line_end + 1;
+    }
+
+    // Backpatch references to labels
+    for (int i = 0; i < as.fixup_count && result == 0; i++) {
+        const label_t* label = &as.labels[as.fixups[i].label];
+        if (as.fixups[i].index >= program->count) continue;
+        if (label->address < 0) {
+            printf("Error: Undefined label '%.*s' at line %d\n", label->name.length, label->name.text,
+                   program->lines[as.fixups[i].index]);
+            as.errors++;
+            continue;
         }
-        
-        instructions[instruction_count++] = encoded;
-        printf("0x%04X: 0x%08X  ; %s\n", instruction_count - 1, encoded, line);
+        program->words[as.fixups[i].index] |= (uint32_t)label->address & 0xFFFF;
+    }
+
+    if (result) {
+        printf("Error: Out of memory\n");
+        as.errors++;
+    }
+    free(as.labels);
+    free(as.label_slots);
+    free(as.fixups);
+    return as.errors;
+}
+
+// Read a whole file into a NUL-terminated buffer
+static char* read_source(const char* path, size_t* length) {
+    FILE* input = fopen(path, "rb");
+    if (!input) {
+        printf("Error: Cannot open input file %s\n", path);
+        return NULL;
+    }
+    fseek(input, 0, SEEK_END);
+    long size = ftell(input);
+    rewind(input);
+    char* source = size >= 0 ? malloc(size + 1) : NULL;
+    if (!source || fread(source, 1, size, input) != (size_t)size) {
+        printf("Error: Cannot read input file %s\n", path);
+        free(source);
+        fclose(input);
+        return NULL;
     }
-    
     fclose(input);
-    
-    // Write binary output
-    FILE* output = fopen(output_file, "wb");
-    if (output) {
-        fwrite(instructions, sizeof(uint32_t), instruction_count, output);
-        fclose(output);
-    } else {
-        printf("Error: Cannot create output file %s\n", output_file);
+    source[size] = '\0';
+    *length = size;
+    return source;
+}
+
+// Assemble a source file. Returns the number of errors.
+int asm_assemble_file(const char* path, asm_program_t* program) {
+    memset(program, 0, sizeof(*program));
+    size_t length;
+    char* source = read_source(path, &length);
+    if (!source) return 1;
+    int errors = asm_assemble(source, length, program);
+    free(source);
+    return errors;
+}
+
+void asm_program_free(asm_program_t* program) {
+    free(program->words);
+    free(program->lines);
+    memset(program, 0, sizeof(*program));
+}
+
+#ifndef ASSEMBLER_NO_MAIN
+
+// Regression cases: programs over the 65536-word limit with label references
+// past it must fail with an error, not write past the program, and so must
+// immediates that do not fit in 16 bits
+static int self_check(void) {
+    int failures = 0;
+    const char* tails[] = {"jump end\nend: end\n", "beq R1, R2, missing\n", "loop: jump loop\n"};
+    for (int t = 0; t < 3; t++) {
+        size_t head = (size_t)(ASM_MAX_INSTRUCTIONS + 10) * 4;
+        size_t length = head + strlen(tails[t]);
+        char* source = malloc(length + 1);
+        if (!source) return 1;
+        for (size_t i = 0; i < head; i += 4) memcpy(source + i, "end\n", 4);
+        memcpy(source + head, tails[t], strlen(tails[t]) + 1);
+        asm_program_t program;
+        memset(&program, 0, sizeof(program));
+        int errors = asm_assemble(source, length, &program);
+        int ok = errors > 0 && program.count == ASM_MAX_INSTRUCTIONS;
+        printf("over-long program %d: %s\n", t + 1, ok ? "rejected" : "NOT rejected");
+        failures += !ok;
+        asm_program_free(&program);
+        free(source);
+    }
+
+    // Immediates and addresses that do not fit in 16 bits are errors, not truncated
+    const char* ranges[] = {"addi R1, R0, 65536\n", "addi R1, R0, -32769\n", "load R1, 0x10000(R0)\n",
+                            "subi R1, R1, 99999999999\n", "jump 65536\n", "beq R1, -1\n"};
+    for (int t = 0; t < 6; t++) {
+        asm_program_t program;
+        memset(&program, 0, sizeof(program));
+        int ok = asm_assemble(ranges[t], strlen(ranges[t]), &program) > 0;
+        printf("out-of-range immediate %d: %s\n", t + 1, ok ? "rejected" : "NOT rejected");
+        failures += !ok;
+        asm_program_free(&program);
     }
+    const char* fits = "addi R1, R0, 65535\naddi R1, R0, -32768\nstore R1, 0xFFFF(R0)\njump 65535\n";
+    asm_program_t program;
+    memset(&program, 0, sizeof(program));
+    int ok = asm_assemble(fits, strlen(fits), &program) == 0 && program.count == 4 &&
+             (program.words[0] & 0xFFFF) == 0xFFFF && (program.words[1] & 0xFFFF) == 0x8000;
+    printf("16-bit immediates: %s\n", ok ? "accepted" : "NOT accepted");
+    failures += !ok;
+    asm_program_free(&program);
+    return failures;
 }
 
 int main(int argc, char const *argv[]) {
-    if (argc != 3) {
-        printf("Usage: %s <input.asm> <output.bin>\n", argv[0]);
+    if (argc == 2 && strcmp(argv[1], "--check") == 0) return self_check() ? 1 : 0;
+    int listing = argc == 4 && strcmp(argv[1], "-l") == 0;
+    if (argc != 3 && !listing) {
+        printf("Usage: %s [-l] <input.asm> <output.bin>\n", argv[0]);
+        printf("       %s --check\n", argv[0]);
+        return 1;
+    }
+    const char* input_file = argv[argc - 2];
+    const char* output_file = argv[argc - 1];
+
+    printf("Compiling %s to %s...\n", input_file, output_file);
+    size_t length;
+    char* source = read_source(input_file, &length);
+    if (!source) return 1;
+    asm_program_t program;
+    int errors = asm_assemble(source, length, &program);
+    if (errors) {
+        printf("Compilation failed with %d error%s.\n", errors, errors == 1 ? "" : "s");
+        asm_program_free(&program);
+        free(source);
+        return 1;
+    }
+    if (listing) {
+        // Print each word next to its source line
+        const char* line = source;
+        int line_number = 1;
+        for (int i = 0; i < program.count; i++) {
+            for (; line_number < program.lines[i]; line_number++) line = strchr(line, '\n') + 1;
+            int line_length = (int)strcspn(line, "\r\n");
+            printf("0x%04X: 0x%08X  ; %.*s\n", i, program.words[i], line_length, line);
+        }
+    }
+    free(source);
+
+    // Write binary output
+    FILE* output = fopen(output_file, "wb");
+    if (!output || fwrite(program.words, sizeof(uint32_t), program.count, output) != (size_t)program.count) {
+        printf("Error: Cannot create output file %s\n", output_file);
+        if (output) fclose(output);
+        asm_program_free(&program);
         return 1;
     }
-    
-    printf("Compiling %s to %s...\n", argv[1], argv[2]);
-    compile_file(argv[1], argv[2]);
-    printf("Compilation complete. Generated %d instructions.\n", instruction_count);
-    
+    fclose(output);
+    printf("Compilation complete. Generated %d instructions.\n", program.count);
+    asm_program_free(&program);
     return 0;
 }
+#endif
@@ -0,0 +1,39 @@
+#ifndef ASSEMBLER_H
+#define ASSEMBLER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Instruction opcodes
+#define OP_ADD      0b010000    // 010000 (R-Type)
+#define OP_LOAD     0b100000    // 100000 (I-Type)
+#define OP_STORE    0b100001    // 100001 (I-Type)
+#define OP_ADDI     0b100010    // 100010 (I-Type)
+#define OP_SUBI     0b100011    // 100011 (I-Type)
+#define OP_BEQ      0b100100    // 100100 (I-Type)
+#define OP_BGE      0b100101    // 100101 (I-Type)
+#define OP_JUMP     0b110000    // 110000 (J-Type)
+#define OP_END      0b000000    // 000000 (Special Type)
+
+// Program memory is addressed with 16 bits
+#define ASM_MAX_INSTRUCTIONS 65536
+
+// Assembled program. words and lines grow as needed and are released by
+// asm_program_free().
+typedef struct {
+    uint32_t* words;
+    int* lines;             // source line of each word
+    int count;
+    int capacity;           // of words
+    int line_capacity;      // of lines
+} asm_program_t;
+
+int asm_assemble(const char* source, size_t length, asm_program_t* program);
+int asm_assemble_file(const char* path, asm_program_t* program);
+void asm_program_free(asm_program_t* program);
+
+uint32_t encode_r_type(uint8_t opcode, uint8_t rd, uint8_t rs1, uint8_t rs2);
+uint32_t encode_i_type(uint8_t opcode, uint8_t rs, uint8_t rt, uint16_t immediate);
+uint32_t encode_j_type(uint8_t opcode, uint16_t address);
+
+#endif
@@ -1,43 +1,312 @@
+#include <ctype.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image.h"
+
+// Writes memory images for Chisel's loadMemoryFromFile: one 32-bit word per
+// line, as binary digits (MemoryLoadFileType.Binary) or 8 hex digits
+// (MemoryLoadFileType.Hex). The input is an assembled program, a BMP/PGM/PBM
+// image, or one of the arrays in Images.scala given as Images.scala:name
+// (comments inside the array are skipped). --check converts every array of
+// a Scala file, to catch one the parser cannot read.
+// Images are stored one pixel per word, rows one after the other, the layout
+// CPUTopTester pokes into DataMemory.
+//
+// Build: gcc -O2 -o bindump asm/bindump.c asm/image.c
+
+#define MEMORY_WORDS    65536
+#define OUTPUT_BUFFER   (1 << 16)
+
+typedef enum {
+    FORMAT_BIN,
+    FORMAT_HEX
+} format_t;
+
+// Text of every byte value, so a word is formatted with four table lookups
+static char bin_digits[256][8];
+static char hex_digits[256][2];
+
+static void init_tables(void) {
+    static const char hex[] = "0123456789abcdef";
+    for (int v = 0; v < 256; v++) {
+        for (int i = 0; i < 8; i++) bin_digits[v][i] = '0' + ((v >> (7 - i)) & 1);
+        hex_digits[v][0] = hex[v >> 4];
+        hex_digits[v][1] = hex[v & 15];
+    }
+}
+
+typedef struct {
+    FILE* file;
+    char data[OUTPUT_BUFFER];
+    size_t used;
+    int failed;
+} writer_t;
+
+static void flush_writer(writer_t* out) {
+    if (out->used && fwrite(out->data, 1, out->used, out->file) != out->used) out->failed = 1;
+    out->used = 0;
+}
+
+static void write_word(writer_t* out, format_t format, uint32_t word) {
+    if (out->used + 33 > OUTPUT_BUFFER) flush_writer(out);
+    char* p = out->data + out->used;
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        unsigned byte = (word >> shift) & 0xFF;
+        if (format == FORMAT_BIN) {
+            memcpy(p, bin_digits[byte], 8);
+            p += 8;
+        } else {
+            memcpy(p, hex_digits[byte], 2);
+            p += 2;
+        }
+    }
+    *p++ = '\n';
+    out->used = p - out->data;
+}
+
+static char* read_file(const char* path, size_t* size) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        printf("Error: Cannot open input file %s\n", path);
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* data = length >= 0 ? malloc((size_t)length + 1) : NULL;
+    if (!data || fread(data, 1, (size_t)length, file) != (size_t)length) {
+        printf("Error: Cannot read input file %s\n", path);
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+    data[length] = '\0';
+    *size = (size_t)length;
+    return data;
+}
+
+// Assembled program: raw little-endian words as written by the assembler
+static uint32_t* load_program(const char* path, int* count) {
+    size_t size;
+    char* data = read_file(path, &size);
+    if (!data) return NULL;
+    if (size % 4 != 0) printf("Warning: %s ends with a partial word, ignored\n", path);
+    *count = (int)(size / 4);
+    uint32_t* words = malloc((*count + 1) * sizeof(uint32_t));
+    if (words) {
+        for (int i = 0; i < *count; i++) {
+            const unsigned char* p = (const unsigned char*)data + 4 * i;
+            words[i] = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+        }
+    }
+    free(data);
+    return words;
+}
+
+static uint32_t* load_image(const char* path, int* count) {
+    image_t img;
+    if (image_map(&img, path, 0)) return NULL;
+    uint32_t* words = NULL;
+    if (img.channels != 1) {
+        printf("Error: %s is not a grayscale image\n", path);
+    } else if ((words = malloc(((size_t)img.rows * img.cols + 1) * sizeof(uint32_t)))) {
+        *count = img.rows * img.cols;
+        for (int x = 0; x < img.rows; x++) {
+            const unsigned char* row = img.data + x * img.stride;
+            for (int y = 0; y < img.cols; y++) words[x * img.cols + y] = row[y];
+        }
+    }
+    image_free(&img);
+    return words;
+}
+
+// Skip blanks, separators and // or /* */ comments
+static const char* skip_scala_space(const char* p) {
+    for (;;) {
+        if (*p == ',' || *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+            p++;
+        } else if (p[0] == '/' && p[1] == '/') {
+            while (*p && *p != '\n') p++;
+        } else if (p[0] == '/' && p[1] == '*') {
+            const char* close = strstr(p + 2, "*/");
+            p = close ? close + 2 : p + strlen(p);
+        } else {
+            return p;
+        }
+    }
+}
+
+// Elements of an array literal, from just after "Array("
+static uint32_t* parse_scala_array(const char* p, const char* name, int* count) {
+    int capacity = 1024;
+    uint32_t* words = malloc(capacity * sizeof(uint32_t));
+    *count = 0;
+    while (words) {
+        p = skip_scala_space(p);
+        if (*p == ')') break;
+        char* end;
+        long value = strtol(p, &end, 0);
+        if (end == p) {
+            if (*p) printf("Error: Unexpected '%c' in array %s\n", *p, name);
+            else printf("Error: Array %s is not closed\n", name);
+            free(words);
+            *count = 0;
+            return NULL;
+        }
+        if (*count == capacity) {
+            capacity *= 2;
+            uint32_t* grown = realloc(words, capacity * sizeof(uint32_t));
+            if (!grown) free(words);
+            words = grown;
+            if (!words) break;
+        }
+        words[(*count)++] = (uint32_t)value;
+        p = end;
+    }
+    return words;
+}
+
+// "val <name> = Array(...)" in a Scala source
+static uint32_t* load_scala_array(const char* path, const char* name, int* count) {
+    size_t size;
+    char* source = read_file(path, &size);
+    if (!source) return NULL;
+
+    size_t name_length = strlen(name);
+    char* p = source;
+    while ((p = strstr(p, "val ")) != NULL) {
+        p += 4;
+        while (*p == ' ') p++;
+        if (strncmp(p, name, name_length) == 0 && (p[name_length] == ' ' || p[name_length] == '=')) break;
+    }
+    char* open = p ? strstr(p, "Array(") : NULL;
+    if (!open) {
+        printf("Error: No array %s in %s\n", name, path);
+        free(source);
+        return NULL;
+    }
+    uint32_t* words = parse_scala_array(open + 6, name, count);
+    free(source);
+    return words;
+}
+
+// Convert every "val <name> = Array(" of a Scala source. Returns the number
+// of arrays that fail.
+static int check_scala_arrays(const char* path) {
+    size_t size;
+    char* source = read_file(path, &size);
+    if (!source) return 1;
+    int arrays = 0, failures = 0;
+    for (char* p = source; (p = strstr(p, "val ")) != NULL;) {
+        p += 4;
+        while (*p == ' ') p++;
+        char name[256];
+        int length = 0;
+        while ((isalnum((unsigned char)p[length]) || p[length] == '_') && length < (int)sizeof(name) - 1) {
+            name[length] = p[length];
+            length++;
+        }
+        name[length] = '\0';
+        const char* q = p + length;
+        while (*q == ' ') q++;
+        if (!length || *q != '=') continue;
+        q++;
+        while (*q == ' ') q++;
+        if (strncmp(q, "Array(", 6) != 0) continue;
+
+        int count = 0;
+        uint32_t* words = parse_scala_array(q + 6, name, &count);
+        int ok = words && count > 0 && count <= MEMORY_WORDS;
+        printf("%s: %d words%s\n", name, count, ok ? "" : ", FAILED");
+        failures += !ok;
+        arrays++;
+        free(words);
+    }
+    free(source);
+    if (!arrays) {
+        printf("Error: No arrays in %s\n", path);
+        return 1;
+    }
+    return failures;
+}
 
 int main(int argc, char* argv[]) {
-    if (argc != 3) {
-        printf("Usage: %s <binary_file> <output_txt_file>\n", argv[0]);
+    format_t format = FORMAT_BIN;
+    long pad = 0;
+    const char* paths[2];
+    int path_count = 0;
+
+    if (argc == 3 && strcmp(argv[1], "--check") == 0) return check_scala_arrays(argv[2]) ? 1 : 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--hex") == 0) {
+            format = FORMAT_HEX;
+        } else if (strcmp(argv[i], "--bin") == 0) {
+            format = FORMAT_BIN;
+        } else if (strcmp(argv[i], "--pad") == 0 && i + 1 < argc) {
+            pad = strtol(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--full") == 0) {
+            pad = MEMORY_WORDS;
+        } else if (path_count < 2 && argv[i][0] != '-') {
+            paths[path_count++] = argv[i];
+        } else {
+            path_count = 0;
+            break;
+        }
+    }
+    if (path_count != 2 || pad < 0 || pad > MEMORY_WORDS) {
+        printf("Usage: %s [--hex | --bin] [--pad N | --full] <input> <output_txt_file>\n", argv[0]);
+        printf("  input: program .bin, .bmp/.pgm/.pbm image, or Images.scala:<array name>\n");
+        printf("  --pad N  append zero words up to N words, --full pads to all %d\n", MEMORY_WORDS);
+        printf("       %s --check <file.scala>  converts every array of the file\n", argv[0]);
         return 1;
     }
-    
-    FILE* file = fopen(argv[1], "rb");
-    if (!file) {
-        printf("Error: Cannot open input file %s\n", argv[1]);
+
+    uint32_t* words;
+    int count = 0;
+    const char* input = paths[0];
+    const char* array = strstr(input, ".scala:");
+    if (array) {
+        char* path = strdup(input);
+        path[array - input + 6] = '\0';
+        words = load_scala_array(path, array + 7, &count);
+        free(path);
+    } else if (image_format_from_path(input) != IMAGE_FORMAT_UNKNOWN) {
+        words = load_image(input, &count);
+    } else {
+        words = load_program(input, &count);
+    }
+    if (!words) return 1;
+    if (count > MEMORY_WORDS) {
+        printf("Error: %s has %d words, memories hold %d\n", input, count, MEMORY_WORDS);
+        free(words);
         return 1;
     }
-    
-    FILE* output = fopen(argv[2], "w");
-    if (!output) {
-        printf("Error: Cannot create output file %s\n", argv[2]);
-        fclose(file);
+
+    static writer_t output;
+    output.file = fopen(paths[1], "w");
+    if (!output.file) {
+        printf("Error: Cannot create output file %s\n", paths[1]);
+        free(words);
         return 1;
     }
-    
-    uint32_t instruction;
-    int address = 0;
-    
-    printf("Converting %s to %s...\n", argv[1], argv[2]);
-    
-    while (fread(&instruction, sizeof(uint32_t), 1, file) == 1) {
-        // Write binary representation to file
-        for (int i = 31; i >= 0; i--) {
-            fprintf(output, "%d", (instruction >> i) & 1);
-        }
-        fprintf(output, "\n");
-        
-        address++;
-    }
-    
-    fclose(file);
-    fclose(output);
-    
-    printf("Successfully converted %d instructions to %s\n", address, argv[2]);
+
+    printf("Converting %s to %s...\n", input, paths[1]);
+
+    init_tables();
+    for (int i = 0; i < count; i++) write_word(&output, format, words[i]);
+    for (long i = count; i < pad; i++) write_word(&output, format, 0);
+    flush_writer(&output);
+    if (fclose(output.file) != 0) output.failed = 1;
+    free(words);
+    if (output.failed) {
+        printf("Error: Cannot write output file %s\n", paths[1]);
+        return 1;
+    }
+
+    printf("Successfully converted %d words to %s\n", count > pad ? count : (int)pad, paths[1]);
     return 0;
-}
\ No newline at end of file
+}
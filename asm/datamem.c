@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "datamem.h"
+#include "erode.h"
+#include "image.h"
+
+// Converters between images and the packed DataMemory layouts of datamem.h,
+// and the reference erosion working directly on the packed words.
+//
+// Build: gcc -O2 -DERODE_NO_MAIN -o datamem asm/datamem.c asm/erode*.c asm/image.c -pthread
+
+void datamem_pack(datamem_layout_t layout, int rows, int cols, const unsigned char* pixels, uint32_t* words) {
+    int bits = layout;
+    int per_word = datamem_pixels_per_word(layout);
+    int n = datamem_words_per_row(layout, cols);
+    for (int x = 0; x < rows; x++) {
+        const unsigned char* row = pixels + (size_t)x * cols;
+        uint32_t* out = words + (size_t)x * n;
+        for (int w = 0; w < n; w++) {
+            int first = w * per_word;
+            int count = cols - first < per_word ? cols - first : per_word;
+            uint32_t word = 0;
+            for (int i = 0; i < count; i++) {
+                uint32_t value = bits == 1 ? row[first + i] != 0 : row[first + i];
+                word |= value << (i * bits);
+            }
+            out[w] = word;
+        }
+    }
+}
+
+// Unpacks to one byte per pixel, 1-bit pixels as 0 and 255
+void datamem_unpack(datamem_layout_t layout, int rows, int cols, const uint32_t* words, unsigned char* pixels) {
+    int bits = layout;
+    int per_word = datamem_pixels_per_word(layout);
+    int n = datamem_words_per_row(layout, cols);
+    uint32_t lane = (1u << bits) - 1;
+    for (int x = 0; x < rows; x++) {
+        const uint32_t* row = words + (size_t)x * n;
+        unsigned char* out = pixels + (size_t)x * cols;
+        for (int y = 0; y < cols; y++) {
+            uint32_t value = (row[y / per_word] >> ((y % per_word) * bits)) & lane;
+            out[y] = bits == 1 ? (value ? 255 : 0) : value;
+        }
+    }
+}
+
+// Every lane set to all ones if its pixel is white: a no-op for 1-bit pixels,
+// for 8-bit ones the top bit of each byte is set if the byte is non-zero and
+// then spread over the byte
+static uint32_t white_lanes(datamem_layout_t layout, uint32_t word) {
+    if (layout == DATAMEM_BITS_1) return word;
+    uint32_t nonzero = (((word & 0x7F7F7F7Fu) + 0x7F7F7F7Fu) | word) & 0x80808080u;
+    return (nonzero >> 7) * 0xFF;
+}
+
+// Cross erosion of packed words, the golden model for packed erosion
+// programs. A pixel survives if it and its four neighbours are white: the AND
+// of the words above and below and of the current word shifted by one pixel
+// each way, with the pixel crossing the word boundary taken from the
+// neighbouring word. Survivors are all ones in their lane (255 for 8-bit
+// pixels), border pixels are cleared as in erode(). dst must not alias src.
+void datamem_erode(datamem_layout_t layout, int rows, int cols, const uint32_t* src, uint32_t* dst) {
+    int bits = layout;
+    int per_word = datamem_pixels_per_word(layout);
+    int n = datamem_words_per_row(layout, cols);
+    if (rows <= 0 || n == 0) return;
+
+    uint32_t lane = (1u << bits) - 1;
+    int last_count = cols - (n - 1) * per_word;
+    uint32_t last_mask = last_count * bits < 32 ? (1u << (last_count * bits)) - 1 : ~0u;
+    last_mask &= ~(lane << ((last_count - 1) * bits));     // right border column
+
+    memset(dst, 0, n * sizeof(uint32_t));
+    memset(dst + (size_t)(rows - 1) * n, 0, n * sizeof(uint32_t));
+
+    for (int x = 1; x < rows - 1; x++) {
+        const uint32_t* up = src + (size_t)(x - 1) * n;
+        const uint32_t* cur = up + n;
+        const uint32_t* down = cur + n;
+        uint32_t* out = dst + (size_t)x * n;
+
+        uint32_t carry = 0;         // last pixel of the previous word, the left neighbour of the first
+        uint32_t c = white_lanes(layout, cur[0]);
+        for (int w = 0; w < n; w++) {
+            uint32_t next = w + 1 < n ? white_lanes(layout, cur[w + 1]) : 0;
+            uint32_t left = (c << bits) | carry;
+            uint32_t right = (c >> bits) | (next << (32 - bits));
+            out[w] = c & white_lanes(layout, up[w]) & white_lanes(layout, down[w]) & left & right;
+            carry = c >> (32 - bits);
+            c = next;
+        }
+        out[0] &= ~lane;            // left border column
+        out[n - 1] &= last_mask;
+    }
+}
+
+#ifndef DATAMEM_NO_MAIN
+
+static int parse_size(const char* text, int* rows, int* cols) {
+    return sscanf(text, "%dx%d", rows, cols) == 2 && *rows > 0 && *cols > 0 ? 0 : -1;
+}
+
+// Reads an image as rows * cols bytes in display order
+static unsigned char* load_pixels(const char* path, int* rows, int* cols) {
+    image_t img;
+    if (image_map(&img, path, 0)) return NULL;
+    unsigned char* pixels = NULL;
+    if (img.channels != 1) {
+        printf("Error: %s is not a grayscale image\n", path);
+    } else if ((pixels = malloc((size_t)img.rows * img.cols))) {
+        for (int i = 0; i < img.rows; i++) {
+            int x = img.bottom_up ? img.rows - 1 - i : i;
+            memcpy(pixels + (size_t)i * img.cols, img.data + x * img.stride, img.cols);
+        }
+        *rows = img.rows;
+        *cols = img.cols;
+    }
+    image_free(&img);
+    return pixels;
+}
+
+static int pack_file(datamem_layout_t layout, const char* input, const char* output) {
+    int rows, cols;
+    unsigned char* pixels = load_pixels(input, &rows, &cols);
+    if (!pixels) return 1;
+    long count = datamem_words(layout, rows, cols);
+    if (2 * count > DATAMEM_WORDS) {
+        printf("Warning: %dx%d takes %ld words, input and output do not fit in %d\n", rows, cols, count, DATAMEM_WORDS);
+    }
+    uint32_t* words = malloc(count * sizeof(uint32_t));
+    FILE* file = words ? fopen(output, "wb") : NULL;
+    if (!file) {
+        printf("Error: Cannot create output file %s\n", output);
+        free(words);
+        free(pixels);
+        return 1;
+    }
+    datamem_pack(layout, rows, cols, pixels, words);
+    int failed = fwrite(words, sizeof(uint32_t), count, file) != (size_t)count;
+    failed |= fclose(file) != 0;
+    if (failed) printf("Error: Cannot write output file %s\n", output);
+    else printf("%s: %dx%d, %d-bit pixels, %ld words (output image from word %ld)\n", output, rows, cols, layout, count, count);
+    free(words);
+    free(pixels);
+    return failed;
+}
+
+static int unpack_file(datamem_layout_t layout, int rows, int cols, long offset, const char* input, const char* output) {
+    long count = datamem_words(layout, rows, cols);
+    uint32_t* words = calloc(offset + count, sizeof(uint32_t));
+    FILE* file = words ? fopen(input, "rb") : NULL;
+    if (!file) {
+        printf("Error: Cannot open input file %s\n", input);
+        free(words);
+        return 1;
+    }
+    size_t read = fread(words, sizeof(uint32_t), offset + count, file);
+    fclose(file);
+    if (read < (size_t)(offset + count)) {
+        printf("Warning: %s ends at word %zu, the rest of the image is black\n", input, read);
+    }
+
+    image_t img;
+    int failed = image_alloc(&img, rows, cols, 1, 0);
+    if (!failed) {
+        datamem_unpack(layout, rows, cols, words + offset, img.data);
+        failed = image_save(&img, output);
+        image_free(&img);
+    }
+    free(words);
+    return failed ? 1 : 0;
+}
+
+// Checks the packed erosion against erode() and the pack/unpack round trip
+static int check_image(datamem_layout_t layout, int rows, int cols, unsigned char* pixels, const char* name) {
+    long count = datamem_words(layout, rows, cols);
+    uint32_t* words = malloc(2 * count * sizeof(uint32_t));
+    unsigned char* result = malloc((size_t)rows * cols);
+    if (!words || !result) {
+        printf("Error: Cannot allocate %dx%d image\n", rows, cols);
+        free(words);
+        free(result);
+        return -1;
+    }
+
+    int errors = 0;
+    datamem_pack(layout, rows, cols, pixels, words);
+    datamem_unpack(layout, rows, cols, words, result);
+    for (long i = 0; i < (long)rows * cols; i++) {
+        errors += layout == DATAMEM_BITS_1 ? (result[i] != 0) != (pixels[i] != 0) : result[i] != pixels[i];
+    }
+    if (errors) printf("%s: %d pixels changed by the round trip\n", name, errors);
+
+    datamem_erode(layout, rows, cols, words, words + count);
+    datamem_unpack(layout, rows, cols, words + count, result);
+    erode(rows, cols, 1, (unsigned char (*)[cols])pixels, NULL);
+    int mismatches = 0;
+    for (long i = 0; i < (long)rows * cols; i++) {
+        mismatches += (result[i] != 0) != (pixels[i] != 0) || (result[i] != 0 && result[i] != 255);
+    }
+    if (mismatches) printf("%s: %d pixels differ from erode()\n", name, mismatches);
+
+    free(words);
+    free(result);
+    return errors || mismatches;
+}
+
+static void usage(const char* name) {
+    printf("Usage: %s pack [--bits 1|8] <image> <out.bin>\n", name);
+    printf("       %s unpack [--bits 1|8] [--offset WORDS] RxC <in.bin> <out.pgm|bmp|pbm>\n", name);
+    printf("       %s check [--bits 1|8] [--size RxC] [--cells N] [images...]\n", name);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char* command = argv[1];
+    datamem_layout_t layout = DATAMEM_BITS_1;
+    long offset = 0;
+    int rows = 20, cols = 20, cells = 100;
+    const char* args[3];
+    int arg_count = 0;
+    const char* images[argc];
+    int image_count = 0;
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--bits") == 0 && i + 1 < argc) {
+            int bits = atoi(argv[++i]);
+            if (bits != 1 && bits != 8) {
+                printf("Error: Pixels are 1 or 8 bits, not %s\n", argv[i]);
+                return 1;
+            }
+            layout = (datamem_layout_t)bits;
+        } else if (strcmp(argv[i], "--offset") == 0 && i + 1 < argc) {
+            offset = strtol(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            if (parse_size(argv[++i], &rows, &cols)) {
+                printf("Error: Invalid image size %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--cells") == 0 && i + 1 < argc) {
+            cells = atoi(argv[++i]);
+        } else if (strcmp(command, "check") == 0) {
+            images[image_count++] = argv[i];
+        } else if (arg_count < 3) {
+            args[arg_count++] = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (strcmp(command, "pack") == 0 && arg_count == 2) {
+        return pack_file(layout, args[0], args[1]);
+    }
+    if (strcmp(command, "unpack") == 0 && arg_count == 3) {
+        if (parse_size(args[0], &rows, &cols) || offset < 0) {
+            printf("Error: Invalid image size %s\n", args[0]);
+            return 1;
+        }
+        return unpack_file(layout, rows, cols, offset, args[1], args[2]);
+    }
+    if (strcmp(command, "check") != 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int failed = 0, checked = 0;
+    for (int i = 0; i < image_count; i++) {
+        int image_rows, image_cols;
+        unsigned char* pixels = load_pixels(images[i], &image_rows, &image_cols);
+        if (!pixels) return 1;
+        failed += check_image(layout, image_rows, image_cols, pixels, images[i]) != 0;
+        checked++;
+        free(pixels);
+    }
+    if (image_count == 0) {
+        unsigned char* pixels = malloc((size_t)rows * cols);
+        for (int c = 0; c < cells && pixels; c++) {
+            char name[32];
+            snprintf(name, sizeof(name), "cells %d", c);
+            fill_cells(rows, cols, (unsigned char (*)[cols])pixels, 1 + rows * cols / 2250, c + 1);
+            failed += check_image(layout, rows, cols, pixels, name) != 0;
+            checked++;
+        }
+        free(pixels);
+    }
+
+    long count = datamem_words(layout, rows, cols);
+    int per_word = datamem_pixels_per_word(layout);
+    printf("%d-bit pixels: %d per word, a %dx%d image takes %ld words (%ld with one pixel per word)\n", layout,
+           per_word, rows, cols, count, (long)rows * cols);
+    int side = 1;
+    while (2 * datamem_words(layout, side + 1, side + 1) <= DATAMEM_WORDS) side++;
+    printf("Largest square image with its output in %d words: %dx%d\n", DATAMEM_WORDS, side, side);
+    printf("%d of %d images match erode()\n", checked - failed, checked);
+    return failed ? 1 : 0;
+}
+#endif
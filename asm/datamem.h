@@ -0,0 +1,51 @@
+#ifndef DATAMEM_H
+#define DATAMEM_H
+
+#include <stdint.h>
+
+// Packed DataMemory layouts. The memory is 65536 words of 32 bits; the
+// original programs store one pixel per word. The packed layouts store
+// 32 pixels (1 bit each) or 4 pixels (8 bits each) per word:
+//
+// - rows are stored one after the other, row x starting at word
+//   x * words_per_row, and every row starts on a word boundary, so the
+//   neighbouring rows of a word are always words_per_row words away
+// - pixel y of a row is in word y / pixels_per_word, at bit
+//   (y % pixels_per_word) * bits, i.e. the first pixel in the least
+//   significant bits as in little-endian byte order
+// - 1 bit: 1 = white (255), 0 = black. 8 bits: the pixel value, 0 or 255
+//   for binary images; any non-zero value counts as white
+// - padding pixels after the last one in a row are 0
+// - the eroded image is stored in the same layout right after the input,
+//   from word datamem_words() on
+//
+// A 1-bit image and its erosion fit in memory up to 32768 words each, i.e.
+// about a million pixels (1024 x 1024), 16 times the 65536 of the one pixel
+// per word layout (including its output); 8-bit images fit up to 131072
+// pixels.
+
+typedef enum {
+    DATAMEM_BITS_1 = 1,     // 32 pixels per word
+    DATAMEM_BITS_8 = 8      // 4 pixels per word
+} datamem_layout_t;
+
+#define DATAMEM_WORDS   65536
+
+static inline int datamem_pixels_per_word(datamem_layout_t layout) {
+    return 32 / layout;
+}
+
+static inline int datamem_words_per_row(datamem_layout_t layout, int cols) {
+    return (cols + datamem_pixels_per_word(layout) - 1) / datamem_pixels_per_word(layout);
+}
+
+// Words taken by one rows x cols image
+static inline long datamem_words(datamem_layout_t layout, int rows, int cols) {
+    return (long)rows * datamem_words_per_row(layout, cols);
+}
+
+void datamem_pack(datamem_layout_t layout, int rows, int cols, const unsigned char* pixels, uint32_t* words);
+void datamem_unpack(datamem_layout_t layout, int rows, int cols, const uint32_t* words, unsigned char* pixels);
+void datamem_erode(datamem_layout_t layout, int rows, int cols, const uint32_t* src, uint32_t* dst);
+
+#endif
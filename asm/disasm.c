@@ -1,7 +1,24 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
+// Disassembler and static analyser for CPUTop programs.
+//
+// With --analyse the program is split into basic blocks, the control-flow
+// graph and its loops are built from the BEQ/BGE/JUMP targets, and cycle
+// bounds are derived for an all-black image (every check exits early, the
+// best case) and an all-white one (every check passes, the worst case).
+//
+// The bounds come from an abstract run in which every LOAD yields the pixel
+// value of the case, so all branches are decided by register values. Loops
+// are not stepped through: once two consecutive iterations of a loop take the
+// same path with the same register increments, each compared register pair
+// changes by a fixed amount per iteration, and the number of iterations until
+// the first branch changes direction is solved for directly from the loop
+// bounds, then skipped. Nested loops are summarised the same way from the
+// inside out, so the cost is independent of the image size.
+
 // Instruction opcodes
 #define OP_ADD      0b010000
 #define OP_LOAD     0b100000
@@ -13,6 +30,10 @@
 #define OP_JUMP     0b110000
 #define OP_END      0b000000
 
+#define REGISTERS       8
+#define MAX_STEPS       100000000ull    // instructions run one by one before giving up
+#define NEVER           UINT64_MAX
+
 const char* get_opcode_name(uint8_t opcode) {
     switch(opcode) {
         case OP_ADD:  return "ADD";
@@ -30,9 +51,9 @@ const char* get_opcode_name(uint8_t opcode) {
 
 void disassemble_instruction(uint32_t instr, int address) {
     uint8_t opcode = (instr >> 26) & 0x3F;
-    
+
     printf("0x%04X: 0x%08X  ", address, instr);
-    
+
     switch(opcode) {
         case OP_ADD: {
             uint8_t rd = (instr >> 21) & 0x1F;
@@ -46,43 +67,44 @@ void disassemble_instruction(uint32_t instr, int address) {
         case OP_LOAD: {
             uint8_t rs = (instr >> 21) & 0x1F;
             uint8_t rt = (instr >> 16) & 0x1F;
-            uint16_t imm = instr & 0xFFFF;
+            int16_t imm = (int16_t)(instr & 0xFFFF);
             printf("LOAD $r%d, %d($r%d)", rt, imm, rs);
             break;
         }
         case OP_STORE: {
             uint8_t rs = (instr >> 21) & 0x1F;
             uint8_t rt = (instr >> 16) & 0x1F;
-            uint16_t imm = instr & 0xFFFF;
+            int16_t imm = (int16_t)(instr & 0xFFFF);
             printf("STORE $r%d, %d($r%d)", rt, imm, rs);
             break;
         }
         case OP_ADDI: {
             uint8_t rs = (instr >> 21) & 0x1F;
             uint8_t rt = (instr >> 16) & 0x1F;
-            uint16_t imm = instr & 0xFFFF;
+            int16_t imm = (int16_t)(instr & 0xFFFF);
             printf("ADDI $r%d, $r%d, %d", rt, rs, imm);
             break;
         }
         case OP_SUBI: {
             uint8_t rs = (instr >> 21) & 0x1F;
             uint8_t rt = (instr >> 16) & 0x1F;
-            uint16_t imm = instr & 0xFFFF;
+            int16_t imm = (int16_t)(instr & 0xFFFF);
             printf("SUBI $r%d, $r%d, %d", rt, rs, imm);
             break;
         }
         case OP_BEQ: {
+            // Branch targets are absolute, CPUTop loads the immediate into the PC
             uint8_t rs = (instr >> 21) & 0x1F;
             uint8_t rt = (instr >> 16) & 0x1F;
-            int16_t offset = (int16_t)(instr & 0xFFFF);
-            printf("BEQ  $r%d, $r%d, %d (-> 0x%04X)", rs, rt, offset, address + 1 + offset);
+            uint16_t target = instr & 0xFFFF;
+            printf("BEQ  $r%d, $r%d, %d (-> 0x%04X)", rs, rt, target, target);
             break;
         }
         case OP_BGE: {
             uint8_t rs = (instr >> 21) & 0x1F;
             uint8_t rt = (instr >> 16) & 0x1F;
-            int16_t offset = (int16_t)(instr & 0xFFFF);
-            printf("BGE  $r%d, $r%d, %d (-> 0x%04X)", rs, rt, offset, address + 1 + offset);
+            uint16_t target = instr & 0xFFFF;
+            printf("BGE  $r%d, $r%d, %d (-> 0x%04X)", rs, rt, target, target);
             break;
         }
         case OP_JUMP: {
@@ -102,29 +124,604 @@ void disassemble_instruction(uint32_t instr, int address) {
     printf("\n");
 }
 
+// Basic block [first, end) and its successors; -1 is the implicit END past
+// the program
+typedef struct {
+    int first;
+    int end;
+    int succ[2];
+    int succ_count;
+    int loop_depth;
+} block_t;
+
+// Loop around a retreating edge of the depth-first search
+typedef struct {
+    int header;             // block
+    unsigned char* body;    // block membership
+    int parent;             // innermost enclosing loop, -1 at top level
+} loop_t;
+
+typedef struct {
+    const uint32_t* code;
+    int count;
+    int* block_of;          // block of each instruction
+    block_t* blocks;
+    int block_count;
+    loop_t* loops;
+    int loop_count;
+    int* loop_of_header;    // loop index of a header block, else -1
+} program_t;
+
+static int opcode_of(uint32_t instr) {
+    return (instr >> 26) & 0x3F;
+}
+
+static int is_control(uint32_t instr) {
+    int op = opcode_of(instr);
+    return op == OP_BEQ || op == OP_BGE || op == OP_JUMP || op == OP_END;
+}
+
+static int target_block(const program_t* prog, uint32_t instr) {
+    int target = instr & 0xFFFF;
+    return target < prog->count ? prog->block_of[target] : -1;
+}
+
+static int build_blocks(program_t* prog) {
+    int count = prog->count;
+    unsigned char* leader = calloc(count + 1, 1);
+    prog->block_of = malloc((count + 1) * sizeof(int));
+    if (!leader || !prog->block_of) return -1;
+
+    leader[0] = 1;
+    for (int pc = 0; pc < count; pc++) {
+        uint32_t instr = prog->code[pc];
+        int op = opcode_of(instr);
+        if (op == OP_BEQ || op == OP_BGE || op == OP_JUMP) {
+            int target = instr & 0xFFFF;
+            if (target < count) leader[target] = 1;
+        }
+        if (is_control(instr)) leader[pc + 1] = 1;
+    }
+
+    prog->block_count = 0;
+    for (int pc = 0; pc < count; pc++) prog->block_count += leader[pc];
+    prog->blocks = calloc(prog->block_count, sizeof(block_t));
+    if (!prog->blocks) return -1;
+    int b = -1;
+    for (int pc = 0; pc < count; pc++) {
+        if (leader[pc]) prog->blocks[++b].first = pc;
+        prog->block_of[pc] = b;
+        prog->blocks[b].end = pc + 1;
+    }
+    free(leader);
+
+    for (b = 0; b < prog->block_count; b++) {
+        block_t* block = &prog->blocks[b];
+        uint32_t last = prog->code[block->end - 1];
+        int op = opcode_of(last);
+        int next = block->end < count ? prog->block_of[block->end] : -1;
+        if (op == OP_JUMP) {
+            block->succ[block->succ_count++] = target_block(prog, last);
+        } else if (op == OP_BEQ || op == OP_BGE) {
+            block->succ[block->succ_count++] = next;
+            int taken = target_block(prog, last);
+            if (taken != next) block->succ[block->succ_count++] = taken;
+        } else if (op != OP_END) {
+            block->succ[block->succ_count++] = next;
+        }
+    }
+    return 0;
+}
+
+// Depth-first search from the entry; every edge to a block still on the
+// stack closes a loop. The loop body is everything that reaches the edge's
+// source without going through the header.
+static int find_loops(program_t* prog) {
+    int n = prog->block_count;
+    int* state = calloc(n, sizeof(int));          // 0 new, 1 on stack, 2 done
+    int* stack = malloc(n * sizeof(int));
+    int* edge = calloc(n, sizeof(int));
+    int* work = malloc(n * sizeof(int));
+    prog->loop_of_header = malloc(n * sizeof(int));
+    if (!state || !stack || !edge || !work || !prog->loop_of_header) return -1;
+    for (int b = 0; b < n; b++) prog->loop_of_header[b] = -1;
+
+    int depth = 0;
+    if (n > 0) {
+        stack[depth++] = 0;
+        state[0] = 1;
+    }
+    while (depth > 0) {
+        int b = stack[depth - 1];
+        block_t* block = &prog->blocks[b];
+        if (edge[b] == block->succ_count) {
+            state[b] = 2;
+            depth--;
+            continue;
+        }
+        int s = block->succ[edge[b]++];
+        if (s < 0) continue;
+        if (state[s] == 0) {
+            state[s] = 1;
+            stack[depth++] = s;
+            continue;
+        }
+        if (state[s] != 1) continue;
+
+        // Retreating edge b -> s: add b's part of the loop around header s
+        int l = prog->loop_of_header[s];
+        if (l < 0) {
+            loop_t* loops = realloc(prog->loops, (prog->loop_count + 1) * sizeof(loop_t));
+            if (!loops) return -1;
+            prog->loops = loops;
+            l = prog->loop_count++;
+            prog->loops[l].header = s;
+            prog->loops[l].parent = -1;
+            prog->loops[l].body = calloc(n, 1);
+            if (!prog->loops[l].body) return -1;
+            prog->loops[l].body[s] = 1;
+            prog->loop_of_header[s] = l;
+        }
+        unsigned char* body = prog->loops[l].body;
+        int top = 0;
+        if (!body[b]) {
+            body[b] = 1;
+            work[top++] = b;
+        }
+        while (top > 0) {
+            int x = work[--top];
+            for (int p = 0; p < n; p++) {
+                for (int i = 0; i < prog->blocks[p].succ_count; i++) {
+                    if (prog->blocks[p].succ[i] == x && !body[p]) {
+                        body[p] = 1;
+                        work[top++] = p;
+                    }
+                }
+            }
+        }
+    }
+
+    // Nesting: the parent is the smallest larger loop containing the header.
+    // Irreducible loops can contain each other's headers; the larger one is
+    // then taken as the outer loop.
+    int* size = calloc(prog->loop_count + 1, sizeof(int));
+    if (!size) return -1;
+    for (int l = 0; l < prog->loop_count; l++) {
+        for (int b = 0; b < n; b++) size[l] += prog->loops[l].body[b];
+    }
+    for (int l = 0; l < prog->loop_count; l++) {
+        int best_size = n + 1;
+        for (int o = 0; o < prog->loop_count; o++) {
+            if (o == l || !prog->loops[o].body[prog->loops[l].header]) continue;
+            if (size[o] < size[l] || (size[o] == size[l] && o > l)) continue;
+            if (size[o] < best_size) {
+                best_size = size[o];
+                prog->loops[l].parent = o;
+            }
+        }
+        for (int b = 0; b < n; b++) prog->blocks[b].loop_depth += prog->loops[l].body[b];
+    }
+    free(size);
+    free(state);
+    free(stack);
+    free(edge);
+    free(work);
+    return 0;
+}
+
+// Conditional branch taken during the abstract run: `diff` is rs - rt as
+// signed values. Accelerated inner loops are logged as events too, with the
+// number of skipped iterations in diff.
+typedef struct {
+    int pc;                 // -1 - loop index for a skipped run of iterations
+    int taken;
+    int depth;              // loop nesting when logged
+    int64_t diff;
+} event_t;
+
+typedef struct {
+    event_t* items;
+    size_t count;
+    size_t capacity;
+} event_log_t;
+
+static int log_push(event_log_t* log, event_t event) {
+    if (log->count == log->capacity) {
+        size_t capacity = log->capacity ? 2 * log->capacity : 1024;
+        event_t* items = realloc(log->items, capacity * sizeof(event_t));
+        if (!items) return -1;
+        log->items = items;
+        log->capacity = capacity;
+    }
+    log->items[log->count++] = event;
+    return 0;
+}
+
+// An active loop of the abstract run
+typedef struct {
+    int loop;
+    size_t log_start;       // events of the current iteration start here
+    uint64_t cycles_start;
+    int32_t regs_start[REGISTERS];
+    int have_prev;          // previous iteration recorded
+    event_log_t prev;
+    uint64_t prev_cycles;
+    int32_t prev_delta[REGISTERS];
+} frame_t;
+
+// Per loop results of one case
+typedef struct {
+    uint64_t entries;
+    uint64_t iterations;
+    uint64_t min_cycles;    // cycles per iteration
+    uint64_t max_cycles;
+    uint64_t skipped;       // iterations solved for instead of run
+    int limit_pc;           // branch that ended the last skipped run
+    int32_t limit_step;     // change of its compared difference per iteration
+} loop_stats_t;
+
+typedef struct {
+    uint64_t cycles;
+    uint64_t steps;         // instructions actually run
+    int halted;
+    loop_stats_t* loops;
+} run_result_t;
+
+// First iteration t >= 1 at which a branch with difference diff + t * step
+// goes the other way, or NEVER
+static uint64_t flip_after(int op, int taken, int64_t diff, int64_t step) {
+    if (step == 0) return NEVER;
+    if (op == OP_BEQ) {
+        if (taken) return 1;
+        if ((-diff) % step != 0 || (-diff) / step <= 0) return NEVER;
+        return (uint64_t)((-diff) / step);
+    }
+    if (taken) {
+        // diff >= 0 until diff + t * step < 0
+        if (step > 0) return NEVER;
+        return (uint64_t)(diff / -step) + 1;
+    }
+    if (step < 0) return NEVER;
+    return (uint64_t)((-diff + step - 1) / step);
+}
+
+// Compare the iteration that just ended with the previous one and return
+// how many further iterations are known to repeat it (0 if none)
+static uint64_t repeat_count(const program_t* prog, const frame_t* frame, const event_t* events, size_t count,
+                             uint64_t cycles, const int32_t* delta, int depth, int* limit_pc, int64_t* limit_step) {
+    if (!frame->have_prev || frame->prev.count != count || frame->prev_cycles != cycles) return 0;
+    if (memcmp(frame->prev_delta, delta, sizeof(frame->prev_delta)) != 0) return 0;
+
+    int inner_skips = 0;
+    for (size_t i = 0; i < count; i++) {
+        const event_t* a = &frame->prev.items[i];
+        const event_t* b = &events[i];
+        if (a->pc != b->pc || a->taken != b->taken) return 0;
+        if (b->pc < 0) {
+            if (a->diff != b->diff) return 0;
+            inner_skips = 1;
+        }
+    }
+
+    uint64_t repeat = NEVER;
+    for (size_t i = 0; i < count; i++) {
+        const event_t* b = &events[i];
+        if (b->pc < 0) continue;
+        int64_t step = b->diff - frame->prev.items[i].diff;
+        // Skipped inner iterations are only the same if their bounds did not move
+        if (inner_skips && b->depth > depth && step != 0) return 0;
+        uint64_t t = flip_after(opcode_of(prog->code[b->pc]), b->taken, b->diff, step);
+        if (t != NEVER && t - 1 < repeat) {
+            repeat = t - 1;
+            *limit_pc = b->pc;
+            *limit_step = step;
+        }
+    }
+    return repeat;
+}
+
+// Run the program with every LOAD returning `pixel`. Returns -1 on
+// allocation failure; result->halted is 0 if the run did not terminate.
+static int abstract_run(const program_t* prog, int32_t pixel, run_result_t* result) {
+    int32_t regs[REGISTERS] = {0};
+    event_log_t log = {NULL, 0, 0};
+    frame_t* frames = calloc(prog->loop_count + 1, sizeof(frame_t));
+    result->loops = calloc(prog->loop_count + 1, sizeof(loop_stats_t));
+    if (!frames || !result->loops) return -1;
+    for (int l = 0; l < prog->loop_count; l++) result->loops[l].min_cycles = NEVER;
+    int depth = 0;
+    uint64_t cycles = 0, steps = 0;
+    int pc = 0, status = 0;
+    result->halted = 0;
+
+#define READ(r) ((r) == 0 ? 0 : regs[(r) % REGISTERS])
+#define WRITE(r, v) do { if ((r) != 0) regs[(r) % REGISTERS] = (v); } while (0)
+
+    while (steps < MAX_STEPS && status == 0) {
+        if (pc >= prog->count) {
+            result->halted = 1;     // program memory past the end reads as END
+            break;
+        }
+        int b = prog->block_of[pc];
+        int l = prog->blocks[b].first == pc ? prog->loop_of_header[b] : -1;
+        if (l >= 0) {
+            // Loops left since the last arrival are finished, and so are the
+            // ones entered after l if l is active further down
+            int active = 0;
+            for (int f = 0; f < depth; f++) active |= frames[f].loop == l;
+            while (depth > 0 && frames[depth - 1].loop != l && (active || !prog->loops[frames[depth - 1].loop].body[b])) {
+                frame_t* done = &frames[--depth];
+                free(done->prev.items);
+                memset(&done->prev, 0, sizeof(done->prev));
+            }
+            if (depth > 0 && frames[depth - 1].loop == l) {
+                // One more iteration of an active loop
+                frame_t* frame = &frames[depth - 1];
+                loop_stats_t* stats = &result->loops[l];
+                uint64_t iteration_cycles = cycles - frame->cycles_start;
+                int32_t delta[REGISTERS];
+                for (int r = 0; r < REGISTERS; r++) delta[r] = regs[r] - frame->regs_start[r];
+                stats->iterations++;
+                if (iteration_cycles < stats->min_cycles) stats->min_cycles = iteration_cycles;
+                if (iteration_cycles > stats->max_cycles) stats->max_cycles = iteration_cycles;
+
+                const event_t* events = log.items + frame->log_start;
+                size_t count = log.count - frame->log_start;
+                int limit_pc = -1;
+                int64_t limit_step = 0;
+                uint64_t repeat = repeat_count(prog, frame, events, count, iteration_cycles, delta, depth, &limit_pc, &limit_step);
+                if (repeat == NEVER) break;     // the loop never exits
+                if (repeat > 0) {
+                    for (int r = 0; r < REGISTERS; r++) regs[r] += (int32_t)((int64_t)delta[r] * (int64_t)repeat);
+                    cycles += repeat * iteration_cycles;
+                    stats->iterations += repeat;
+                    stats->skipped += repeat;
+                    stats->limit_pc = limit_pc;
+                    stats->limit_step = (int32_t)limit_step;
+                    frame->have_prev = 0;
+                    log.count = frame->log_start;
+                    event_t skip = {-1 - l, 1, depth, (int64_t)repeat};
+                    if (depth > 1 && log_push(&log, skip)) status = -1;
+                } else {
+                    // Keep this iteration to compare the next one against
+                    frame->prev.count = 0;
+                    for (size_t i = 0; i < count && status == 0; i++) status = log_push(&frame->prev, events[i]);
+                    frame->prev_cycles = iteration_cycles;
+                    memcpy(frame->prev_delta, delta, sizeof(delta));
+                    frame->have_prev = 1;
+                    // Events are only kept while an enclosing loop needs them
+                    if (depth == 1) log.count = 0;
+                }
+                frame->log_start = log.count;
+                frame->cycles_start = cycles;
+                memcpy(frame->regs_start, regs, sizeof(regs));
+            } else {
+                // Entering the loop
+                frame_t* frame = &frames[depth++];
+                frame->loop = l;
+                frame->log_start = log.count;
+                frame->cycles_start = cycles;
+                memcpy(frame->regs_start, regs, sizeof(regs));
+                frame->have_prev = 0;
+                frame->prev.count = 0;
+                result->loops[l].entries++;
+            }
+        }
+
+        uint32_t instr = prog->code[pc];
+        int op = opcode_of(instr);
+        int rs = (instr >> 21) & 0x1F;
+        int rt = (instr >> 16) & 0x1F;
+        int32_t imm = (int16_t)(instr & 0xFFFF);
+        int target = instr & 0xFFFF;
+        if (op == OP_END) {
+            result->halted = 1;
+            break;
+        }
+        cycles++;
+        steps++;
+        switch (op) {
+            case OP_LOAD: WRITE(rt, pixel); pc++; break;
+            case OP_ADDI: WRITE(rt, (int32_t)((uint32_t)READ(rs) + (uint32_t)imm)); pc++; break;
+            case OP_SUBI: WRITE(rt, (int32_t)((uint32_t)READ(rs) - (uint32_t)imm)); pc++; break;
+            case OP_JUMP: pc = target; break;
+            case OP_BEQ:
+            case OP_BGE: {
+                int32_t a = READ(rs), c = READ(rt);
+                int taken = op == OP_BEQ ? a == c : a >= c;
+                if (depth > 0) {
+                    event_t event = {pc, taken, depth, (int64_t)a - c};
+                    status = log_push(&log, event);
+                }
+                pc = taken ? target : pc + 1;
+                break;
+            }
+            default: pc++; break;   // STORE and undecoded opcodes change no register
+        }
+    }
+#undef READ
+#undef WRITE
+
+    result->cycles = cycles ? cycles : 1;
+    result->steps = steps;
+    for (int i = 0; i < prog->loop_count; i++) free(frames[i].prev.items);
+    free(frames);
+    free(log.items);
+    return status;
+}
+
+static void print_blocks(const program_t* prog) {
+    printf("\nBasic blocks: %d\n", prog->block_count);
+    printf("Block  Range          Insns  LOAD STORE  ALU  BR  JUMP  END  Other  Depth  Successors\n");
+    int total[7] = {0};
+    for (int b = 0; b < prog->block_count; b++) {
+        const block_t* block = &prog->blocks[b];
+        int mix[7] = {0};       // load, store, alu, branch, jump, end, other
+        for (int pc = block->first; pc < block->end; pc++) {
+            switch (opcode_of(prog->code[pc])) {
+                case OP_LOAD:  mix[0]++; break;
+                case OP_STORE: mix[1]++; break;
+                case OP_ADDI:
+                case OP_SUBI:  mix[2]++; break;
+                case OP_BEQ:
+                case OP_BGE:   mix[3]++; break;
+                case OP_JUMP:  mix[4]++; break;
+                case OP_END:   mix[5]++; break;
+                default:       mix[6]++; break;
+            }
+        }
+        printf("B%-5d 0x%04X-0x%04X %5d %5d %5d %4d %3d %5d %4d %6d %6d  ", b, block->first, block->end - 1,
+               block->end - block->first, mix[0], mix[1], mix[2], mix[3], mix[4], mix[5], mix[6], block->loop_depth);
+        if (block->succ_count == 0) printf("-");
+        for (int i = 0; i < block->succ_count; i++) {
+            if (block->succ[i] < 0) printf("%sEND", i ? ", " : "");
+            else printf("%sB%d", i ? ", " : "", block->succ[i]);
+        }
+        printf("\n");
+        for (int i = 0; i < 7; i++) total[i] += mix[i];
+    }
+    printf("Total  %*s %5d %5d %5d %4d %3d %5d %4d %6d\n", 13, "", prog->count, total[0], total[1], total[2],
+           total[3], total[4], total[5], total[6]);
+}
+
+static void print_loop_case(const char* name, const loop_stats_t* stats, const uint32_t* code) {
+    if (stats->entries == 0) {
+        printf("    %-6s not reached\n", name);
+        return;
+    }
+    printf("    %-6s %llu iteration%s", name, (unsigned long long)stats->iterations, stats->iterations == 1 ? "" : "s");
+    if (stats->entries > 1) {
+        printf(" over %llu entries (%.1f per entry)", (unsigned long long)stats->entries,
+               (double)stats->iterations / stats->entries);
+    }
+    if (stats->iterations) {
+        if (stats->min_cycles == stats->max_cycles) printf(", %llu cycles each", (unsigned long long)stats->min_cycles);
+        else printf(", %llu-%llu cycles each", (unsigned long long)stats->min_cycles, (unsigned long long)stats->max_cycles);
+    }
+    printf("\n");
+    if (stats->skipped) {
+        uint32_t instr = code[stats->limit_pc];
+        printf("           exit bound: %s $r%d, $r%d at 0x%04X, difference changes by %d per iteration\n",
+               get_opcode_name(opcode_of(instr)), (instr >> 21) & 0x1F, (instr >> 16) & 0x1F, stats->limit_pc,
+               stats->limit_step);
+    }
+}
+
+// Cycle formula of one case: the time outside loops plus, for each top-level
+// loop, iterations x cycles per iteration
+static void print_formula(const program_t* prog, const char* name, const run_result_t* run) {
+    if (!run->halted) {
+        if (run->steps >= MAX_STEPS) printf("%s: no END within %llu instructions\n", name, (unsigned long long)MAX_STEPS);
+        else printf("%s: does not terminate, a loop repeats without approaching its exit\n", name);
+        return;
+    }
+    printf("%s: %llu cycles", name, (unsigned long long)run->cycles);
+    uint64_t inside = 0;
+    int exact = 1;
+    char terms[1024] = "";
+    size_t length = 0;
+    for (int l = 0; l < prog->loop_count; l++) {
+        const loop_stats_t* stats = &run->loops[l];
+        if (prog->loops[l].parent >= 0 || stats->iterations == 0) continue;
+        if (stats->min_cycles != stats->max_cycles) exact = 0;
+        inside += stats->iterations * stats->min_cycles;
+        if (length < sizeof(terms)) {
+            length += snprintf(terms + length, sizeof(terms) - length, " + %llu x %llu",
+                               (unsigned long long)stats->iterations, (unsigned long long)stats->min_cycles);
+        }
+    }
+    if (exact && inside <= run->cycles && length > 0 && length < sizeof(terms)) {
+        printf(" = %llu%s", (unsigned long long)(run->cycles - inside), terms);
+    }
+    printf("\n");
+}
+
+static int analyse(const uint32_t* code, int count) {
+    program_t prog;
+    memset(&prog, 0, sizeof(prog));
+    prog.code = code;
+    prog.count = count;
+    if (count == 0) {
+        printf("\nEmpty program: 1 cycle\n");
+        return 0;
+    }
+    if (build_blocks(&prog) || find_loops(&prog)) {
+        printf("Error: Cannot allocate the control-flow graph\n");
+        return 1;
+    }
+    print_blocks(&prog);
+
+    run_result_t best, worst;
+    if (abstract_run(&prog, 0, &best) || abstract_run(&prog, 255, &worst)) {
+        printf("Error: Cannot allocate the abstract run\n");
+        return 1;
+    }
+
+    printf("\nLoops: %d\n", prog.loop_count);
+    for (int l = 0; l < prog.loop_count; l++) {
+        const loop_t* loop = &prog.loops[l];
+        int size = 0;
+        for (int b = 0; b < prog.block_count; b++) size += loop->body[b];
+        printf("L%d: header B%d (0x%04X), %d block%s", l, loop->header, prog.blocks[loop->header].first, size,
+               size == 1 ? "" : "s");
+        if (loop->parent >= 0) printf(", inside L%d", loop->parent);
+        printf("\n");
+        print_loop_case("black", &best.loops[l], code);
+        print_loop_case("white", &worst.loops[l], code);
+    }
+
+    printf("\nCycle bounds (each cycle is one instruction on the single-cycle CPU):\n");
+    print_formula(&prog, "Best case, all black", &best);
+    print_formula(&prog, "Worst case, all white", &worst);
+
+    for (int l = 0; l < prog.loop_count; l++) free(prog.loops[l].body);
+    free(prog.loops);
+    free(prog.loop_of_header);
+    free(prog.blocks);
+    free(prog.block_of);
+    free(best.loops);
+    free(worst.loops);
+    return 0;
+}
+
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        printf("Usage: %s <binary_file>\n", argv[0]);
+    int analysis = argc == 3 && (strcmp(argv[1], "--analyse") == 0 || strcmp(argv[1], "-a") == 0);
+    if (argc != 2 && !analysis) {
+        printf("Usage: %s [--analyse] <binary_file>\n", argv[0]);
         return 1;
     }
-    
-    FILE* file = fopen(argv[1], "rb");
+    const char* path = argv[argc - 1];
+
+    FILE* file = fopen(path, "rb");
     if (!file) {
-        printf("Error: Cannot open file %s\n", argv[1]);
+        printf("Error: Cannot open file %s\n", path);
         return 1;
     }
-    
+
+    uint32_t* code = NULL;
+    int count = 0, capacity = 0;
     uint32_t instruction;
-    int address = 0;
-    
-    printf("Disassembly of %s:\n", argv[1]);
+
+    printf("Disassembly of %s:\n", path);
     printf("========================================\n");
-    
+
     while (fread(&instruction, sizeof(uint32_t), 1, file) == 1) {
-        disassemble_instruction(instruction, address);
-        address++;
+        disassemble_instruction(instruction, count);
+        if (count == capacity) {
+            capacity = capacity ? 2 * capacity : 256;
+            uint32_t* grown = realloc(code, capacity * sizeof(uint32_t));
+            if (!grown) {
+                printf("Error: Cannot allocate program\n");
+                fclose(file);
+                return 1;
+            }
+            code = grown;
+        }
+        code[count++] = instruction;
     }
-    
+
     fclose(file);
-    return 0;
-}
\ No newline at end of file
+    int result = analysis ? analyse(code, count) : 0;
+    free(code);
+    return result;
+}
@@ -1,8 +1,32 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "erode.h"
+
+#include "image.h"
+#include "perf.h"
+
+// Hook of erode() for memory-access traces, see erode.h
+erode_trace_fn erode_trace_hook;
+void* erode_trace_context;
+
+#ifdef ERODE_TRACE
+#define ERODE_TRACE_ACCESS(image, x, y, store) \
+    do { \
+        if (erode_trace_hook) erode_trace_hook(erode_trace_context, image, (size_t)(x) * height + (y), store); \
+    } while (0)
+#else
+#define ERODE_TRACE_ACCESS(image, x, y, store) ((void)0)
+#endif
+
+// Size of the generated image used by the self-check
 #define BMP_WIDTH 950
 #define BMP_HEIGTH 950
-#define BMP_CHANNELS 3
 
-void erode (unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS]) {
+void erode (int width, int height, int channels, unsigned char binary_image[width][height], unsigned char bmp_image[width][height][channels]) {
     int se_size = 3;
     int se_center = 1;
     int structuringElement[3][3] = {
@@ -10,50 +34,753 @@ void erode (unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], unsigned char bmp
         {1, 1, 1},
         {0, 1, 0}
     };
-    unsigned char temp_image[BMP_WIDTH][BMP_HEIGTH];
-    for (int x = 0; x < BMP_WIDTH; x++) {
-        for (int y = 0; y < BMP_HEIGTH; y++) {
-            temp_image[x][y] = binary_image[x][y];
-        }
-    }
-    for (int x = 1; x < BMP_WIDTH - 1; x++) {
-        for (int y = 1; y < BMP_HEIGTH - 1; y++) {
-            int erosion_result = 0;
-            if (temp_image[x][y]) {
-                erosion_result = 1;
-                for (int i = 0; i < se_size; i++) {
-                    for (int j = 0; j < se_size; j++) {
-                        if (structuringElement[i][j] == 1) {
-                            int entry_x = x + i - 1;
-                            int entry_y = y + j - 1;
-                            if (temp_image[entry_x][entry_y] == 0) {
-                                erosion_result = 0;
+    (void)bmp_image;
+    unsigned char (*temp_image)[height] = malloc((size_t)width * height);
+    if (!temp_image) {
+        printf("Error: Cannot allocate temp image\n");
+        return;
+    }
+    // Phases are counted as perf regions when built with -DERODE_PERF
+    {
+        PERF_SCOPE(PERF_ERODE_COPY);
+        for (int x = 0; x < width; x++) {
+            for (int y = 0; y < height; y++) {
+                ERODE_TRACE_ACCESS(ERODE_TRACE_IMAGE, x, y, 0);
+                ERODE_TRACE_ACCESS(ERODE_TRACE_TEMP, x, y, 1);
+                temp_image[x][y] = binary_image[x][y];
+            }
+        }
+    }
+    {
+        PERF_SCOPE(PERF_ERODE_INTERIOR);
+        for (int x = 1; x < width - 1; x++) {
+            for (int y = 1; y < height - 1; y++) {
+                int erosion_result = 0;
+                ERODE_TRACE_ACCESS(ERODE_TRACE_TEMP, x, y, 0);
+                if (temp_image[x][y]) {
+                    erosion_result = 1;
+                    for (int i = 0; i < se_size; i++) {
+                        for (int j = 0; j < se_size; j++) {
+                            if (structuringElement[i][j] == 1) {
+                                int entry_x = x + i - 1;
+                                int entry_y = y + j - 1;
+                                ERODE_TRACE_ACCESS(ERODE_TRACE_TEMP, entry_x, entry_y, 0);
+                                if (temp_image[entry_x][entry_y] == 0) {
+                                    erosion_result = 0;
+                                }
                             }
                         }
+                    }             
+                }
+                ERODE_TRACE_ACCESS(ERODE_TRACE_IMAGE, x, y, 1);
+                binary_image[x][y] = erosion_result;
+            }
+        }
+    }
+    {
+        PERF_SCOPE(PERF_ERODE_BORDER);
+        for (int x = 0; x < width; x++) {
+            for (int i = 0; i < se_center && i < height; i++) {
+                ERODE_TRACE_ACCESS(ERODE_TRACE_IMAGE, x, i, 1);
+                ERODE_TRACE_ACCESS(ERODE_TRACE_IMAGE, x, height - 1 - i, 1);
+                binary_image[x][i] = 0;
+                binary_image[x][height - 1 - i] = 0;
+            }
+        }
+        for (int y = 0; y < height; y++) {
+            for (int i = 0; i < se_center && i < width; i++) {
+                ERODE_TRACE_ACCESS(ERODE_TRACE_IMAGE, i, y, 1);
+                ERODE_TRACE_ACCESS(ERODE_TRACE_IMAGE, width - 1 - i, y, 1);
+                binary_image[i][y] = 0;
+                binary_image[width - 1 - i][y] = 0;
+            }
+        }
+    }
+    free(temp_image);
+}
+
+// Fill the image with random filled circles resembling the cell images. The
+// generator state is local, so threads can fill images concurrently.
+void fill_cells(int width, int height, unsigned char binary_image[width][height], int cells, unsigned int seed) {
+    memset(binary_image, 0, (size_t)width * height);
+    for (int c = 0; c < cells; c++) {
+        int cx = rand_r(&seed) % width;
+        int cy = rand_r(&seed) % height;
+        int r = 3 + rand_r(&seed) % 18;
+        for (int x = cx - r; x <= cx + r; x++) {
+            for (int y = cy - r; y <= cy + r; y++) {
+                if (x >= 0 && x < width && y >= 0 && y < height &&
+                    (x - cx) * (x - cx) + (y - cy) * (y - cy) <= r * r) {
+                    binary_image[x][y] = 255;
+                }
+            }
+        }
+    }
+}
+
+// Compare a result against the reference erode() output
+int compare_images(const char* name, int width, int height, unsigned char expected[width][height], unsigned char actual[width][height]) {
+    for (int x = 0; x < width; x++) {
+        for (int y = 0; y < height; y++) {
+            if (expected[x][y] != actual[x][y]) {
+                printf("Error: %s differs from erode() at (%d, %d): %d != %d\n", name, x, y, actual[x][y], expected[x][y]);
+                return 1;
+            }
+        }
+    }
+    printf("%s matches erode()\n", name);
+    return 0;
+}
+
+// Grayscale erosion with one element, 8 and 16 bits, against a naive minimum
+// filter; then its threshold against erode_se() on the binary input. The
+// grey levels are above 127 (above 32767 in 16 bits) exactly on the cells.
+// Returns the number of mismatches, -1 on errors.
+static int check_gray(const char* name, int width, int height, unsigned char input_image[width][height],
+                      unsigned char result_image[width][height], const structuring_element_t* se) {
+    size_t size = (size_t)width * height;
+    uint8_t (*gray8)[height] = malloc(size);
+    uint16_t (*gray16)[height] = malloc(size * sizeof(uint16_t));
+    uint16_t (*expected)[height] = malloc(size * sizeof(uint16_t));
+    int errors = -1;
+    if (!gray8 || !gray16 || !expected) {
+        printf("Error: Cannot allocate %dx%d grayscale images\n", width, height);
+        goto done;
+    }
+    for (int x = 0; x < width; x++) {
+        for (int y = 0; y < height; y++) {
+            int level = input_image[x][y] ? 128 + (7 * x + 3 * y) % 128 : (x + 5 * y) % 128;
+            gray8[x][y] = level;
+            gray16[x][y] = level << 8 | ((x * y) & 255);
+        }
+    }
+
+    int rx = se->rows / 2, ry = se->cols / 2;
+    for (int x = 0; x < width; x++) {
+        for (int y = 0; y < height; y++) {
+            unsigned minimum = 0;
+            if (x >= rx && x < width - rx && y >= ry && y < height - ry) {
+                minimum = UINT16_MAX;
+                for (int i = 0; i < se->rows; i++) {
+                    for (int j = 0; j < se->cols; j++) {
+                        if (!se->mask[i * se->cols + j]) continue;
+                        unsigned v = gray16[x + i - rx][y + j - ry];
+                        if (v < minimum) minimum = v;
                     }
-                }             
+                }
+            }
+            expected[x][y] = minimum;
+        }
+    }
+
+    if (erode_gray8(width, height, gray8, se) || erode_gray16(width, height, gray16, se)) {
+        printf("Error: Cannot allocate grayscale erosion buffers\n");
+        goto done;
+    }
+    errors = 0;
+    for (int bits = 8; bits <= 16; bits += 8) {
+        int x = 0, y = 0, found = 0;
+        for (x = 0; x < width && !found; x++) {
+            for (y = 0; y < height && !found; y++) {
+                unsigned want = bits == 8 ? (expected[x][y] >> 8) : expected[x][y];
+                found = (bits == 8 ? gray8[x][y] : gray16[x][y]) != want;
+            }
+        }
+        if (found) {
+            x--, y--;
+            printf("Error: erode_gray%d %s differs from the minimum filter at (%d, %d): %d != %d\n", bits, name, x, y,
+                   bits == 8 ? gray8[x][y] : gray16[x][y], bits == 8 ? expected[x][y] >> 8 : expected[x][y]);
+            errors++;
+        } else {
+            printf("erode_gray%d %s matches the minimum filter\n", bits, name);
+        }
+    }
+
+    // Thresholding commutes with the minimum
+    {
+        unsigned char (*binary)[height] = (unsigned char (*)[height])expected;
+        memcpy(binary, input_image, size);
+        erode_se(width, height, binary, se);
+        for (int x = 0; x < width; x++) {
+            for (int y = 0; y < height; y++) {
+                binary[x][y] = binary[x][y] != 0;
+                result_image[x][y] = gray8[x][y] > 127;
+            }
+        }
+        char label[64];
+        snprintf(label, sizeof(label), "erode_gray8 %s thresholded", name);
+        errors += compare_images(label, width, height, binary, result_image);
+        for (int x = 0; x < width; x++) {
+            for (int y = 0; y < height; y++) result_image[x][y] = gray16[x][y] > 32767;
+        }
+        snprintf(label, sizeof(label), "erode_gray16 %s thresholded", name);
+        errors += compare_images(label, width, height, binary, result_image);
+    }
+
+done:
+    free(gray8);
+    free(gray16);
+    free(expected);
+    return errors;
+}
+
+// Run every kernel on a generated width x height cell image and compare it
+// with erode(). Returns the number of mismatching kernels, -1 on errors.
+int self_check(int width, int height) {
+    // Everything that is allocated is released at `done`, also on errors;
+    // the pixel pointers are declared before the first jump there
+    image_t images[4], rgb;
+    packed_image_t packed_src, packed_dst;
+    rle_image_t rle_src, rle_dst;
+    structuring_element_t cross, disk;
+    erode_pool_t* pool = NULL;
+    erode_video_t* video = NULL;
+    memset(images, 0, sizeof(images));
+    memset(&rgb, 0, sizeof(rgb));
+    memset(&packed_src, 0, sizeof(packed_src));
+    memset(&packed_dst, 0, sizeof(packed_dst));
+    memset(&rle_src, 0, sizeof(rle_src));
+    memset(&rle_dst, 0, sizeof(rle_dst));
+    memset(&cross, 0, sizeof(cross));
+    memset(&disk, 0, sizeof(disk));
+    unsigned char (*input_image)[height] = NULL;
+    unsigned char (*binary_image)[height] = NULL;
+    unsigned char (*result_image)[height] = NULL;
+    unsigned char (*twice_image)[height] = NULL;
+    unsigned char (*rgb_image)[height][3] = NULL;
+    size_t size = (size_t)width * height;
+    int errors = -1;
+
+    for (int i = 0; i < 4; i++) {
+        if (image_alloc(&images[i], width, height, 1, 0)) {
+            printf("Error: Cannot allocate %dx%d image\n", width, height);
+            goto done;
+        }
+    }
+    input_image = IMAGE_PIXELS(&images[0]);
+    binary_image = IMAGE_PIXELS(&images[1]);
+    result_image = IMAGE_PIXELS(&images[2]);
+    twice_image = IMAGE_PIXELS(&images[3]);
+    errors = 0;
+
+    fill_cells(width, height, input_image, width * height / 2250, 1);
+    memcpy(binary_image, input_image, size);
+    erode(width, height, 0, binary_image, NULL);
+
+    // Bit-packed erosion
+    if (packed_image_alloc(&packed_src, width, height) || packed_image_alloc(&packed_dst, width, height)) {
+        printf("Error: Cannot allocate packed image\n");
+        errors = -1;
+        goto done;
+    }
+    pack_image(width, height, input_image, &packed_src);
+    erode_packed(&packed_src, &packed_dst);
+    unpack_image(&packed_dst, width, height, result_image);
+    errors += compare_images("erode_packed", width, height, binary_image, result_image);
+
+    // Erosion on runs
+    if (rle_image_alloc(&rle_src, width, height, 1024) || rle_image_alloc(&rle_dst, width, height, 1024) ||
+        rle_encode(width, height, input_image, &rle_src) || erode_rle(&rle_src, &rle_dst)) {
+        printf("Error: Cannot allocate run-length image\n");
+        errors = -1;
+        goto done;
+    }
+    rle_decode(&rle_dst, width, height, result_image);
+    errors += compare_images("erode_rle", width, height, binary_image, result_image);
+    printf("RLE: %zu runs in %zu bytes for %zu pixels\n", rle_src.row_start[width], rle_image_bytes(&rle_src), size);
+
+    // Vectorised erosion, widest kernel supported by this CPU
+    erode_simd(width, height, input_image, result_image);
+    printf("SIMD kernel: %s\n", erode_row_isa());
+    errors += compare_images("erode_simd", width, height, binary_image, result_image);
+
+    // In-place erosion with a two-row line buffer
+    memcpy(result_image, input_image, size);
+    if (erode_inplace(width, height, result_image)) {
+        printf("Error: Cannot allocate line buffer\n");
+        errors = -1;
+        goto done;
+    }
+    errors += compare_images("erode_inplace", width, height, binary_image, result_image);
+
+    // Structuring element API with the same 3x3 cross
+    if (se_create(&cross, SE_CROSS, 3)) {
+        printf("Error: Cannot create structuring element\n");
+        errors = -1;
+        goto done;
+    }
+    memcpy(result_image, input_image, size);
+    erode_se(width, height, result_image, &cross);
+    errors += compare_images("erode_se", width, height, binary_image, result_image);
+
+    // Grayscale erosion with a square, a disk, a cross and an irregular element,
+    // and runs of 16 and more pixels for the van Herk/Gil-Werman sliding minimum
+    static const unsigned char custom_mask[3 * 5] = {
+        1, 1, 0, 1, 0,
+        0, 1, 1, 1, 1,
+        1, 0, 1, 0, 0
+    };
+    const se_shape_t gray_shapes[] = {SE_SQUARE, SE_DISK, SE_CROSS, SE_CUSTOM, SE_RECT, SE_HLINE};
+    const char* const gray_names[] = {"square 5", "disk 7", "cross 5", "custom 3x5", "rect 3x21", "hline 31"};
+    const int gray_sizes[] = {5, 7, 5, 0, 21, 31};
+    for (int i = 0; i < 6; i++) {
+        structuring_element_t se;
+        int failed = gray_shapes[i] == SE_CUSTOM ? se_from_mask(&se, 3, 5, custom_mask)
+                   : gray_shapes[i] == SE_RECT   ? se_rect(&se, 3, gray_sizes[i])
+                                                 : se_create(&se, gray_shapes[i], gray_sizes[i]);
+        if (failed) {
+            printf("Error: Cannot create structuring element\n");
+            errors = -1;
+            goto done;
+        }
+        int result = check_gray(gray_names[i], width, height, input_image, result_image, &se);
+        se_free(&se);
+        if (result < 0) {
+            errors = -1;
+            goto done;
+        }
+        errors += result;
+    }
+
+    // Dilation against the dual of erosion, !erode(!input), away from the
+    // border that erosion clears; the cross is its own reflection
+    for (int x = 0; x < width; x++) {
+        for (int y = 0; y < height; y++) twice_image[x][y] = !input_image[x][y];
+    }
+    memcpy(result_image, input_image, size);
+    if (erode_se(width, height, twice_image, &cross) || dilate_se(width, height, result_image, &cross)) {
+        printf("Error: Cannot allocate morphology buffers\n");
+        errors = -1;
+        goto done;
+    }
+    for (int x = 0; x < width; x++) {
+        for (int y = 0; y < height; y++) {
+            int inside = x > 0 && x < width - 1 && y > 0 && y < height - 1;
+            twice_image[x][y] = inside && !twice_image[x][y];
+            if (!inside) result_image[x][y] = 0;
+        }
+    }
+    errors += compare_images("dilate_se", width, height, twice_image, result_image);
+
+    // Fused opening and closing against erode_se() and dilate_se() one after the other
+    if (se_create(&disk, SE_DISK, 5)) {
+        printf("Error: Cannot create structuring element\n");
+        errors = -1;
+        goto done;
+    }
+    for (int close = 0; close < 2; close++) {
+        memcpy(twice_image, input_image, size);
+        memcpy(result_image, input_image, size);
+        int failed = close ? dilate_se(width, height, twice_image, &disk) || erode_se(width, height, twice_image, &disk) ||
+                                 morph_close(width, height, result_image, &disk)
+                           : erode_se(width, height, twice_image, &disk) || dilate_se(width, height, twice_image, &disk) ||
+                                 morph_open(width, height, result_image, &disk);
+        if (failed) {
+            printf("Error: Cannot allocate morphology buffers\n");
+            errors = -1;
+            goto done;
+        }
+        errors += compare_images(close ? "morph_close" : "morph_open", width, height, twice_image, result_image);
+    }
+
+    // Two fused erosion steps against erode() applied twice
+    memcpy(twice_image, binary_image, size);
+    erode(width, height, 0, twice_image, NULL);
+    memcpy(result_image, input_image, size);
+    if (erode_steps(width, height, result_image, &cross, 2)) {
+        printf("Error: Cannot allocate pipeline buffers\n");
+        errors = -1;
+        goto done;
+    }
+    errors += compare_images("erode_steps", width, height, twice_image, result_image);
+    memcpy(result_image, input_image, size);
+    if (erode_worklist(width, height, result_image, 2, NULL) < 0) {
+        printf("Error: Cannot allocate worklist\n");
+        errors = -1;
+        goto done;
+    }
+    errors += compare_images("erode_worklist", width, height, twice_image, result_image);
+    distance_map_t distance;
+    if (distance_map_compute(&distance, width, height, input_image, DISTANCE_CITY_BLOCK)) {
+        printf("Error: Cannot allocate distance map\n");
+        errors = -1;
+        goto done;
+    }
+    distance_map_erode(&distance, 2, &result_image[0][0]);
+    distance_map_free(&distance);
+    errors += compare_images("distance_map_erode", width, height, twice_image, result_image);
+
+    // Fused threshold and erosion of a colour version of the input, with
+    // the cells bright and the background dark
+    if (image_alloc(&rgb, width, height, 3, 0)) {
+        printf("Error: Cannot allocate %dx%d colour image\n", width, height);
+        errors = -1;
+        goto done;
+    }
+    rgb_image = (unsigned char (*)[height][3])rgb.data;
+    for (int x = 0; x < width; x++) {
+        for (int y = 0; y < height; y++) {
+            for (int c = 0; c < 3; c++) {
+                rgb_image[x][y][c] = input_image[x][y] ? 160 + (x + 2 * y + c) % 90 : (3 * x + y + c) % 80;
             }
-            binary_image[x][y] = erosion_result;
         }
     }
-    for (int x = 0; x < BMP_WIDTH; x++) {
-        for (int i = 0; i < se_center; i++) {
-            binary_image[x][i] = 0;
-            binary_image[x][BMP_HEIGTH - 1 - i] = 0;
+    erode_rgb_options_t rgb_options = {RGB_THRESHOLD_FIXED, 120, NULL};
+    erode_rgb(width, height, 3, rgb_image, result_image, &rgb_options);
+    errors += compare_images("erode_rgb (fixed)", width, height, binary_image, result_image);
+    // Otsu needs both classes, which an image too small for any cell lacks
+    if (width * height / 2250 > 0) {
+        rgb_options.rule = RGB_THRESHOLD_OTSU;
+        erode_rgb(width, height, 3, rgb_image, result_image, &rgb_options);
+        errors += compare_images("erode_rgb (Otsu)", width, height, binary_image, result_image);
+    }
+
+    // Band-parallel in-place erosion
+    pool = erode_pool_create(0);
+    if (!pool) {
+        printf("Error: Cannot create thread pool\n");
+        errors = -1;
+        goto done;
+    }
+    memcpy(result_image, input_image, size);
+    if (erode_parallel(pool, width, height, result_image)) {
+        printf("Error: Cannot allocate band scratch\n");
+        errors = -1;
+        goto done;
+    }
+    printf("Threads: %d\n", erode_pool_threads(pool));
+    errors += compare_images("erode_parallel", width, height, binary_image, result_image);
+
+    // Incremental erosion: a first frame, then the same frame with a block inverted
+    video = erode_video_create(width, height);
+    if (!video) {
+        printf("Error: Cannot allocate video eroder\n");
+        errors = -1;
+        goto done;
+    }
+    erode_video_frame(video, width, height, input_image);
+    errors += compare_images("erode_video", width, height, binary_image, (unsigned char (*)[height])erode_video_output(video));
+    memcpy(twice_image, input_image, size);
+    for (int x = width / 3; x < width / 3 + 40 && x < width; x++) {
+        for (int y = height / 3; y < height / 3 + 40 && y < height; y++) twice_image[x][y] = ~twice_image[x][y];
+    }
+    erode_video_frame(video, width, height, twice_image);
+    erode(width, height, 0, twice_image, NULL);
+    errors += compare_images("erode_video (next frame)", width, height, twice_image, (unsigned char (*)[height])erode_video_output(video));
+
+done:
+    for (int i = 0; i < 4; i++) {
+        image_free(&images[i]);
+    }
+    image_free(&rgb);
+    packed_image_free(&packed_src);
+    packed_image_free(&packed_dst);
+    rle_image_free(&rle_src);
+    rle_image_free(&rle_dst);
+    se_free(&cross);
+    se_free(&disk);
+    erode_pool_destroy(pool);
+    erode_video_destroy(video);
+    return errors;
+}
+
+// Map a single channel image file as one contiguous image
+static int map_binary_file(image_t* img, const char* input_file) {
+    if (image_map(img, input_file, 0)) return -1;
+    if (img->channels != 1) {
+        printf("Error: %s has %d channels, erosion needs a binary (single channel) image\n", input_file, img->channels);
+        image_free(img);
+        return -1;
+    }
+    if (!image_is_contiguous(img)) {
+        image_t copy;
+        if (image_copy(&copy, img, 0)) {
+            printf("Error: Cannot allocate %dx%d image\n", img->cols, img->rows);
+            image_free(img);
+            return -1;
         }
+        image_free(img);
+        *img = copy;
     }
-    for (int y = 0; y < BMP_HEIGTH; y++) {
-        for (int i = 0; i < se_center; i++) {
-            binary_image[i][y] = 0;
-            binary_image[BMP_WIDTH - 1 - i][y] = 0;
+    return 0;
+}
+
+// Erode a single channel image file in place and optionally save the result
+int erode_file(const char* input_file, const char* output_file) {
+    image_t img;
+    if (map_binary_file(&img, input_file)) return 1;
+
+    erode_pool_t* pool = erode_pool_create(0);
+    if (!pool || erode_parallel(pool, img.rows, img.cols, IMAGE_PIXELS(&img))) {
+        printf("Error: Cannot set up parallel erosion\n");
+        erode_pool_destroy(pool);
+        image_free(&img);
+        return 1;
+    }
+    erode_pool_destroy(pool);
+
+    // erode() writes 0/1, scale to 0/255 so the result is visible
+    size_t remaining = 0;
+    for (int x = 0; x < img.rows; x++) {
+        unsigned char* row = img.data + x * img.stride;
+        for (int y = 0; y < img.cols; y++) {
+            remaining += row[y];
+            row[y] *= 255;
         }
     }
+    printf("%s: %dx%d, %zu foreground pixels after erosion\n", input_file, img.cols, img.rows, remaining);
+
+    int result = 0;
+    if (output_file && image_save(&img, output_file)) result = 1;
+    image_free(&img);
+    return result;
 }
 
+// Erode a file too large for memory in strips, with at most `memory` bytes of buffers
+int erode_stream_file(const char* input_file, const char* output_file, size_t memory) {
+    erode_stream_stats_t stats;
+    if (erode_stream(input_file, output_file, memory, &stats)) return 1;
+    double megabytes = (double)stats.rows * stats.cols / (1 << 20);
+    printf("%s: %dx%d, %zu foreground pixels after erosion\n", input_file, stats.cols, stats.rows, stats.foreground);
+    printf("%d strips of %d rows in %.1f MB of buffers: %.2f s, %.0f MB/s, eroding %.0f%%, waiting for I/O %.0f%%\n",
+           stats.strips, stats.strip_rows, stats.buffer_bytes / 1048576.0, stats.seconds,
+           stats.seconds > 0 ? megabytes / stats.seconds : 0.0,
+           stats.seconds > 0 ? 100 * stats.compute_seconds / stats.seconds : 0.0,
+           stats.seconds > 0 ? 100 * stats.stall_seconds / stats.seconds : 0.0);
+    return 0;
+}
+
+// Threshold a colour (or grey) image file, erode it and write the mask, and
+// optionally the image with the eroded pixels painted red. `rule` is a grey
+// level or "otsu".
+int erode_rgb_file(const char* rule, const char* input_file, const char* mask_file, const char* overlay_file) {
+    erode_rgb_options_t options = {RGB_THRESHOLD_FIXED, 0, NULL};
+    if (strcmp(rule, "otsu") == 0) {
+        options.rule = RGB_THRESHOLD_OTSU;
+    } else {
+        char* end;
+        long level = strtol(rule, &end, 10);
+        if (*end || end == rule || level < 0 || level > 255) {
+            printf("Error: Invalid threshold %s, expected 0-255 or otsu\n", rule);
+            return 1;
+        }
+        options.threshold = (int)level;
+    }
+
+    image_t img, mask;
+    if (image_map(&img, input_file, 0)) return 1;
+    if (img.channels == 2) {
+        printf("Error: %s has 2 channels, expected grey or colour\n", input_file);
+        image_free(&img);
+        return 1;
+    }
+    if (!image_is_contiguous(&img)) {
+        image_t copy;
+        if (image_copy(&copy, &img, 0)) {
+            printf("Error: Cannot allocate %dx%d image\n", img.cols, img.rows);
+            image_free(&img);
+            return 1;
+        }
+        image_free(&img);
+        img = copy;
+    }
+    if (image_alloc(&mask, img.rows, img.cols, 1, 0)) {
+        printf("Error: Cannot allocate %dx%d image\n", img.cols, img.rows);
+        image_free(&img);
+        return 1;
+    }
+    mask.bottom_up = img.bottom_up;
+
+    // Red in BMP channel order, white for a grey image
+    static const unsigned char red[3] = {0, 0, 255}, white[1] = {255};
+    if (overlay_file) options.overlay = img.channels >= 3 ? red : white;
+    int threshold = erode_rgb(img.rows, img.cols, img.channels, (unsigned char (*)[img.cols][img.channels])img.data,
+                              IMAGE_PIXELS(&mask), &options);
+    if (threshold < 0) {
+        printf("Error: Cannot allocate mask rows\n");
+        image_free(&img);
+        image_free(&mask);
+        return 1;
+    }
+
+    size_t remaining = 0;
+    for (size_t i = 0; i < (size_t)mask.rows * mask.cols; i++) {
+        remaining += mask.data[i];
+        mask.data[i] *= 255;
+    }
+    printf("%s: %dx%d, %d channels, threshold %d, %zu foreground pixels after erosion\n", input_file, img.cols,
+           img.rows, img.channels, threshold, remaining);
+    int result = 0;
+    if (image_save(&mask, mask_file) || (overlay_file && image_save(&img, overlay_file))) result = 1;
+    image_free(&img);
+    image_free(&mask);
+    return result;
+}
+
+// Erode a file until nothing is left and list the cells as they vanish
+int count_cells_file(const char* input_file) {
+    image_t img;
+    if (map_binary_file(&img, input_file)) return 1;
+    erode_cells_t cells;
+    int steps = erode_worklist(img.rows, img.cols, IMAGE_PIXELS(&img), 0, &cells);
+    if (steps < 0) {
+        printf("Error: Cannot allocate worklist\n");
+        image_free(&img);
+        return 1;
+    }
+    printf("%s: %dx%d, %d cells in %d erosion steps\n", input_file, img.cols, img.rows, cells.count, steps);
+    for (int i = 0; i < cells.count; i++) {
+        // Positions in display order, as the file is viewed
+        int row = img.bottom_up ? img.rows - 1 - cells.cells[i].x : cells.cells[i].x;
+        printf("cell %d: x %d, y %d, vanished at step %d with %zu pixels\n", i + 1, cells.cells[i].y, row,
+               cells.cells[i].step, cells.cells[i].pixels);
+    }
+    erode_cells_free(&cells);
+    image_free(&img);
+    return 0;
+}
+
+static int compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static int add_name(char*** names, int* count, int* capacity, char* name) {
+    if (*count == *capacity) {
+        int grown_capacity = *capacity ? 2 * *capacity : 256;
+        char** grown = realloc(*names, grown_capacity * sizeof(char*));
+        if (!grown) return -1;
+        *names = grown;
+        *capacity = grown_capacity;
+    }
+    (*names)[(*count)++] = name;
+    return 0;
+}
+
+// The BMP, PGM and PBM files of a directory in name order, or the lines of a
+// list file. Returns the count, or -1 on error.
+static int read_batch_inputs(const char* source, char*** names) {
+    int count = 0, capacity = 0;
+    *names = NULL;
+    struct stat st;
+    if (stat(source, &st) != 0) {
+        printf("Error: Cannot open %s\n", source);
+        return -1;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        DIR* dir = opendir(source);
+        if (!dir) {
+            printf("Error: Cannot open directory %s\n", source);
+            return -1;
+        }
+        struct dirent* entry;
+        while ((entry = readdir(dir))) {
+            if (entry->d_name[0] == '.' || image_format_from_path(entry->d_name) == IMAGE_FORMAT_UNKNOWN) continue;
+            char* path = NULL;
+            if (asprintf(&path, "%s/%s", source, entry->d_name) < 0 || add_name(names, &count, &capacity, path)) {
+                free(path);
+                count = -1;
+                break;
+            }
+        }
+        closedir(dir);
+    } else {
+        FILE* list = fopen(source, "r");
+        if (!list) {
+            printf("Error: Cannot open file list %s\n", source);
+            return -1;
+        }
+        char* line = NULL;
+        size_t size = 0;
+        ssize_t length;
+        while ((length = getline(&line, &size, list)) >= 0) {
+            while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) line[--length] = 0;
+            if (length == 0) continue;
+            char* path = strdup(line);
+            if (!path || add_name(names, &count, &capacity, path)) {
+                free(path);
+                count = -1;
+                break;
+            }
+        }
+        free(line);
+        fclose(list);
+    }
+    if (count < 0) {
+        printf("Error: Cannot allocate the file list\n");
+        return -1;
+    }
+    if (*names) qsort(*names, count, sizeof(char*), compare_names);
+    return count;
+}
+
+// Erode every image of a directory or list file, optionally into output_dir
+int erode_batch_files(const char* source, const char* output_dir) {
+    char** names;
+    int count = read_batch_inputs(source, &names);
+    if (count < 0) return 1;
+    if (count == 0) {
+        printf("Error: No images in %s\n", source);
+        free(names);
+        return 1;
+    }
+    erode_batch_stats_t stats;
+    int result = erode_batch((const char* const*)names, count, output_dir, 0, &stats);
+    for (int i = 0; i < count; i++) free(names[i]);
+    free(names);
+    if (result) {
+        printf("Error: Cannot set up batch workers\n");
+        return 1;
+    }
+    double megapixels = stats.pixels / 1e6;
+    printf("%d images, %d failed, on %d threads (%d steals): %.2f s, %.1f images/s, %.0f Mpixels/s\n",
+           stats.images, stats.failed, stats.threads, stats.steals, stats.seconds,
+           stats.seconds > 0 ? stats.images / stats.seconds : 0.0,
+           stats.seconds > 0 ? megapixels / stats.seconds : 0.0);
+    printf("latency per image: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n", 1e3 * stats.latency_p50,
+           1e3 * stats.latency_p90, 1e3 * stats.latency_p99, 1e3 * stats.latency_max);
+    return stats.failed ? 1 : 0;
+}
+
+#ifndef ERODE_NO_MAIN
 int main(int argc, char const *argv[])
 {
-    unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH];
-    unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS];
-    erode(binary_image, bmp_image);
-    return 0;
+    if (argc >= 2 && strcmp(argv[1], "--check") == 0) {
+        int width = argc >= 4 ? atoi(argv[2]) : BMP_WIDTH;
+        int height = argc >= 4 ? atoi(argv[3]) : BMP_HEIGTH;
+        if (width <= 0 || height <= 0) {
+            printf("Error: Invalid image size %s x %s\n", argv[2], argv[3]);
+            return 1;
+        }
+        return self_check(width, height) ? 1 : 0;
+    }
+    if (argc == 3 && strcmp(argv[1], "--count") == 0) {
+        return count_cells_file(argv[2]);
+    }
+    if ((argc == 5 || argc == 6) && strcmp(argv[1], "--rgb") == 0) {
+        return erode_rgb_file(argv[2], argv[3], argv[4], argc == 6 ? argv[5] : NULL);
+    }
+    if ((argc == 3 || argc == 4) && strcmp(argv[1], "--batch") == 0) {
+        return erode_batch_files(argv[2], argc == 4 ? argv[3] : NULL);
+    }
+    if (argc == 5 && strcmp(argv[1], "--stream") == 0) {
+        long megabytes = atol(argv[2]);
+        if (megabytes <= 0) {
+            printf("Error: Invalid memory limit %s MB\n", argv[2]);
+            return 1;
+        }
+        return erode_stream_file(argv[3], argv[4], (size_t)megabytes << 20);
+    }
+    if (argc == 2 || argc == 3) {
+        return erode_file(argv[1], argc == 3 ? argv[2] : NULL);
+    }
+    if (argc == 1) {
+        return self_check(BMP_WIDTH, BMP_HEIGTH) ? 1 : 0;
+    }
+    printf("Usage: %s [--check [width height]] | <input.bmp|pgm|pbm> [output.bmp|pgm|pbm]\n", argv[0]);
+    printf("       %s --stream <MB> <input.bmp|pgm> <output.bmp|pgm>\n", argv[0]);
+    printf("       %s --count <input.bmp|pgm|pbm>\n", argv[0]);
+    printf("       %s --batch <directory|list.txt> [output directory]\n", argv[0]);
+    printf("       %s --rgb <threshold|otsu> <input.bmp|pgm> <mask.bmp|pgm|pbm> [overlay.bmp|pgm]\n", argv[0]);
+    return 1;
 }
+#endif
@@ -0,0 +1,247 @@
+#ifndef ERODE_H
+#define ERODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Image layout used by every kernel: binary_image[x][y] with x in [0, width)
+// and y in [0, height). A row is binary_image[x], i.e. `height` contiguous
+// pixels, matching the row-major data memory layout used by CPUTop.
+
+// Reference cross erosion, in place; bmp_image is not used and may be NULL
+void erode(int width, int height, int channels, unsigned char binary_image[width][height], unsigned char bmp_image[width][height][channels]);
+
+// Pixel access hook of erode(), for asm/memtrace.c. When erode.c is built
+// with -DERODE_TRACE, every load and store of pixel [x][y] of the image or of
+// erode()'s temporary copy calls it with offset x * height + y, in program
+// order; nothing is recorded while it is NULL.
+typedef enum {
+    ERODE_TRACE_IMAGE,      // binary_image
+    ERODE_TRACE_TEMP        // the copy the neighbourhoods are read from
+} erode_trace_image_t;
+
+typedef void (*erode_trace_fn)(void* context, erode_trace_image_t image, size_t offset, int store);
+extern erode_trace_fn erode_trace_hook;
+extern void* erode_trace_context;
+
+// Random filled circles resembling the cell images, 255 on 0
+void fill_cells(int width, int height, unsigned char binary_image[width][height], int cells, unsigned int seed);
+
+// Bit-packed binary image, 64 pixels per word
+typedef struct {
+    int width;              // number of rows
+    int height;             // pixels per row
+    int words_per_row;      // (height + 63) / 64
+    uint64_t* words;        // pixel [x][y] is bit y % 64 of words[x * words_per_row + y / 64]
+} packed_image_t;
+
+int packed_image_alloc(packed_image_t* packed, int width, int height);
+void packed_image_free(packed_image_t* packed);
+void pack_image(int width, int height, unsigned char binary_image[width][height], packed_image_t* packed);
+void unpack_image(const packed_image_t* packed, int width, int height, unsigned char binary_image[width][height]);
+void erode_packed(const packed_image_t* src, packed_image_t* dst);
+
+// Run-length encoded binary image: the foreground of row x is the sorted,
+// disjoint runs[row_start[x] .. row_start[x + 1]), each covering [start, end)
+typedef struct {
+    int32_t start;
+    int32_t end;
+} rle_run_t;
+
+typedef struct {
+    int width;
+    int height;
+    size_t* row_start;      // width + 1 entries
+    rle_run_t* runs;
+    size_t capacity;        // allocated runs, grown on demand
+} rle_image_t;
+
+int rle_image_alloc(rle_image_t* rle, int width, int height, size_t capacity);
+void rle_image_free(rle_image_t* rle);
+size_t rle_image_bytes(const rle_image_t* rle);
+int rle_encode(int width, int height, unsigned char binary_image[width][height], rle_image_t* rle);
+void rle_decode(const rle_image_t* rle, int width, int height, unsigned char binary_image[width][height]);
+int erode_rle(const rle_image_t* src, rle_image_t* dst);
+
+// Row kernel: erodes row `cur` (with neighbours `up` and `down`) into `out`,
+// including the cleared border columns. `out` must not alias the inputs.
+typedef void (*erode_row_fn)(const unsigned char* up, const unsigned char* cur, const unsigned char* down, unsigned char* out, int height);
+
+void erode_row_scalar(const unsigned char* up, const unsigned char* cur, const unsigned char* down, unsigned char* out, int height);
+int erode_isa_limit(void);
+erode_row_fn erode_row_select(void);
+const char* erode_row_isa(void);
+void erode_simd(int width, int height, unsigned char src[width][height], unsigned char dst[width][height]);
+
+// In-place streaming erosion with a two-row line buffer
+void erode_rows_inplace(int width, int height, unsigned char binary_image[width][height], int first, int end,
+                        const unsigned char* above, const unsigned char* below, unsigned char* ring, erode_row_fn kernel);
+int erode_inplace(int width, int height, unsigned char binary_image[width][height]);
+
+// Structuring elements for erode_se(). Rows and cols are odd, the centre
+// tap is at (rows / 2, cols / 2).
+typedef enum {
+    SE_CROSS,
+    SE_SQUARE,
+    SE_DISK,
+    SE_HLINE,
+    SE_VLINE,
+    SE_RECT,
+    SE_CUSTOM
+} se_shape_t;
+
+typedef struct {
+    se_shape_t shape;
+    int rows;
+    int cols;
+    unsigned char* mask;    // rows * cols entries, 1 = active tap
+} structuring_element_t;
+
+int se_create(structuring_element_t* se, se_shape_t shape, int size);
+int se_rect(structuring_element_t* se, int rows, int cols);
+int se_from_mask(structuring_element_t* se, int rows, int cols, const unsigned char* mask);
+void se_free(structuring_element_t* se);
+int erode_se(int width, int height, unsigned char binary_image[width][height], const structuring_element_t* se);
+
+// Grayscale erosion (minimum filter) over the active taps of an element
+int erode_gray8(int width, int height, uint8_t image[width][height], const structuring_element_t* se);
+int erode_gray16(int width, int height, uint16_t image[width][height], const structuring_element_t* se);
+const char* erode_gray_isa(void);
+
+// Fused morphology pipeline
+typedef enum {
+    MORPH_ERODE,
+    MORPH_DILATE
+} morph_op_t;
+
+typedef struct {
+    morph_op_t op;
+    const structuring_element_t* se;
+} morph_stage_t;
+
+int dilate_se(int width, int height, unsigned char binary_image[width][height], const structuring_element_t* se);
+int morph_pipeline(int width, int height, unsigned char binary_image[width][height], const morph_stage_t* stages, int stage_count);
+int morph_open(int width, int height, unsigned char binary_image[width][height], const structuring_element_t* se);
+int morph_close(int width, int height, unsigned char binary_image[width][height], const structuring_element_t* se);
+int erode_steps(int width, int height, unsigned char binary_image[width][height], const structuring_element_t* se, int steps);
+
+// Repeated erosion over a worklist of boundary pixels, with the cells
+// recorded as they vanish
+typedef struct {
+    int x;                  // centre of the pixels removed by the last step
+    int y;
+    int step;               // step that removed the last pixels
+    size_t pixels;          // pixels removed by that step
+} erode_cell_t;
+
+typedef struct {
+    erode_cell_t* cells;
+    int count;
+    int capacity;
+} erode_cells_t;
+
+int erode_worklist(int width, int height, unsigned char binary_image[width][height], int max_steps, erode_cells_t* cells);
+void erode_cells_free(erode_cells_t* cells);
+
+// Distance to the nearest background pixel (the outside counts as
+// background), for erosion by any radius with one threshold
+typedef enum {
+    DISTANCE_CITY_BLOCK,    // k iterations of erode()
+    DISTANCE_CHESSBOARD,    // k iterations of the 3x3 square
+    DISTANCE_EUCLIDEAN      // SE_DISK of radius k, distances stored squared
+} distance_metric_t;
+
+typedef struct {
+    int width;
+    int height;
+    distance_metric_t metric;
+    uint32_t* distance;     // width x height, 0 on background
+} distance_map_t;
+
+int distance_map_compute(distance_map_t* map, int width, int height, unsigned char binary_image[width][height],
+                         distance_metric_t metric);
+void distance_map_free(distance_map_t* map);
+void distance_map_erode(const distance_map_t* map, int radius, unsigned char* output);
+
+// Threshold, erosion and overlay of an interleaved colour image in one pass.
+// The image has 1 channel (grey) or 3 or more (RGB, then e.g. alpha, which
+// is ignored); 2 channels are rejected.
+typedef enum {
+    RGB_THRESHOLD_FIXED,
+    RGB_THRESHOLD_OTSU
+} rgb_threshold_t;
+
+typedef struct {
+    rgb_threshold_t rule;
+    int threshold;                  // RGB_THRESHOLD_FIXED: grey level above which a pixel is foreground
+    const unsigned char* overlay;   // colour painted over the eroded pixels, one byte per channel, or NULL
+} erode_rgb_options_t;
+
+int erode_rgb(int width, int height, int channels, unsigned char rgb_image[width][height][channels],
+              unsigned char binary_image[width][height], const erode_rgb_options_t* options);
+
+// Persistent worker pool and band-parallel erosion
+typedef struct erode_pool erode_pool_t;
+typedef void (*erode_pool_job_fn)(void* arg, int index, int count);
+
+erode_pool_t* erode_pool_create(int threads);
+void erode_pool_destroy(erode_pool_t* pool);
+int erode_pool_threads(const erode_pool_t* pool);
+void erode_pool_run(erode_pool_t* pool, erode_pool_job_fn job, void* arg);
+int erode_parallel(erode_pool_t* pool, int width, int height, unsigned char binary_image[width][height]);
+
+// Batch erosion of many image files on a work-stealing worker pool
+typedef struct {
+    int images;
+    int failed;
+    int threads;
+    int steals;                 // ranges of the file list moved between workers
+    size_t pixels;              // in the images that were read
+    double seconds;
+    double latency_p50;         // per image, from taking it to its output written
+    double latency_p90;
+    double latency_p99;
+    double latency_max;
+} erode_batch_stats_t;
+
+int erode_batch(const char* const* inputs, int count, const char* output_dir, int threads, erode_batch_stats_t* stats);
+
+// Incremental erosion of video frames: only pixels near the changes since
+// the previous frame are eroded again. Rectangles cover rows [x, x + rows)
+// and columns [y, y + cols).
+typedef struct erode_video erode_video_t;
+
+typedef struct {
+    int x;
+    int y;
+    int rows;
+    int cols;
+} erode_rect_t;
+
+erode_video_t* erode_video_create(int width, int height);
+void erode_video_destroy(erode_video_t* video);
+int erode_video_frame(erode_video_t* video, int width, int height, const unsigned char frame[width][height]);
+int erode_video_update(erode_video_t* video, int width, int height, const unsigned char frame[width][height],
+                       const erode_rect_t* rects, int count);
+const unsigned char* erode_video_output(const erode_video_t* video);
+size_t erode_video_recomputed(const erode_video_t* video);
+
+// Out-of-core erosion of image files in strips of rows, read and written by
+// background threads while the current strip is eroded
+#define ERODE_STREAM_DEFAULT_MEMORY ((size_t)64 << 20)
+
+typedef struct {
+    int rows;
+    int cols;
+    int strip_rows;
+    int strips;
+    size_t buffer_bytes;        // strip buffers actually allocated
+    size_t foreground;          // pixels left after erosion
+    double seconds;             // whole pipeline
+    double compute_seconds;     // eroding
+    double stall_seconds;       // eroding waited for the reader or the writer
+} erode_stream_stats_t;
+
+int erode_stream(const char* input_file, const char* output_file, size_t memory_limit, erode_stream_stats_t* stats);
+
+#endif
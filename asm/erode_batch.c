@@ -0,0 +1,285 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "erode.h"
+#include "image.h"
+
+// Batch erosion of many image files on the worker pool. Every worker owns a
+// contiguous range of the file list and takes from its front; a worker whose
+// range is empty steals the back half of the largest range left, so uneven
+// image sizes still balance without a shared counter on every image. The
+// range is one 64-bit word (next, end) updated with compare and swap.
+//
+// Each worker keeps one input and one output buffer that only grow: a file is
+// read into the input buffer and parsed there, and the eroded image is written
+// from the output buffer with image_save(), which does not allocate. So after
+// the largest image nothing is allocated or mapped per image, except for PBM
+// and palette BMP inputs, which are converted into a heap image first. Reads
+// are pipelined: a worker takes its next image before eroding the current one
+// and asks the kernel to read it ahead, so the disk works while the CPU erodes.
+
+#define RANGE(next, end) (((uint64_t)(uint32_t)(end) << 32) | (uint32_t)(next))
+#define RANGE_NEXT(range) ((int)(uint32_t)(range))
+#define RANGE_END(range) ((int)((range) >> 32))
+
+typedef struct {
+    uint64_t range;             // (next, end) of the images still to take
+    unsigned char* input;       // file being eroded, grown to the largest one seen
+    size_t input_size;
+    unsigned char* buffer;      // eroded image, grown to the largest one seen
+    size_t buffer_size;
+    char path[4096];
+} batch_worker_t;
+
+typedef struct {
+    const char* const* inputs;
+    int count;
+    const char* output_dir;
+    erode_row_fn kernel;
+    batch_worker_t* workers;
+    int worker_count;
+    double* latency;            // per image, seconds
+    int failed;
+    int steals;
+    size_t pixels;
+} batch_job_t;
+
+static double batch_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Take the next image of the worker's own range, -1 if it is empty
+static int take_own(batch_worker_t* worker) {
+    uint64_t range = __atomic_load_n(&worker->range, __ATOMIC_ACQUIRE);
+    while (RANGE_NEXT(range) < RANGE_END(range)) {
+        uint64_t taken = RANGE(RANGE_NEXT(range) + 1, RANGE_END(range));
+        if (__atomic_compare_exchange_n(&worker->range, &range, taken, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return RANGE_NEXT(range);
+        }
+    }
+    return -1;
+}
+
+// Move the back half of the largest other range to this worker's (empty)
+// range. Returns 0 if every range is empty.
+static int steal(batch_job_t* job, int self) {
+    for (;;) {
+        int victim = -1, most = 0;
+        uint64_t seen = 0;
+        for (int i = 0; i < job->worker_count; i++) {
+            uint64_t range = __atomic_load_n(&job->workers[i].range, __ATOMIC_ACQUIRE);
+            int left = RANGE_END(range) - RANGE_NEXT(range);
+            if (i != self && left > most) {
+                victim = i;
+                most = left;
+                seen = range;
+            }
+        }
+        if (victim < 0) return 0;
+        int end = RANGE_END(seen);
+        int split = end - (most + 1) / 2;
+        if (__atomic_compare_exchange_n(&job->workers[victim].range, &seen, RANGE(RANGE_NEXT(seen), split), 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&job->workers[self].range, RANGE(split, end), __ATOMIC_RELEASE);
+            __atomic_fetch_add(&job->steals, 1, __ATOMIC_RELAXED);
+            return 1;
+        }
+    }
+}
+
+static int take(batch_job_t* job, int self) {
+    int index;
+    while ((index = take_own(&job->workers[self])) < 0) {
+        if (!steal(job, self)) return -1;
+    }
+    return index;
+}
+
+// Start reading a file into the page cache without waiting for it
+static void read_ahead(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+}
+
+// Read a whole file into the worker's input buffer
+static int read_input(batch_worker_t* worker, const char* path, size_t* size) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        printf("Error: Cannot open input file %s\n", path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    *size = st.st_size;
+    if (worker->input_size < *size) {
+        unsigned char* input = realloc(worker->input, *size);
+        if (!input) {
+            printf("Error: Cannot allocate %zu bytes for %s\n", *size, path);
+            close(fd);
+            return -1;
+        }
+        worker->input = input;
+        worker->input_size = *size;
+    }
+    size_t done = 0;
+    while (done < *size) {
+        ssize_t got = read(fd, worker->input + done, *size - done);
+        if (got <= 0) break;
+        done += got;
+    }
+    close(fd);
+    if (done < *size) {
+        printf("Error: Cannot read input file %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Erode one file into the worker's buffer and write it to the output
+// directory under the same name. The input may have padded rows, the row
+// kernel reads it in place.
+static int batch_image(batch_job_t* job, batch_worker_t* worker, const char* input_file) {
+    image_t img;
+    size_t file_size;
+    if (read_input(worker, input_file, &file_size) || image_parse(&img, worker->input, file_size, input_file, 0)) {
+        return -1;
+    }
+    if (img.channels != 1) {
+        printf("Error: %s has %d channels, erosion needs a binary (single channel) image\n", input_file, img.channels);
+        image_free(&img);
+        return -1;
+    }
+    int rows = img.rows, cols = img.cols;
+    size_t size = (size_t)rows * cols;
+    if (worker->buffer_size < size) {
+        unsigned char* buffer = realloc(worker->buffer, size);
+        if (!buffer) {
+            printf("Error: Cannot allocate %dx%d image\n", cols, rows);
+            image_free(&img);
+            return -1;
+        }
+        worker->buffer = buffer;
+        worker->buffer_size = size;
+    }
+
+    // erode() clears the border rows; the kernel clears the border columns
+    unsigned char* out = worker->buffer;
+    memset(out, 0, cols);
+    memset(out + (size_t)(rows - 1) * cols, 0, cols);
+    for (int x = 1; x < rows - 1; x++) {
+        const unsigned char* cur = img.data + x * img.stride;
+        unsigned char* row = out + (size_t)x * cols;
+        job->kernel(cur - img.stride, cur, cur + img.stride, row, cols);
+        for (int y = 0; y < cols; y++) row[y] *= 255;
+    }
+    __atomic_fetch_add(&job->pixels, size, __ATOMIC_RELAXED);
+
+    int result = 0;
+    if (job->output_dir) {
+        const char* name = strrchr(input_file, '/');
+        name = name ? name + 1 : input_file;
+        if (snprintf(worker->path, sizeof(worker->path), "%s/%s", job->output_dir, name) >= (int)sizeof(worker->path)) {
+            printf("Error: Output path for %s is too long\n", input_file);
+            result = -1;
+        } else {
+            image_t eroded = img;
+            eroded.stride = cols;
+            eroded.data = out;
+            eroded.storage = 0;
+            result = image_save(&eroded, worker->path);
+        }
+    }
+    image_free(&img);
+    return result;
+}
+
+static void batch_worker(void* p, int index, int count) {
+    batch_job_t* job = p;
+    (void)count;
+    batch_worker_t* worker = &job->workers[index];
+    int current = take(job, index);
+    while (current >= 0) {
+        double start = batch_seconds();
+        // The next image is read while this one is eroded
+        int next = take(job, index);
+        if (next >= 0) read_ahead(job->inputs[next]);
+        if (batch_image(job, worker, job->inputs[current])) __atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+        job->latency[current] = batch_seconds() - start;
+        current = next;
+    }
+}
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double* sorted, int count, double p) {
+    int i = (int)(p * (count - 1) + 0.5);
+    return sorted[i];
+}
+
+// Erode every input file, writing the results into output_dir under their own
+// names (or nowhere if output_dir is NULL). threads <= 0 picks the count as
+// erode_pool_create() does. Files that cannot be read, eroded or written are
+// reported and counted in stats->failed. Returns -1 if the workers cannot be
+// set up.
+int erode_batch(const char* const* inputs, int count, const char* output_dir, int threads, erode_batch_stats_t* stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (count <= 0) return 0;
+
+    batch_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.inputs = inputs;
+    job.count = count;
+    job.output_dir = output_dir;
+    job.kernel = erode_row_select();
+    erode_pool_t* pool = erode_pool_create(threads);
+    if (pool) {
+        job.worker_count = erode_pool_threads(pool);
+        job.workers = calloc(job.worker_count, sizeof(batch_worker_t));
+        job.latency = malloc(count * sizeof(double));
+    }
+    if (!pool || !job.workers || !job.latency) {
+        erode_pool_destroy(pool);
+        free(job.workers);
+        free(job.latency);
+        return -1;
+    }
+    for (int i = 0; i < job.worker_count; i++) {
+        job.workers[i].range = RANGE((long long)count * i / job.worker_count, (long long)count * (i + 1) / job.worker_count);
+    }
+
+    double start = batch_seconds();
+    erode_pool_run(pool, batch_worker, &job);
+    stats->seconds = batch_seconds() - start;
+
+    qsort(job.latency, count, sizeof(double), compare_double);
+    stats->images = count;
+    stats->failed = job.failed;
+    stats->threads = job.worker_count;
+    stats->steals = job.steals;
+    stats->pixels = job.pixels;
+    stats->latency_p50 = percentile(job.latency, count, 0.50);
+    stats->latency_p90 = percentile(job.latency, count, 0.90);
+    stats->latency_p99 = percentile(job.latency, count, 0.99);
+    stats->latency_max = job.latency[count - 1];
+
+    for (int i = 0; i < job.worker_count; i++) {
+        free(job.workers[i].input);
+        free(job.workers[i].buffer);
+    }
+    free(job.workers);
+    free(job.latency);
+    erode_pool_destroy(pool);
+    return 0;
+}
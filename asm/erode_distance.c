@@ -0,0 +1,157 @@
+#include <stdlib.h>
+#include <string.h>
+#include "erode.h"
+
+// Erosion by any radius from a distance transform. Every foreground pixel
+// gets the distance to the nearest background pixel, where everything outside
+// the image counts as background. A pixel survives erosion by radius k
+// exactly when that distance is larger than k, so once the map is computed
+// (in time linear in the pixels) every radius is one threshold pass:
+//
+//   city-block:  k iterations of erode() (3x3 cross),
+//   chessboard:  k iterations of the 3x3 square, or erode_se() with a
+//                (2k + 1) square,
+//   Euclidean:   erode_se() with the SE_DISK of radius k; distances are
+//                stored squared so the comparison is exact.
+//
+// Treating the outside as background gives the cleared border of erode() and
+// erode_se(): a pixel within k of the image edge is within k of the outside.
+
+// Two chamfer passes with unit steps; exact for city-block (4 neighbours)
+// and chessboard (8 neighbours)
+static void chamfer(int width, int height, unsigned char binary_image[width][height], uint32_t (*d)[height],
+                    int diagonal) {
+    for (int x = 0; x < width; x++) {
+        for (int y = 0; y < height; y++) {
+            if (!binary_image[x][y]) {
+                d[x][y] = 0;
+                continue;
+            }
+            uint32_t m = x > 0 ? d[x - 1][y] : 0;
+            if (y > 0 && d[x][y - 1] < m) m = d[x][y - 1];
+            if (y == 0) m = 0;
+            if (diagonal) {
+                uint32_t upleft = x > 0 && y > 0 ? d[x - 1][y - 1] : 0;
+                uint32_t upright = x > 0 && y < height - 1 ? d[x - 1][y + 1] : 0;
+                if (upleft < m) m = upleft;
+                if (upright < m) m = upright;
+            }
+            d[x][y] = m + 1;
+        }
+    }
+    for (int x = width - 1; x >= 0; x--) {
+        for (int y = height - 1; y >= 0; y--) {
+            if (!d[x][y]) continue;
+            uint32_t m = x < width - 1 ? d[x + 1][y] : 0;
+            if (y < height - 1 && d[x][y + 1] < m) m = d[x][y + 1];
+            if (y == height - 1) m = 0;
+            if (diagonal) {
+                uint32_t downleft = x < width - 1 && y > 0 ? d[x + 1][y - 1] : 0;
+                uint32_t downright = x < width - 1 && y < height - 1 ? d[x + 1][y + 1] : 0;
+                if (downleft < m) m = downleft;
+                if (downright < m) m = downright;
+            }
+            if (m + 1 < d[x][y]) d[x][y] = m + 1;
+        }
+    }
+}
+
+// Exact squared Euclidean distances (Felzenszwalb and Huttenlocher): the
+// distance to the nearest background pixel in the same column, then per row
+// the lower envelope of the parabolas (y - q)^2 + g(q)^2. The outside pixels
+// at y = -1 and y = height are background sites of their own.
+static int euclidean(int width, int height, unsigned char binary_image[width][height], uint32_t (*d)[height]) {
+    int sites = height + 2;
+    int* v = malloc(sites * sizeof(int));              // envelope parabola positions
+    double* z = malloc((sites + 1) * sizeof(double));  // envelope boundaries
+    int64_t* f = malloc(sites * sizeof(int64_t));      // g^2 at q = -1 .. height
+    if (!v || !z || !f) {
+        free(v);
+        free(z);
+        free(f);
+        return -1;
+    }
+
+    // Column distances, one whole row at a time
+    for (int x = 0; x < width; x++) {
+        for (int y = 0; y < height; y++) d[x][y] = binary_image[x][y] ? (x > 0 ? d[x - 1][y] : 0) + 1 : 0;
+    }
+    // The last row is next to the outside
+    for (int y = 0; y < height; y++) {
+        if (d[width - 1][y] > 1) d[width - 1][y] = 1;
+    }
+    for (int x = width - 2; x >= 0; x--) {
+        for (int y = 0; y < height; y++) {
+            if (d[x + 1][y] + 1 < d[x][y]) d[x][y] = d[x + 1][y] + 1;
+        }
+    }
+
+    for (int x = 0; x < width; x++) {
+        // Site i is column q = i - 1
+        f[0] = f[sites - 1] = 0;
+        for (int y = 0; y < height; y++) f[y + 1] = (int64_t)d[x][y] * d[x][y];
+        int k = 0;
+        v[0] = 0;
+        z[0] = -1e300;
+        z[1] = 1e300;
+        for (int q = 1; q < sites; q++) {
+            double s;
+            for (;;) {
+                int p = v[k];
+                s = ((double)(f[q] + (int64_t)q * q) - (double)(f[p] + (int64_t)p * p)) / (2.0 * (q - p));
+                if (s > z[k]) break;
+                k--;
+            }
+            k++;
+            v[k] = q;
+            z[k] = s;
+            z[k + 1] = 1e300;
+        }
+        k = 0;
+        for (int q = 1; q <= height; q++) {
+            while (z[k + 1] < q) k++;
+            int64_t dy = q - v[k];
+            d[x][q - 1] = (uint32_t)(dy * dy + f[v[k]]);
+        }
+    }
+    free(v);
+    free(z);
+    free(f);
+    return 0;
+}
+
+// Compute the distance map of a binary image (any non-zero pixel is
+// foreground). Returns -1 if it cannot be allocated.
+int distance_map_compute(distance_map_t* map, int width, int height, unsigned char binary_image[width][height],
+                         distance_metric_t metric) {
+    memset(map, 0, sizeof(*map));
+    if (width <= 0 || height <= 0) return -1;
+    map->distance = malloc((size_t)width * height * sizeof(uint32_t));
+    if (!map->distance) return -1;
+    map->width = width;
+    map->height = height;
+    map->metric = metric;
+    uint32_t (*d)[height] = (uint32_t (*)[height])map->distance;
+    if (metric == DISTANCE_EUCLIDEAN) {
+        if (euclidean(width, height, binary_image, d)) {
+            distance_map_free(map);
+            return -1;
+        }
+    } else {
+        chamfer(width, height, binary_image, d, metric == DISTANCE_CHESSBOARD);
+    }
+    return 0;
+}
+
+void distance_map_free(distance_map_t* map) {
+    free(map->distance);
+    map->distance = NULL;
+}
+
+// Erosion by `radius` from the map, written as the 0/1 pixels of erode()
+void distance_map_erode(const distance_map_t* map, int radius, unsigned char* output) {
+    uint32_t threshold = radius < 0 ? 0 : (uint32_t)radius;
+    if (map->metric == DISTANCE_EUCLIDEAN) threshold *= threshold;
+    size_t pixels = (size_t)map->width * map->height;
+    for (size_t i = 0; i < pixels; i++) output[i] = map->distance[i] > threshold;
+}
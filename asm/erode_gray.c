@@ -0,0 +1,360 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "erode.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GRAY_X86 1
+#endif
+
+// Grayscale erosion: the minimum over the active taps of the structuring
+// element, for 8- and 16-bit pixels.
+//
+// Each row of the element is split into runs of consecutive taps. A run of
+// length L is a sliding minimum along the image rows: short runs double a
+// window with shifted vector minimums, longer ones use the van Herk/Gil-Werman
+// algorithm in three operations per pixel for any L. For full rectangles (and
+// lines) the rows are combined by a second van Herk/Gil-Werman pass down the
+// columns, so the cost per pixel is the same for every rectangle size. A
+// cross is the minimum of its vertical and horizontal line, the same passes.
+//
+// Any other element (a disk) takes the minimum of its runs per output row,
+// each from the sliding minimum of an image row for that run length. Those
+// are made as a row enters the window and kept for the `rows` rows of the
+// window only: rows * distinct run lengths * height pixels. The lengths of
+// one image row are made shortest first, each from the one before with one
+// vector minimum when it at most doubles, so the cost per pixel is about one
+// vector minimum per run and per distinct length. It still grows with the
+// diameter of a disk, where a rectangle of any size costs the same.
+//
+// All minimums of whole rows go through a vectorised min kernel picked for
+// the CPU like the binary row kernels, ERODE_ISA caps the choice.
+
+typedef void (*min_u8_fn)(uint8_t* dst, const uint8_t* a, const uint8_t* b, size_t n);
+typedef void (*min_u16_fn)(uint16_t* dst, const uint16_t* a, const uint16_t* b, size_t n);
+
+static void min_u8_scalar(uint8_t* dst, const uint8_t* a, const uint8_t* b, size_t n) {
+    for (size_t i = 0; i < n; i++) dst[i] = a[i] < b[i] ? a[i] : b[i];
+}
+
+static void min_u16_scalar(uint16_t* dst, const uint16_t* a, const uint16_t* b, size_t n) {
+    for (size_t i = 0; i < n; i++) dst[i] = a[i] < b[i] ? a[i] : b[i];
+}
+
+#ifdef GRAY_X86
+
+__attribute__((target("sse2")))
+static void min_u8_sse2(uint8_t* dst, const uint8_t* a, const uint8_t* b, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_min_epu8(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+        _mm_storeu_si128((__m128i*)(dst + i), v);
+    }
+    min_u8_scalar(dst + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void min_u8_avx2(uint8_t* dst, const uint8_t* a, const uint8_t* b, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_min_epu8(_mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i)));
+        _mm256_storeu_si256((__m256i*)(dst + i), v);
+    }
+    min_u8_scalar(dst + i, a + i, b + i, n - i);
+}
+
+// Unsigned 16-bit min needs SSE4.1
+__attribute__((target("sse4.1")))
+static void min_u16_sse41(uint16_t* dst, const uint16_t* a, const uint16_t* b, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_min_epu16(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+        _mm_storeu_si128((__m128i*)(dst + i), v);
+    }
+    min_u16_scalar(dst + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void min_u16_avx2(uint16_t* dst, const uint16_t* a, const uint16_t* b, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i v = _mm256_min_epu16(_mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i)));
+        _mm256_storeu_si256((__m256i*)(dst + i), v);
+    }
+    min_u16_scalar(dst + i, a + i, b + i, n - i);
+}
+
+#endif
+
+static pthread_once_t gray_once = PTHREAD_ONCE_INIT;
+static min_u8_fn min_u8 = min_u8_scalar;
+static min_u16_fn min_u16 = min_u16_scalar;
+static const char* selected_gray_isa = "scalar";
+
+static void gray_pick(void) {
+#ifdef GRAY_X86
+    int limit = erode_isa_limit();
+    __builtin_cpu_init();
+    if (limit >= 2 && __builtin_cpu_supports("avx2")) {
+        min_u8 = min_u8_avx2;
+        min_u16 = min_u16_avx2;
+        selected_gray_isa = "avx2";
+    } else if (limit >= 1 && __builtin_cpu_supports("sse2")) {
+        min_u8 = min_u8_sse2;
+        selected_gray_isa = "sse2";
+        if (__builtin_cpu_supports("sse4.1")) {
+            min_u16 = min_u16_sse41;
+            selected_gray_isa = "sse4.1";
+        }
+    }
+#endif
+}
+
+static void gray_select(void) {
+    pthread_once(&gray_once, gray_pick);
+}
+
+const char* erode_gray_isa(void) {
+    gray_select();
+    return selected_gray_isa;
+}
+
+// The kernels are the same for both pixel types, instantiated per type
+#define GRAY_KERNELS(T, suffix, min_rows, white)                                                     \
+                                                                                                \
+/* out[s] = min(in[s], ..., in[s + k - 1]) for s in [0, n - k]; g and h hold n pixels */         \
+static void sliding_min_##suffix(const T* in, T* out, T* g, T* h, int n, int k) {               \
+    if (k < 16) {                                                                               \
+        /* Short runs: double the window with shifted vector minimums up to the largest        \
+           power of two p <= k, then cover k with two overlapping windows of p */               \
+        memcpy(out, in, n * sizeof(T));                                                         \
+        int p = 1;                                                                              \
+        for (; 2 * p <= k; p *= 2) min_rows(out, out, out + p, n - 2 * p + 1);                  \
+        if (p < k) min_rows(out, out, out + k - p, n - k + 1);                                  \
+        return;                                                                                 \
+    }                                                                                           \
+    /* Prefix minimum g and suffix minimum h inside blocks of k pixels; the window            \
+       starting at s is min(h[s], g[s + k - 1]) */                                              \
+    for (int b = 0; b < n; b += k) {                                                            \
+        int e = b + k < n ? b + k : n;                                                          \
+        g[b] = in[b];                                                                           \
+        for (int i = b + 1; i < e; i++) g[i] = in[i] < g[i - 1] ? in[i] : g[i - 1];             \
+        h[e - 1] = in[e - 1];                                                                   \
+        for (int i = e - 2; i >= b; i--) h[i] = in[i] < h[i + 1] ? in[i] : h[i + 1];            \
+    }                                                                                           \
+    min_rows(out, h, g + k - 1, n - k + 1);                                                     \
+}                                                                                               \
+                                                                                                \
+static void clear_border_##suffix(int width, int height, T (*image)[height], int rx, int ry) {  \
+    for (int x = 0; x < width; x++) {                                                           \
+        if (x < rx || x >= width - rx) {                                                        \
+            memset(image[x], 0, height * sizeof(T));                                            \
+            continue;                                                                           \
+        }                                                                                       \
+        for (int y = 0; y < ry && y < height; y++) {                                            \
+            image[x][y] = 0;                                                                    \
+            image[x][height - 1 - y] = 0;                                                       \
+        }                                                                                       \
+    }                                                                                           \
+}                                                                                               \
+                                                                                                \
+/* Rectangle: sliding minimum along the rows into runs, then a van Herk/Gil-Werman pass         \
+   down the columns, a whole row at a time */                                                   \
+static int erode_gray_rect_##suffix(int width, int height, T (*image)[height], int rows, int cols) { \
+    size_t row_bytes = (size_t)height * sizeof(T);                                              \
+    T (*runs)[height] = malloc((size_t)width * row_bytes);                                      \
+    T (*h)[height] = malloc((size_t)width * row_bytes);                                         \
+    T* line = malloc(3 * row_bytes);                                                            \
+    if (!runs || !h || !line) {                                                                 \
+        free(runs);                                                                             \
+        free(h);                                                                                \
+        free(line);                                                                             \
+        return -1;                                                                              \
+    }                                                                                           \
+    for (int x = 0; x < width; x++) {                                                           \
+        sliding_min_##suffix(image[x], runs[x], line, line + height, height, cols);             \
+    }                                                                                           \
+    int rx = rows / 2;                                                                          \
+    int ry = cols / 2;                                                                          \
+    int span = height - cols + 1;   /* columns with a full window */                            \
+    /* Suffix minimum h within blocks of `rows` rows, from the bottom */                         \
+    for (int x = width - 1; x >= 0; x--) {                                                      \
+        if (x % rows == rows - 1 || x == width - 1) memcpy(h[x], runs[x], span * sizeof(T));    \
+        else min_rows(h[x], h[x + 1], runs[x], span);                                           \
+    }                                                                                           \
+    /* Prefix minimum g streamed from the top; the window starting at row s ends at             \
+       t = s + rows - 1 and its minimum is min(h[s], g[t]) */                                   \
+    T* g = line;                                                                                \
+    for (int t = 0; t < width; t++) {                                                           \
+        if (t % rows == 0) memcpy(g, runs[t], span * sizeof(T));                                \
+        else min_rows(g, g, runs[t], span);                                                     \
+        int s = t - rows + 1;                                                                   \
+        if (s >= 0) min_rows(image[s + rx] + ry, h[s], g, span);                                \
+    }                                                                                           \
+    clear_border_##suffix(width, height, image, rx, ry);                                        \
+    free(runs);                                                                                 \
+    free(h);                                                                                    \
+    free(line);                                                                                 \
+    return 0;                                                                                   \
+}                                                                                               \
+                                                                                                \
+/* Cross: the union of a vertical and a horizontal line, so its erosion is the minimum of        \
+   the two line erosions. The vertical one is the van Herk/Gil-Werman pass of the rectangle,    \
+   streamed with the suffix minimums of only two blocks of rows kept; the horizontal one is     \
+   a sliding minimum of the output row, which is still unchanged when it is written */          \
+static int erode_gray_cross_##suffix(int width, int height, T (*image)[height], int rows, int cols) { \
+    size_t row_bytes = (size_t)height * sizeof(T);                                              \
+    T* h = malloc(2 * (size_t)rows * row_bytes);                                                \
+    T* line = malloc(4 * row_bytes);                                                            \
+    if (!h || !line) {                                                                          \
+        free(h);                                                                                \
+        free(line);                                                                             \
+        return -1;                                                                              \
+    }                                                                                           \
+    int rx = rows / 2, ry = cols / 2;                                                           \
+    int span = height - cols + 1;                                                               \
+    T* across = line + 2 * height;                                                              \
+    T* g = line + 3 * height;                                                                   \
+    for (int t = 0; t < width; t++) {                                                           \
+        if (t % rows == 0) {                                                                    \
+            /* Suffix minimums of the block starting at t, from its last row up */              \
+            T* block = h + (size_t)(t / rows % 2) * rows * height;                              \
+            int end = t + rows < width ? t + rows : width;                                      \
+            memcpy(block + (size_t)(end - 1 - t) * height, image[end - 1], row_bytes);          \
+            for (int x = end - 2; x >= t; x--) {                                                \
+                min_rows(block + (size_t)(x - t) * height, block + (size_t)(x - t + 1) * height, image[x], height); \
+            }                                                                                   \
+            memcpy(g, image[t], row_bytes);                                                     \
+        } else {                                                                                \
+            min_rows(g, g, image[t], height);                                                   \
+        }                                                                                       \
+        /* The window of rows s to t is complete */                                             \
+        int s = t - rows + 1;                                                                   \
+        if (s < 0) continue;                                                                    \
+        int x = s + rx;                                                                         \
+        sliding_min_##suffix(image[x], across, line, line + height, height, cols);              \
+        min_rows(line, h + ((size_t)(s / rows % 2) * rows + s % rows) * height, g, height);     \
+        min_rows(image[x] + ry, line + ry, across, span);                                       \
+    }                                                                                           \
+    clear_border_##suffix(width, height, image, rx, ry);                                        \
+    free(h);                                                                                    \
+    free(line);                                                                                 \
+    return 0;                                                                                   \
+}                                                                                               \
+                                                                                                \
+/* Any other element: per output row, the minimum over the runs of the element, each a          \
+   sliding minimum of an image row. An image row gets its sliding minimums for every run        \
+   length as it enters the window and keeps them in a ring of `rows` rows, so the image can     \
+   be overwritten behind the window */                                                          \
+static int erode_gray_runs_##suffix(int width, int height, T (*image)[height],                  \
+                                    const structuring_element_t* se) {                          \
+    int rows = se->rows, cols = se->cols;                                                       \
+    int rx = rows / 2, ry = cols / 2;                                                           \
+    int span = height - 2 * ry;     /* output columns */                                        \
+    size_t row_bytes = (size_t)height * sizeof(T);                                              \
+    int* length_slot = calloc(cols + 1, sizeof(int));  /* run length -> cache slot + 1 */       \
+    int* lengths = malloc(cols * sizeof(int));                                                  \
+    T* line = malloc(2 * row_bytes);                                                            \
+    T* out = malloc(row_bytes);                                                                 \
+    T* cache = NULL;                                                                            \
+    int status = -1, distinct = 0;                                                              \
+    if (!length_slot || !lengths || !line || !out) goto done;                                   \
+    for (int i = 0; i < rows; i++) {                                                            \
+        for (int j = 0; j < cols; j++) {                                                        \
+            if (!se->mask[i * cols + j] || (j > 0 && se->mask[i * cols + j - 1])) continue;     \
+            int k = j;                                                                          \
+            while (k < cols && se->mask[i * cols + k]) k++;                                    \
+            length_slot[k - j] = 1;                                                             \
+        }                                                                                       \
+    }                                                                                           \
+    for (int length = 1; length <= cols; length++) {                                            \
+        if (!length_slot[length]) continue;                                                     \
+        lengths[distinct] = length;                                                             \
+        length_slot[length] = ++distinct;                                                       \
+    }                                                                                           \
+    if (distinct == 0) {                                                                        \
+        /* No taps: the minimum over nothing is white */                                        \
+        for (int x = 0; x < width; x++) {                                                       \
+            for (int y = 0; y < height; y++) image[x][y] = white;                               \
+        }                                                                                       \
+        clear_border_##suffix(width, height, image, rx, ry);                                    \
+        status = 0;                                                                             \
+        goto done;                                                                              \
+    }                                                                                           \
+    cache = malloc((size_t)rows * distinct * row_bytes);                                        \
+    if (!cache) goto done;                                                                      \
+    for (int x = rx; x < width - rx; x++) {                                                     \
+        /* Image rows x - rx to x - rx + rows - 1 are in the window; output row x is            \
+           written only after the row entered it */                                             \
+        int last = x - rx + rows - 1;                                                           \
+        for (int r = x == rx ? 0 : last; r <= last; r++) {                                      \
+            T* slot = cache + (size_t)(r % rows) * distinct * height;                           \
+            /* Lengths go up, and a window at most twice the previous one is the minimum of     \
+               two overlapping windows of that one */                                           \
+            for (int d = 0; d < distinct; d++) {                                                \
+                T* run = slot + (size_t)d * height;                                             \
+                int grow = d > 0 ? lengths[d] - lengths[d - 1] : 0;                             \
+                if (d > 0 && grow <= lengths[d - 1]) min_rows(run, run - height, run - height + grow, height - lengths[d] + 1); \
+                else sliding_min_##suffix(image[r], run, line, line + height, height, lengths[d]); \
+            }                                                                                   \
+        }                                                                                       \
+        int first = 1;                                                                          \
+        for (int i = 0; i < rows; i++) {                                                        \
+            const T* slot = cache + (size_t)((x + i - rx) % rows) * distinct * height;          \
+            for (int j = 0; j < cols; j++) {                                                    \
+                if (!se->mask[i * cols + j] || (j > 0 && se->mask[i * cols + j - 1])) continue; \
+                int k = j;                                                                      \
+                while (k < cols && se->mask[i * cols + k]) k++;                                \
+                const T* run = slot + (size_t)(length_slot[k - j] - 1) * height + j;            \
+                if (first) memcpy(out, run, span * sizeof(T));                                  \
+                else min_rows(out, out, run, span);                                             \
+                first = 0;                                                                      \
+            }                                                                                   \
+        }                                                                                       \
+        memcpy(image[x] + ry, out, span * sizeof(T));                                           \
+    }                                                                                           \
+    clear_border_##suffix(width, height, image, rx, ry);                                        \
+    status = 0;                                                                                 \
+done:                                                                                           \
+    free(length_slot);                                                                          \
+    free(lengths);                                                                              \
+    free(line);                                                                                 \
+    free(out);                                                                                  \
+    free(cache);                                                                                \
+    return status;                                                                              \
+}                                                                                               \
+                                                                                                \
+static int erode_gray_##suffix(int width, int height, T (*image)[height], const structuring_element_t* se) { \
+    if (!se->mask || width <= 0 || height <= 0) return -1;                                      \
+    gray_select();                                                                              \
+    int rows = se->rows, cols = se->cols;                                                       \
+    if (width < rows || height < cols) {                                                        \
+        clear_border_##suffix(width, height, image, rows / 2, cols / 2);                        \
+        return 0;                                                                               \
+    }                                                                                           \
+    int full = 1;                                                                               \
+    for (int i = 0; i < rows * cols; i++) full &= se->mask[i] != 0;                             \
+    if (full) return erode_gray_rect_##suffix(width, height, image, rows, cols);                \
+    int cross = 1;                                                                              \
+    for (int i = 0; i < rows * cols; i++) cross &= (se->mask[i] != 0) == (i / cols == rows / 2 || i % cols == cols / 2); \
+    if (cross) return erode_gray_cross_##suffix(width, height, image, rows, cols);              \
+    return erode_gray_runs_##suffix(width, height, image, se);                                  \
+}
+
+GRAY_KERNELS(uint8_t, u8, min_u8, UINT8_MAX)
+GRAY_KERNELS(uint16_t, u16, min_u16, UINT16_MAX)
+
+// Erode an 8-bit grayscale image in place: every pixel becomes the minimum
+// over the active taps of se. Pixels closer to the border than the element
+// radius are cleared as in erode_se(), so thresholding the result gives the
+// same image as erode_se() on the thresholded input.
+// Returns -1 on an invalid element or allocation failure.
+int erode_gray8(int width, int height, uint8_t image[width][height], const structuring_element_t* se) {
+    return erode_gray_u8(width, height, image, se);
+}
+
+// The same for 16-bit pixels
+int erode_gray16(int width, int height, uint16_t image[width][height], const structuring_element_t* se) {
+    return erode_gray_u16(width, height, image, se);
+}
@@ -0,0 +1,37 @@
+#include <stdlib.h>
+#include <string.h>
+#include "erode.h"
+
+// Erode rows [first, end) in place, streaming top to bottom like a hardware
+// line buffer: each row is copied once into a two-row ring before it is
+// overwritten, so the original row above and the current row are always
+// available and the row below has not been touched yet.
+// `above` is the original row first - 1 (ignored when first == 0) and
+// `below` the original row end (ignored when end == width); pass the image
+// rows themselves if nobody else modifies them. `ring` holds 2 * height bytes.
+void erode_rows_inplace(int width, int height, unsigned char binary_image[width][height], int first, int end,
+                        const unsigned char* above, const unsigned char* below, unsigned char* ring, erode_row_fn kernel) {
+    const unsigned char* prev = above;
+    for (int x = first; x < end; x++) {
+        unsigned char* saved = ring + (x & 1) * (size_t)height;
+        memcpy(saved, binary_image[x], height);
+        if (x == 0 || x == width - 1) {
+            memset(binary_image[x], 0, height);
+        } else {
+            const unsigned char* down = (x + 1 < end) ? binary_image[x + 1] : below;
+            kernel(prev, saved, down, binary_image[x], height);
+        }
+        prev = saved;
+    }
+}
+
+// In-place erosion with O(height) extra memory instead of a full temp image.
+// Same output as erode(). Returns -1 if the line buffer cannot be allocated.
+int erode_inplace(int width, int height, unsigned char binary_image[width][height]) {
+    if (width <= 0 || height <= 0) return 0;
+    unsigned char* ring = malloc(2 * (size_t)height);
+    if (!ring) return -1;
+    erode_rows_inplace(width, height, binary_image, 0, width, NULL, NULL, ring, erode_row_select());
+    free(ring);
+    return 0;
+}
@@ -0,0 +1,81 @@
+#include <stdlib.h>
+#include <string.h>
+#include "erode.h"
+
+// Allocate a zeroed packed image
+int packed_image_alloc(packed_image_t* packed, int width, int height) {
+    packed->width = width;
+    packed->height = height;
+    packed->words_per_row = (height + 63) / 64;
+    packed->words = calloc((size_t)width * packed->words_per_row, sizeof(uint64_t));
+    return packed->words ? 0 : -1;
+}
+
+void packed_image_free(packed_image_t* packed) {
+    free(packed->words);
+    packed->words = NULL;
+}
+
+// Pack a binary image, any non-zero pixel becomes a 1 bit. Padding bits stay 0.
+void pack_image(int width, int height, unsigned char binary_image[width][height], packed_image_t* packed) {
+    int n = packed->words_per_row;
+    for (int x = 0; x < width; x++) {
+        uint64_t* row = packed->words + (size_t)x * n;
+        for (int w = 0; w < n; w++) {
+            int base = w * 64;
+            int count = height - base < 64 ? height - base : 64;
+            uint64_t word = 0;
+            for (int i = 0; i < count; i++) {
+                word |= (uint64_t)(binary_image[x][base + i] != 0) << i;
+            }
+            row[w] = word;
+        }
+    }
+}
+
+// Unpack to one byte per pixel with the 0/1 values written by erode()
+void unpack_image(const packed_image_t* packed, int width, int height, unsigned char binary_image[width][height]) {
+    int n = packed->words_per_row;
+    for (int x = 0; x < width; x++) {
+        const uint64_t* row = packed->words + (size_t)x * n;
+        for (int y = 0; y < height; y++) {
+            binary_image[x][y] = (row[y >> 6] >> (y & 63)) & 1;
+        }
+    }
+}
+
+// Cross-shaped erosion on packed rows. A pixel survives if it and its four
+// neighbours are set: AND of the row above, the row below and the current row
+// shifted one pixel left and right. Border pixels are cleared as in erode().
+// dst must have the same size as src and must not alias it.
+void erode_packed(const packed_image_t* src, packed_image_t* dst) {
+    int width = src->width;
+    int height = src->height;
+    int n = src->words_per_row;
+    if (width <= 0 || n == 0) return;
+
+    uint64_t last_mask = (height % 64) ? ((uint64_t)1 << (height % 64)) - 1 : ~(uint64_t)0;
+    last_mask &= ~((uint64_t)1 << ((height - 1) & 63));    // right border column
+
+    memset(dst->words, 0, n * sizeof(uint64_t));
+    memset(dst->words + (size_t)(width - 1) * n, 0, n * sizeof(uint64_t));
+
+    for (int x = 1; x < width - 1; x++) {
+        const uint64_t* up = src->words + (size_t)(x - 1) * n;
+        const uint64_t* cur = up + n;
+        const uint64_t* down = cur + n;
+        uint64_t* out = dst->words + (size_t)x * n;
+
+        uint64_t carry = 0;     // top bit of the previous word, i.e. pixel to the left
+        for (int w = 0; w < n; w++) {
+            uint64_t c = cur[w];
+            uint64_t next = (w + 1 < n) ? cur[w + 1] : 0;
+            uint64_t left = (c << 1) | carry;
+            uint64_t right = (c >> 1) | (next << 63);
+            out[w] = c & up[w] & down[w] & left & right;
+            carry = c >> 63;
+        }
+        out[0] &= ~(uint64_t)1;    // left border column
+        out[n - 1] &= last_mask;
+    }
+}
@@ -0,0 +1,205 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "erode.h"
+
+// Persistent pool of worker threads. The calling thread acts as worker 0,
+// so a pool of N threads starts N - 1 pthreads.
+struct erode_pool {
+    int threads;
+    pthread_t* handles;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned long generation;   // incremented for every job
+    int pending;                // workers still running the current job
+    int shutdown;
+    erode_pool_job_fn job;
+    void* arg;
+
+    // Scratch for erode_parallel(), grown on demand
+    unsigned char* scratch;
+    size_t scratch_size;
+};
+
+typedef struct {
+    erode_pool_t* pool;
+    int index;
+} worker_start_t;
+
+static void* worker_main(void* p) {
+    worker_start_t start = *(worker_start_t*)p;
+    free(p);
+    erode_pool_t* pool = start.pool;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->generation == seen && !pool->shutdown) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->shutdown) break;
+        seen = pool->generation;
+        erode_pool_job_fn job = pool->job;
+        void* arg = pool->arg;
+        pthread_mutex_unlock(&pool->lock);
+
+        job(arg, start.index, pool->threads);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0) pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Create a pool. threads <= 0 uses $ERODE_THREADS, or else one per online CPU.
+erode_pool_t* erode_pool_create(int threads) {
+    if (threads <= 0) {
+        const char* env = getenv("ERODE_THREADS");
+        threads = env ? atoi(env) : 0;
+    }
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0) threads = 1;
+
+    erode_pool_t* pool = calloc(1, sizeof(erode_pool_t));
+    if (!pool) return NULL;
+    pool->threads = threads;
+    pool->handles = calloc(threads, sizeof(pthread_t));
+    if (!pool->handles) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (int i = 1; i < threads; i++) {
+        worker_start_t* start = malloc(sizeof(worker_start_t));
+        if (start) {
+            start->pool = pool;
+            start->index = i;
+        }
+        if (!start || pthread_create(&pool->handles[i], NULL, worker_main, start) != 0) {
+            free(start);
+            pool->threads = i;  // keep the workers that did start
+            break;
+        }
+    }
+    return pool;
+}
+
+void erode_pool_destroy(erode_pool_t* pool) {
+    if (!pool) return;
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 1; i < pool->threads; i++) {
+        pthread_join(pool->handles[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    free(pool->scratch);
+    free(pool->handles);
+    free(pool);
+}
+
+int erode_pool_threads(const erode_pool_t* pool) {
+    return pool->threads;
+}
+
+// Run job(arg, index, count) on every worker and wait for all of them
+void erode_pool_run(erode_pool_t* pool, erode_pool_job_fn job, void* arg) {
+    if (pool->threads > 1) {
+        pthread_mutex_lock(&pool->lock);
+        pool->job = job;
+        pool->arg = arg;
+        pool->pending = pool->threads - 1;
+        pool->generation++;
+        pthread_cond_broadcast(&pool->start);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    job(arg, 0, pool->threads);
+
+    if (pool->threads > 1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->pending > 0) {
+            pthread_cond_wait(&pool->done, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+typedef struct {
+    int width;
+    int height;
+    int bands;
+    unsigned char* image;
+    unsigned char* halos;       // per band: copy of its first row, then of its last row
+    unsigned char* rings;       // per band: two rows of original values
+    erode_row_fn kernel;
+} band_job_t;
+
+static void band_range(const band_job_t* job, int band, int* first, int* end) {
+    *first = (int)((long long)job->width * band / job->bands);
+    *end = (int)((long long)job->width * (band + 1) / job->bands);
+}
+
+// Phase 1: publish the original first and last row of each band
+static void band_save_halos(void* p, int index, int count) {
+    band_job_t* job = p;
+    (void)count;
+    if (index >= job->bands) return;
+    int first, end;
+    band_range(job, index, &first, &end);
+    size_t row = job->height;
+    memcpy(job->halos + (2 * (size_t)index) * row, job->image + first * row, row);
+    memcpy(job->halos + (2 * (size_t)index + 1) * row, job->image + (end - 1) * row, row);
+}
+
+// Phase 2: erode the band in place, using the neighbouring bands' saved rows
+// as halos. Border rows and columns are cleared in the same pass.
+static void band_erode(void* p, int index, int count) {
+    band_job_t* job = p;
+    (void)count;
+    if (index >= job->bands) return;
+    int first, end;
+    band_range(job, index, &first, &end);
+    size_t row = job->height;
+    const unsigned char* above = index > 0 ? job->halos + (2 * (size_t)index - 1) * row : NULL;
+    const unsigned char* below = index + 1 < job->bands ? job->halos + (2 * (size_t)index + 2) * row : NULL;
+    erode_rows_inplace(job->width, job->height, (unsigned char (*)[job->height])job->image, first, end,
+                       above, below, job->rings + 2 * (size_t)index * row, job->kernel);
+}
+
+// Band-parallel in-place erosion, same output as erode() for any thread count.
+// Calls on the same pool must not overlap. Returns -1 if scratch allocation fails.
+int erode_parallel(erode_pool_t* pool, int width, int height, unsigned char binary_image[width][height]) {
+    if (width <= 0 || height <= 0) return 0;
+
+    band_job_t job;
+    job.width = width;
+    job.height = height;
+    job.bands = pool->threads < width ? pool->threads : width;
+    job.image = &binary_image[0][0];
+    job.kernel = erode_row_select();
+
+    // Two halo rows and two ring rows per band
+    size_t needed = 4 * (size_t)job.bands * height;
+    if (pool->scratch_size < needed) {
+        unsigned char* scratch = realloc(pool->scratch, needed);
+        if (!scratch) return -1;
+        pool->scratch = scratch;
+        pool->scratch_size = needed;
+    }
+    job.halos = pool->scratch;
+    job.rings = pool->scratch + 2 * (size_t)job.bands * height;
+
+    erode_pool_run(pool, band_save_halos, &job);
+    erode_pool_run(pool, band_erode, &job);
+    return 0;
+}
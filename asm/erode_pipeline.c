@@ -0,0 +1,188 @@
+#include <stdlib.h>
+#include <string.h>
+#include "erode.h"
+
+// Fused morphology. Every stage is a line-buffered row filter: it keeps the
+// last `window` rows of its input in a ring and emits an output row as soon as
+// all rows it depends on have arrived. Rows are pushed from the image through
+// all stages while they are still in cache, so the image is read once and
+// written once no matter how many stages there are.
+
+typedef struct {
+    int dx;
+    int dy;
+} morph_tap_t;
+
+typedef struct {
+    morph_op_t op;
+    int rx;
+    int ry;
+    int window;             // 2 * rx + 1 input rows
+    int tap_count;
+    morph_tap_t* taps;
+    unsigned char* ring;    // window rows, input row x in slot x % window
+    int received;           // input rows received so far
+    int next_out;           // next output row to produce
+} stage_state_t;
+
+// Binary dilation: a pixel is set if any tap of the reflected element hits a
+// set pixel. Samples outside the image count as background, and no border is
+// cleared. Returns -1 on allocation failure.
+int dilate_se(int width, int height, unsigned char binary_image[width][height], const structuring_element_t* se) {
+    if (!se->mask || width <= 0 || height <= 0) return -1;
+    unsigned char (*temp_image)[height] = malloc((size_t)width * height);
+    if (!temp_image) return -1;
+    memcpy(temp_image, binary_image, (size_t)width * height);
+    int rx = se->rows / 2;
+    int ry = se->cols / 2;
+    for (int x = 0; x < width; x++) {
+        for (int y = 0; y < height; y++) {
+            int dilation_result = 0;
+            for (int i = 0; i < se->rows; i++) {
+                for (int j = 0; j < se->cols; j++) {
+                    int entry_x = x - (i - rx);
+                    int entry_y = y - (j - ry);
+                    if (se->mask[i * se->cols + j] && entry_x >= 0 && entry_x < width &&
+                        entry_y >= 0 && entry_y < height && temp_image[entry_x][entry_y]) {
+                        dilation_result = 1;
+                    }
+                }
+            }
+            binary_image[x][y] = dilation_result;
+        }
+    }
+    free(temp_image);
+    return 0;
+}
+
+static const unsigned char* stage_input(const stage_state_t* st, int x, int height) {
+    return st->ring + (size_t)(x % st->window) * height;
+}
+
+// Compute output row x of a stage, same result as erode_se()/dilate_se()
+static void stage_row(const stage_state_t* st, int width, int height, int x, unsigned char* out) {
+    if (st->op == MORPH_ERODE) {
+        if (x < st->rx || x >= width - st->rx || height <= 2 * st->ry) {
+            memset(out, 0, height);
+            return;
+        }
+        for (int y = st->ry; y < height - st->ry; y++) {
+            out[y] = 1;
+        }
+        for (int t = 0; t < st->tap_count; t++) {
+            const unsigned char* src = stage_input(st, x + st->taps[t].dx, height) + st->taps[t].dy;
+            for (int y = st->ry; y < height - st->ry; y++) {
+                out[y] &= src[y] != 0;
+            }
+        }
+        memset(out, 0, st->ry);
+        memset(out + height - st->ry, 0, st->ry);
+    } else {
+        memset(out, 0, height);
+        for (int t = 0; t < st->tap_count; t++) {
+            int src_x = x - st->taps[t].dx;
+            int dy = st->taps[t].dy;
+            if (src_x < 0 || src_x >= width) continue;
+            const unsigned char* src = stage_input(st, src_x, height) - dy;
+            int first = dy > 0 ? dy : 0;
+            int end = dy < 0 ? height + dy : height;
+            for (int y = first; y < end; y++) {
+                out[y] |= src[y] != 0;
+            }
+        }
+    }
+}
+
+// Hand input row x (already stored in the stage's ring) to stage s and push
+// every output row that became ready on to the next stage, or to the image.
+static void stage_push(stage_state_t* stages, int count, int s, int width, int height, unsigned char* image) {
+    stage_state_t* st = &stages[s];
+    st->received++;
+    while (st->next_out < width &&
+           (st->next_out + st->rx < st->received || st->received == width)) {
+        int x = st->next_out++;
+        if (s + 1 < count) {
+            stage_state_t* next = &stages[s + 1];
+            stage_row(st, width, height, x, next->ring + (size_t)(x % next->window) * height);
+            stage_push(stages, count, s + 1, width, height, image);
+        } else {
+            // Input row x was consumed by the first stage long ago
+            stage_row(st, width, height, x, image + (size_t)x * height);
+        }
+    }
+}
+
+// Run the stages on the image in one fused sweep. The result is identical to
+// applying erode_se()/dilate_se() stage by stage. Returns -1 on an invalid
+// element or allocation failure.
+int morph_pipeline(int width, int height, unsigned char binary_image[width][height], const morph_stage_t* stages, int stage_count) {
+    if (width <= 0 || height <= 0 || stage_count <= 0) return 0;
+    stage_state_t* state = calloc(stage_count, sizeof(stage_state_t));
+    if (!state) return -1;
+
+    int result = 0;
+    for (int s = 0; s < stage_count && result == 0; s++) {
+        const structuring_element_t* se = stages[s].se;
+        stage_state_t* st = &state[s];
+        st->op = stages[s].op;
+        st->rx = se->rows / 2;
+        st->ry = se->cols / 2;
+        st->window = se->rows;
+        st->taps = malloc((size_t)se->rows * se->cols * sizeof(morph_tap_t));
+        st->ring = malloc((size_t)st->window * height);
+        if (!se->mask || !st->taps || !st->ring) {
+            result = -1;
+            break;
+        }
+        for (int i = 0; i < se->rows; i++) {
+            for (int j = 0; j < se->cols; j++) {
+                if (se->mask[i * se->cols + j]) {
+                    st->taps[st->tap_count].dx = i - st->rx;
+                    st->taps[st->tap_count].dy = j - st->ry;
+                    st->tap_count++;
+                }
+            }
+        }
+    }
+
+    if (result == 0) {
+        unsigned char* image = &binary_image[0][0];
+        for (int x = 0; x < width; x++) {
+            memcpy(state[0].ring + (size_t)(x % state[0].window) * height, binary_image[x], height);
+            stage_push(state, stage_count, 0, width, height, image);
+        }
+    }
+
+    for (int s = 0; s < stage_count; s++) {
+        free(state[s].taps);
+        free(state[s].ring);
+    }
+    free(state);
+    return result;
+}
+
+// Opening: erosion followed by dilation
+int morph_open(int width, int height, unsigned char binary_image[width][height], const structuring_element_t* se) {
+    morph_stage_t stages[2] = {{MORPH_ERODE, se}, {MORPH_DILATE, se}};
+    return morph_pipeline(width, height, binary_image, stages, 2);
+}
+
+// Closing: dilation followed by erosion
+int morph_close(int width, int height, unsigned char binary_image[width][height], const structuring_element_t* se) {
+    morph_stage_t stages[2] = {{MORPH_DILATE, se}, {MORPH_ERODE, se}};
+    return morph_pipeline(width, height, binary_image, stages, 2);
+}
+
+// Erode `steps` times with the same element
+int erode_steps(int width, int height, unsigned char binary_image[width][height], const structuring_element_t* se, int steps) {
+    if (steps <= 0) return 0;
+    morph_stage_t* stages = malloc((size_t)steps * sizeof(morph_stage_t));
+    if (!stages) return -1;
+    for (int i = 0; i < steps; i++) {
+        stages[i].op = MORPH_ERODE;
+        stages[i].se = se;
+    }
+    int result = morph_pipeline(width, height, binary_image, stages, steps);
+    free(stages);
+    return result;
+}
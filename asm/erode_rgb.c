@@ -0,0 +1,257 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "erode.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RGB_X86 1
+#endif
+
+// Thresholding, erosion and overlay of an interleaved colour image in one
+// sweep. The grey level of a pixel is the average of its first three
+// channels (or its only channel), and it is foreground when that is above
+// the threshold. Rows are thresholded one ahead of the erosion into a ring
+// of three mask rows, so row x is eroded as soon as row x + 1 is read; the
+// overlay then paints row x while it is still in the cache from being read.
+// Every source pixel comes from memory once, instead of once for each of
+// the grey, erosion and overlay passes.
+//
+// Otsu's threshold needs the histogram before the first row can be
+// thresholded; it is taken from every 8th row only (all rows of small
+// images), so the pre-pass reads an eighth of the image.
+//
+// Three-channel rows are split into their channels sixteen pixels at a time
+// with SSSE3 byte shuffles when the CPU has them (ERODE_ISA=scalar or sse2
+// turns that off), and summed in 16-bit lanes. The overlay spreads sixteen mask
+// bytes over the 48 bytes of their pixels the same way and blends the colour
+// in; blocks without a set pixel are not written, so background stays clean
+// in the cache.
+
+#define OTSU_ROW_STEP 8
+
+// Foreground when the channel sum is above this: (sum / 3 > t) == (sum > 3t + 2)
+static int sum_limit(int channels, int threshold) {
+    return channels == 1 ? threshold : 3 * threshold + 2;
+}
+
+typedef void (*threshold_rgb_fn)(const unsigned char* pixels, int height, int limit, unsigned char* mask);
+typedef void (*paint_rgb_fn)(unsigned char* pixels, const unsigned char* mask, int height, const unsigned char* colour);
+
+static void threshold_rgb_scalar(const unsigned char* pixels, int height, int limit, unsigned char* mask) {
+    for (int y = 0; y < height; y++) mask[y] = pixels[3 * y] + pixels[3 * y + 1] + pixels[3 * y + 2] > limit;
+}
+
+static void paint_rgb_scalar(unsigned char* pixels, const unsigned char* mask, int height, const unsigned char* colour) {
+    for (int y = 0; y < height; y++) {
+        if (mask[y]) {
+            pixels[3 * y] = colour[0];
+            pixels[3 * y + 1] = colour[1];
+            pixels[3 * y + 2] = colour[2];
+        }
+    }
+}
+
+#ifdef RGB_X86
+
+// rgb_shuffle[k][v] moves channel k of the pixels in the v-th 16 bytes of a
+// 48-byte block to their pixel positions, and zeroes the rest.
+// rgb_spread[v] repeats each pixel's mask byte over its bytes in the v-th 16.
+static unsigned char rgb_shuffle[3][3][16];
+static unsigned char rgb_spread[3][16];
+
+__attribute__((target("ssse3")))
+static void threshold_rgb_ssse3(const unsigned char* pixels, int height, int limit, unsigned char* mask) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i bound = _mm_set1_epi16((short)limit);
+    __m128i shuffle[3][3];
+    for (int k = 0; k < 3; k++) {
+        for (int v = 0; v < 3; v++) shuffle[k][v] = _mm_loadu_si128((const __m128i*)rgb_shuffle[k][v]);
+    }
+    int y = 0;
+    for (; y + 16 <= height; y += 16) {
+        const unsigned char* p = pixels + 3 * y;
+        __m128i block[3] = {
+            _mm_loadu_si128((const __m128i*)p),
+            _mm_loadu_si128((const __m128i*)(p + 16)),
+            _mm_loadu_si128((const __m128i*)(p + 32))
+        };
+        __m128i low = zero, high = zero;
+        for (int k = 0; k < 3; k++) {
+            __m128i channel = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(block[0], shuffle[k][0]),
+                                                        _mm_shuffle_epi8(block[1], shuffle[k][1])),
+                                           _mm_shuffle_epi8(block[2], shuffle[k][2]));
+            low = _mm_add_epi16(low, _mm_unpacklo_epi8(channel, zero));
+            high = _mm_add_epi16(high, _mm_unpackhi_epi8(channel, zero));
+        }
+        __m128i set = _mm_packs_epi16(_mm_cmpgt_epi16(low, bound), _mm_cmpgt_epi16(high, bound));
+        _mm_storeu_si128((__m128i*)(mask + y), _mm_and_si128(set, one));
+    }
+    threshold_rgb_scalar(pixels + 3 * y, height - y, limit, mask + y);
+}
+
+__attribute__((target("ssse3")))
+static void paint_rgb_ssse3(unsigned char* pixels, const unsigned char* mask, int height, const unsigned char* colour) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i spread[3], fill[3];
+    for (int v = 0; v < 3; v++) {
+        unsigned char pattern[16];
+        for (int i = 0; i < 16; i++) pattern[i] = colour[(16 * v + i) % 3];
+        spread[v] = _mm_loadu_si128((const __m128i*)rgb_spread[v]);
+        fill[v] = _mm_loadu_si128((const __m128i*)pattern);
+    }
+    int y = 0;
+    for (; y + 16 <= height; y += 16) {
+        __m128i set = _mm_cmpgt_epi8(_mm_loadu_si128((const __m128i*)(mask + y)), zero);
+        if (!_mm_movemask_epi8(set)) continue;
+        unsigned char* p = pixels + 3 * y;
+        for (int v = 0; v < 3; v++) {
+            __m128i select = _mm_shuffle_epi8(set, spread[v]);
+            __m128i old = _mm_loadu_si128((const __m128i*)(p + 16 * v));
+            _mm_storeu_si128((__m128i*)(p + 16 * v), _mm_or_si128(_mm_andnot_si128(select, old), _mm_and_si128(select, fill[v])));
+        }
+    }
+    paint_rgb_scalar(pixels + 3 * y, mask + y, height - y, colour);
+}
+
+#endif
+
+static pthread_once_t rgb_once = PTHREAD_ONCE_INIT;
+static threshold_rgb_fn threshold_rgb = threshold_rgb_scalar;
+static paint_rgb_fn paint_rgb = paint_rgb_scalar;
+
+static void rgb_pick(void) {
+#ifdef RGB_X86
+    // ERODE_ISA caps it as for the row kernels: SSSE3 comes after sse2
+    int limit = erode_isa_limit();
+    __builtin_cpu_init();
+    if (limit >= 2 && __builtin_cpu_supports("ssse3")) {
+        for (int k = 0; k < 3; k++) {
+            for (int i = 0; i < 16; i++) {
+                int byte = 3 * i + k;
+                for (int v = 0; v < 3; v++) rgb_shuffle[k][v][i] = byte / 16 == v ? byte % 16 : 0x80;
+            }
+        }
+        for (int v = 0; v < 3; v++) {
+            for (int i = 0; i < 16; i++) rgb_spread[v][i] = (16 * v + i) / 3;
+        }
+        threshold_rgb = threshold_rgb_ssse3;
+        paint_rgb = paint_rgb_ssse3;
+    }
+#endif
+}
+
+static void rgb_select(void) {
+    pthread_once(&rgb_once, rgb_pick);
+}
+
+static void threshold_row(const unsigned char* pixels, int height, int channels, int limit, unsigned char* mask) {
+    if (channels == 1) {
+        for (int y = 0; y < height; y++) mask[y] = pixels[y] > limit;
+    } else if (channels == 3) {
+        threshold_rgb(pixels, height, limit, mask);
+    } else {
+        for (int y = 0; y < height; y++) {
+            const unsigned char* p = pixels + (size_t)y * channels;
+            mask[y] = p[0] + p[1] + p[2] > limit;
+        }
+    }
+}
+
+// Otsu's threshold of a grey-level histogram: the level that maximises the
+// variance between the two classes it splits the pixels into
+static int otsu_threshold(const uint64_t histogram[256]) {
+    uint64_t total = 0;
+    double sum = 0;
+    for (int i = 0; i < 256; i++) {
+        total += histogram[i];
+        sum += (double)i * histogram[i];
+    }
+    uint64_t below = 0;
+    double sum_below = 0, best = -1;
+    int first = 0, last = 0, highest = 0;
+    for (int i = 0; i < 256; i++) {
+        if (histogram[i]) highest = i;
+    }
+    for (int t = 0; t < 255; t++) {
+        below += histogram[t];
+        sum_below += (double)t * histogram[t];
+        uint64_t above = total - below;
+        if (below == 0) continue;
+        if (above == 0) break;
+        double mean_below = sum_below / below;
+        double mean_above = (sum - sum_below) / above;
+        double between = (double)below * above * (mean_below - mean_above) * (mean_below - mean_above);
+        if (between > best) {
+            best = between;
+            first = last = t;
+        } else if (between == best && last == t - 1) {
+            last = t;
+        }
+    }
+    // A single grey level cannot be split: everything is background
+    if (best < 0) return highest;
+    // Levels with no pixels leave the variance unchanged; a gap between the
+    // classes is split in the middle rather than at the edge of one of them
+    return (first + last) / 2;
+}
+
+static int sampled_otsu(int width, int height, int channels, const unsigned char* rgb) {
+    uint64_t histogram[256] = {0};
+    size_t row = (size_t)height * channels;
+    int step = width / 64 < OTSU_ROW_STEP ? (width / 64 > 1 ? width / 64 : 1) : OTSU_ROW_STEP;
+    for (int x = 0; x < width; x += step) {
+        const unsigned char* p = rgb + x * row;
+        if (channels == 1) {
+            for (int y = 0; y < height; y++) histogram[p[y]]++;
+        } else {
+            for (int y = 0; y < height; y++, p += channels) histogram[(p[0] + p[1] + p[2]) / 3]++;
+        }
+    }
+    return otsu_threshold(histogram);
+}
+
+static void paint_row(unsigned char* pixels, const unsigned char* mask, int height, int channels,
+                      const unsigned char* colour) {
+    if (channels == 3) {
+        paint_rgb(pixels, mask, height, colour);
+        return;
+    }
+    for (int y = 0; y < height; y++) {
+        if (mask[y]) memcpy(pixels + (size_t)y * channels, colour, channels);
+    }
+}
+
+// Threshold rgb_image with the rule in options, erode the mask as erode()
+// does into binary_image (0/1), and paint options->overlay over the eroded
+// pixels of rgb_image if it is given. channels is 1 (grey) or at least 3,
+// with any channels after the third (alpha) ignored. Returns the grey-level
+// threshold used, or -1 for another channel count or if the mask rows cannot
+// be allocated.
+int erode_rgb(int width, int height, int channels, unsigned char rgb_image[width][height][channels],
+              unsigned char binary_image[width][height], const erode_rgb_options_t* options) {
+    if (width <= 0 || height <= 0 || (channels != 1 && channels < 3)) return -1;
+    int threshold = options->rule == RGB_THRESHOLD_OTSU ? sampled_otsu(width, height, channels, &rgb_image[0][0][0])
+                                                        : options->threshold;
+    int limit = sum_limit(channels, threshold);
+    unsigned char* ring = malloc(3 * (size_t)height);
+    if (!ring) return -1;
+    erode_row_fn kernel = erode_row_select();
+    rgb_select();
+
+    // Mask row x lives in ring row x % 3
+    threshold_row(&rgb_image[0][0][0], height, channels, limit, ring);
+    memset(binary_image[0], 0, height);
+    for (int x = 1; x < width; x++) {
+        threshold_row(&rgb_image[x][0][0], height, channels, limit, ring + (size_t)(x % 3) * height);
+        if (x >= 2) {
+            kernel(ring + (size_t)((x - 2) % 3) * height, ring + (size_t)((x - 1) % 3) * height,
+                   ring + (size_t)(x % 3) * height, binary_image[x - 1], height);
+            if (options->overlay) paint_row(&rgb_image[x - 1][0][0], binary_image[x - 1], height, channels, options->overlay);
+        }
+    }
+    if (width > 1) memset(binary_image[width - 1], 0, height);
+    free(ring);
+    return threshold;
+}
@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <string.h>
+#include "erode.h"
+
+// Run-length encoded erosion. A sparse image is a short list of foreground
+// runs per row, and the cross erosion maps onto it directly: a pixel keeps
+// its left and right neighbours only if it is not at either end of its run,
+// so a run [start, end) shrinks to [start + 1, end - 1), and the neighbours
+// above and below are an intersection with the runs of those rows. The work
+// is proportional to the number of runs, background costs nothing.
+
+int rle_image_alloc(rle_image_t* rle, int width, int height, size_t capacity) {
+    memset(rle, 0, sizeof(*rle));
+    rle->width = width;
+    rle->height = height;
+    rle->row_start = calloc((size_t)width + 1, sizeof(size_t));
+    rle->runs = malloc((capacity ? capacity : 1) * sizeof(rle_run_t));
+    rle->capacity = capacity ? capacity : 1;
+    if (!rle->row_start || !rle->runs) {
+        rle_image_free(rle);
+        return -1;
+    }
+    return 0;
+}
+
+void rle_image_free(rle_image_t* rle) {
+    free(rle->row_start);
+    free(rle->runs);
+    rle->row_start = NULL;
+    rle->runs = NULL;
+    rle->capacity = 0;
+}
+
+// Append a run, doubling the run array when it is full
+static int rle_push(rle_image_t* rle, size_t* count, int start, int end) {
+    if (*count == rle->capacity) {
+        rle_run_t* runs = realloc(rle->runs, 2 * rle->capacity * sizeof(rle_run_t));
+        if (!runs) return -1;
+        rle->runs = runs;
+        rle->capacity *= 2;
+    }
+    rle->runs[*count].start = start;
+    rle->runs[*count].end = end;
+    (*count)++;
+    return 0;
+}
+
+#define HAS_ZERO_BYTE(word) ((((word) - 0x0101010101010101ull) & ~(word) & 0x8080808080808080ull) != 0)
+
+// Encode a binary image, any non-zero pixel is foreground. Words of eight
+// background or eight foreground pixels are skipped at once. Returns -1 if
+// the runs cannot grow.
+int rle_encode(int width, int height, unsigned char binary_image[width][height], rle_image_t* rle) {
+    size_t count = 0;
+    rle->width = width;
+    rle->height = height;
+    for (int x = 0; x < width; x++) {
+        const unsigned char* row = binary_image[x];
+        rle->row_start[x] = count;
+        int y = 0;
+        while (y < height) {
+            uint64_t word;
+            if (y + 8 <= height && (memcpy(&word, row + y, 8), word == 0)) {
+                y += 8;
+                continue;
+            }
+            if (!row[y]) {
+                y++;
+                continue;
+            }
+            int start = y;
+            while (y + 8 <= height && (memcpy(&word, row + y, 8), !HAS_ZERO_BYTE(word))) y += 8;
+            while (y < height && row[y]) y++;
+            if (rle_push(rle, &count, start, y)) return -1;
+        }
+    }
+    rle->row_start[width] = count;
+    return 0;
+}
+
+// Decode to one byte per pixel with the 0/1 values written by erode()
+void rle_decode(const rle_image_t* rle, int width, int height, unsigned char binary_image[width][height]) {
+    memset(binary_image, 0, (size_t)width * height);
+    for (int x = 0; x < width; x++) {
+        for (size_t r = rle->row_start[x]; r < rle->row_start[x + 1]; r++) {
+            memset(binary_image[x] + rle->runs[r].start, 1, rle->runs[r].end - rle->runs[r].start);
+        }
+    }
+}
+
+size_t rle_image_bytes(const rle_image_t* rle) {
+    return ((size_t)rle->width + 1) * sizeof(size_t) + rle->row_start[rle->width] * sizeof(rle_run_t);
+}
+
+// Cross-shaped erosion on runs. Row x of the result is the intersection of
+// the shrunk runs of row x with the runs of rows x - 1 and x + 1, merged in
+// one pass: the run that ends first is the one to advance. The shrinking
+// also clears the border columns, the border rows get no runs, as in erode().
+// dst must not alias src. Returns -1 if the runs of dst cannot grow.
+int erode_rle(const rle_image_t* src, rle_image_t* dst) {
+    int width = src->width;
+    size_t count = 0;
+    dst->width = width;
+    dst->height = src->height;
+    dst->row_start[0] = 0;
+    for (int x = 0; x < width; x++) {
+        dst->row_start[x] = count;
+        if (x == 0 || x == width - 1) continue;
+        const rle_run_t* up = src->runs + src->row_start[x - 1];
+        const rle_run_t* up_end = src->runs + src->row_start[x];
+        const rle_run_t* cur = up_end;
+        const rle_run_t* cur_end = src->runs + src->row_start[x + 1];
+        const rle_run_t* down = cur_end;
+        const rle_run_t* down_end = src->runs + src->row_start[x + 2];
+        while (cur < cur_end && up < up_end && down < down_end) {
+            int cur_start = cur->start + 1, cur_stop = cur->end - 1;
+            if (cur_start >= cur_stop) {
+                cur++;
+                continue;
+            }
+            int start = cur_start;
+            if (up->start > start) start = up->start;
+            if (down->start > start) start = down->start;
+            int end = cur_stop;
+            if (up->end < end) end = up->end;
+            if (down->end < end) end = down->end;
+            if (start < end && rle_push(dst, &count, start, end)) return -1;
+            if (cur_stop == end) cur++;
+            else if (up->end == end) up++;
+            else down++;
+        }
+    }
+    dst->row_start[width] = count;
+    return 0;
+}
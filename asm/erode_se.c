@@ -0,0 +1,251 @@
+#include <stdlib.h>
+#include <string.h>
+#include "erode.h"
+
+// Erosion with an arbitrary structuring element. A pixel survives if every
+// active tap of the element, centred on the pixel, is set. Pixels closer to
+// the border than the element's radius are cleared, as erode() does for the
+// 3x3 cross (where this gives exactly erode()'s output).
+
+static int se_alloc(structuring_element_t* se, se_shape_t shape, int rows, int cols) {
+    if (rows <= 0 || cols <= 0 || rows % 2 == 0 || cols % 2 == 0) return -1;
+    se->shape = shape;
+    se->rows = rows;
+    se->cols = cols;
+    se->mask = calloc((size_t)rows * cols, 1);
+    return se->mask ? 0 : -1;
+}
+
+// Create one of the built-in shapes. `size` is the (odd) diameter for the
+// cross, square and disk, and the length for lines.
+int se_create(structuring_element_t* se, se_shape_t shape, int size) {
+    int rows = size, cols = size;
+    if (shape == SE_HLINE) rows = 1;
+    if (shape == SE_VLINE) cols = 1;
+    if (shape == SE_CUSTOM || se_alloc(se, shape, rows, cols)) return -1;
+
+    int r = size / 2;
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < cols; j++) {
+            int di = i - rows / 2;
+            int dj = j - cols / 2;
+            int on = 1;
+            if (shape == SE_CROSS) on = (di == 0 || dj == 0);
+            if (shape == SE_DISK) on = (di * di + dj * dj <= r * r);
+            se->mask[i * cols + j] = on;
+        }
+    }
+    return 0;
+}
+
+// Create a filled rows x cols rectangle
+int se_rect(structuring_element_t* se, int rows, int cols) {
+    if (se_alloc(se, SE_RECT, rows, cols)) return -1;
+    memset(se->mask, 1, (size_t)rows * cols);
+    return 0;
+}
+
+// Create an element from a user mask, any non-zero entry is an active tap
+int se_from_mask(structuring_element_t* se, int rows, int cols, const unsigned char* mask) {
+    if (se_alloc(se, SE_CUSTOM, rows, cols)) return -1;
+    for (int i = 0; i < rows * cols; i++) {
+        se->mask[i] = mask[i] != 0;
+    }
+    return 0;
+}
+
+void se_free(structuring_element_t* se) {
+    free(se->mask);
+    se->mask = NULL;
+}
+
+static void clear_border(int width, int height, unsigned char binary_image[width][height], int rx, int ry) {
+    for (int x = 0; x < width; x++) {
+        if (x < rx || x >= width - rx) {
+            memset(binary_image[x], 0, height);
+            continue;
+        }
+        for (int y = 0; y < ry && y < height; y++) {
+            binary_image[x][y] = 0;
+            binary_image[x][height - 1 - y] = 0;
+        }
+    }
+}
+
+// In-place erosion over the active taps of a mask, streaming top to bottom.
+// The rows above the current one are overwritten already, so their original
+// values are kept in a ring of rx + 1 rows. Each tap is a branch-free AND of a
+// shifted row into the output row. Always inlined, so the fixed-shape kernels
+// below see a constant mask and only their active taps are emitted.
+static inline __attribute__((always_inline))
+void erode_mask(int width, int height, unsigned char binary_image[width][height], int rows, int cols,
+                const unsigned char* mask, unsigned char* ring) {
+    int rx = rows / 2;
+    int ry = cols / 2;
+    for (int x = 0; x < width; x++) {
+        unsigned char* saved = ring + (size_t)(x % (rx + 1)) * height;
+        memcpy(saved, binary_image[x], height);
+        if (x < rx || x >= width - rx) continue;
+
+        unsigned char* out = binary_image[x];
+        for (int y = ry; y < height - ry; y++) {
+            out[y] = 1;
+        }
+#pragma GCC unroll 16
+        for (int i = 0; i < rows; i++) {
+            int dx = i - rx;
+            const unsigned char* src = dx <= 0 ? ring + (size_t)((x + dx) % (rx + 1)) * height : binary_image[x + dx];
+#pragma GCC unroll 16
+            for (int j = 0; j < cols; j++) {
+                if (!mask[i * cols + j]) continue;
+                const unsigned char* shifted = src + j - ry;
+                for (int y = ry; y < height - ry; y++) {
+                    out[y] &= shifted[y] != 0;
+                }
+            }
+        }
+    }
+    clear_border(width, height, binary_image, rx, ry);
+}
+
+// Fixed-shape kernels, specialised at compile time
+#define FIXED_SE_KERNEL(name, rows, cols, ...)                                              \
+    static const unsigned char name##_mask[(rows) * (cols)] = { __VA_ARGS__ };            \
+    static void name(int width, int height, unsigned char binary_image[width][height],     \
+                     unsigned char* ring) {                                                \
+        erode_mask(width, height, binary_image, rows, cols, name##_mask, ring);            \
+    }
+
+FIXED_SE_KERNEL(erode_cross3, 3, 3,
+    0, 1, 0,
+    1, 1, 1,
+    0, 1, 0)
+
+FIXED_SE_KERNEL(erode_disk5, 5, 5,
+    0, 0, 1, 0, 0,
+    0, 1, 1, 1, 0,
+    1, 1, 1, 1, 1,
+    0, 1, 1, 1, 0,
+    0, 0, 1, 0, 0)
+
+FIXED_SE_KERNEL(erode_cross5, 5, 5,
+    0, 0, 1, 0, 0,
+    0, 0, 1, 0, 0,
+    1, 1, 1, 1, 1,
+    0, 0, 1, 0, 0,
+    0, 0, 1, 0, 0)
+
+typedef struct {
+    int rows;
+    int cols;
+    const unsigned char* mask;
+    void (*kernel)(int width, int height, unsigned char binary_image[width][height], unsigned char* ring);
+} fixed_se_t;
+
+static const fixed_se_t fixed_kernels[] = {
+    {3, 3, erode_cross3_mask, erode_cross3},
+    {5, 5, erode_disk5_mask, erode_disk5},
+    {5, 5, erode_cross5_mask, erode_cross5},
+};
+
+// van Herk/Gil-Werman running AND over windows of length k: with g the
+// prefix AND and h the suffix AND inside blocks of k samples, the window
+// starting at s is h[s] & g[s + k - 1]. Three operations per sample for any k.
+static void erode_line_vhgw(const unsigned char* in, unsigned char* out, unsigned char* g, unsigned char* h, int n, int k) {
+    for (int i = 0; i < n; i++) {
+        unsigned char v = in[i] != 0;
+        g[i] = (i % k == 0) ? v : (g[i - 1] & v);
+    }
+    for (int i = n - 1; i >= 0; i--) {
+        unsigned char v = in[i] != 0;
+        h[i] = (i % k == k - 1 || i == n - 1) ? v : (h[i + 1] & v);
+    }
+    int r = k / 2;
+    for (int y = r; y < n - r; y++) {
+        out[y] = h[y - r] & g[y + r];
+    }
+}
+
+// Separable rectangle erosion: a van Herk/Gil-Werman pass along each row,
+// then one down the columns, done a whole row at a time.
+static int erode_rect(int width, int height, unsigned char binary_image[width][height], int rows, int cols) {
+    int rx = rows / 2;
+    int ry = cols / 2;
+
+    if (cols > 1 && height >= cols) {
+        unsigned char* line = malloc(3 * (size_t)height);
+        if (!line) return -1;
+        for (int x = 0; x < width; x++) {
+            memcpy(line, binary_image[x], height);
+            erode_line_vhgw(line, binary_image[x], line + height, line + 2 * (size_t)height, height, cols);
+        }
+        free(line);
+    }
+
+    if (rows > 1 && width >= rows) {
+        // h needs the unmodified rows, so it gets its own buffer; g is built
+        // in place and each output row only overwrites rows g no longer needs.
+        unsigned char (*h)[height] = malloc((size_t)width * height);
+        if (!h) return -1;
+        for (int x = width - 1; x >= 0; x--) {
+            int block_end = (x % rows == rows - 1 || x == width - 1);
+            for (int y = 0; y < height; y++) {
+                unsigned char v = binary_image[x][y] != 0;
+                h[x][y] = block_end ? v : (h[x + 1][y] & v);
+            }
+        }
+        for (int x = 0; x < width; x++) {
+            if (x % rows == 0) {
+                for (int y = 0; y < height; y++) binary_image[x][y] = binary_image[x][y] != 0;
+            } else {
+                for (int y = 0; y < height; y++) binary_image[x][y] = binary_image[x - 1][y] & (binary_image[x][y] != 0);
+            }
+            int out = x - rx;   // output row whose window ends at x
+            if (out >= rx) {
+                for (int y = 0; y < height; y++) binary_image[out][y] = h[out - rx][y] & binary_image[x][y];
+            }
+        }
+        free(h);
+    }
+
+    if (rows == 1 && cols == 1) {
+        for (int x = 0; x < width; x++) {
+            for (int y = 0; y < height; y++) binary_image[x][y] = binary_image[x][y] != 0;
+        }
+    }
+    clear_border(width, height, binary_image, rx, ry);
+    return 0;
+}
+
+// Erode in place with any structuring element. Full rectangles and lines use
+// the van Herk/Gil-Werman path, a few common shapes have fixed kernels and
+// everything else runs through the generic tap list.
+// Returns -1 on an invalid element or allocation failure.
+int erode_se(int width, int height, unsigned char binary_image[width][height], const structuring_element_t* se) {
+    if (!se->mask || width <= 0 || height <= 0) return -1;
+    int rows = se->rows;
+    int cols = se->cols;
+    int rx = rows / 2;
+
+    int full = 1;
+    for (int i = 0; i < rows * cols; i++) {
+        full &= se->mask[i] != 0;
+    }
+    if (full) return erode_rect(width, height, binary_image, rows, cols);
+
+    unsigned char* ring = malloc((size_t)(rx + 1) * height);
+    if (!ring) return -1;
+
+    for (size_t i = 0; i < sizeof(fixed_kernels) / sizeof(fixed_kernels[0]); i++) {
+        const fixed_se_t* fixed = &fixed_kernels[i];
+        if (fixed->rows == rows && fixed->cols == cols && memcmp(fixed->mask, se->mask, (size_t)rows * cols) == 0) {
+            fixed->kernel(width, height, binary_image, ring);
+            free(ring);
+            return 0;
+        }
+    }
+
+    erode_mask(width, height, binary_image, rows, cols, se->mask, ring);
+    free(ring);
+    return 0;
+}
@@ -0,0 +1,153 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "erode.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ERODE_X86 1
+#endif
+
+// Erode columns [y, height - 1) and clear the two border columns. Branch
+// free: the result is the AND of the five "pixel is set" tests of the cross,
+// so the run time does not depend on how the neighbours are distributed.
+static inline void erode_row_tail(const unsigned char* up, const unsigned char* cur, const unsigned char* down, unsigned char* out, int y, int height) {
+    for (; y < height - 1; y++) {
+        out[y] = (cur[y] != 0) & (up[y] != 0) & (down[y] != 0) & (cur[y - 1] != 0) & (cur[y + 1] != 0);
+    }
+    out[0] = 0;
+    if (height > 1) out[height - 1] = 0;
+}
+
+// Scalar fallback
+
+void erode_row_scalar(const unsigned char* up, const unsigned char* cur, const unsigned char* down, unsigned char* out, int height) {
+    erode_row_tail(up, cur, down, out, 1, height);
+}
+
+#ifdef ERODE_X86
+
+// The vector kernels take the unsigned minimum of the five neighbours, which
+// is non-zero only if all of them are, then clamp it to 1 with another min.
+// Columns that do not fill a whole vector are done by one more vector ending
+// at the last interior column, overlapping the previous one (out never
+// aliases the input rows, so recomputing a column gives the same value).
+// Rows shorter than a vector go to the next narrower kernel.
+
+#define ERODE_VECTOR(T, load, min, store, y)                                     \
+    do {                                                                        \
+        T v = load((const void*)(cur + (y)));                                   \
+        v = min(v, load((const void*)(up + (y))));                              \
+        v = min(v, load((const void*)(down + (y))));                            \
+        v = min(v, load((const void*)(cur + (y) - 1)));                         \
+        v = min(v, load((const void*)(cur + (y) + 1)));                         \
+        store((void*)(out + (y)), min(v, one));                                 \
+    } while (0)
+
+__attribute__((target("sse2")))
+static void erode_row_sse2(const unsigned char* up, const unsigned char* cur, const unsigned char* down, unsigned char* out, int height) {
+    if (height - 2 < 16) {
+        erode_row_tail(up, cur, down, out, 1, height);
+        return;
+    }
+    const __m128i one = _mm_set1_epi8(1);
+    int y = 1;
+    for (; y + 16 <= height - 1; y += 16) ERODE_VECTOR(__m128i, _mm_loadu_si128, _mm_min_epu8, _mm_storeu_si128, y);
+    if (y < height - 1) ERODE_VECTOR(__m128i, _mm_loadu_si128, _mm_min_epu8, _mm_storeu_si128, height - 1 - 16);
+    out[0] = 0;
+    out[height - 1] = 0;
+}
+
+__attribute__((target("avx2")))
+static void erode_row_avx2(const unsigned char* up, const unsigned char* cur, const unsigned char* down, unsigned char* out, int height) {
+    if (height - 2 < 32) {
+        erode_row_sse2(up, cur, down, out, height);
+        return;
+    }
+    const __m256i one = _mm256_set1_epi8(1);
+    int y = 1;
+    for (; y + 32 <= height - 1; y += 32) ERODE_VECTOR(__m256i, _mm256_loadu_si256, _mm256_min_epu8, _mm256_storeu_si256, y);
+    if (y < height - 1) ERODE_VECTOR(__m256i, _mm256_loadu_si256, _mm256_min_epu8, _mm256_storeu_si256, height - 1 - 32);
+    out[0] = 0;
+    out[height - 1] = 0;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void erode_row_avx512(const unsigned char* up, const unsigned char* cur, const unsigned char* down, unsigned char* out, int height) {
+    if (height - 2 < 64) {
+        erode_row_avx2(up, cur, down, out, height);
+        return;
+    }
+    const __m512i one = _mm512_set1_epi8(1);
+    int y = 1;
+    for (; y + 64 <= height - 1; y += 64) ERODE_VECTOR(__m512i, _mm512_loadu_si512, _mm512_min_epu8, _mm512_storeu_si512, y);
+    if (y < height - 1) ERODE_VECTOR(__m512i, _mm512_loadu_si512, _mm512_min_epu8, _mm512_storeu_si512, height - 1 - 64);
+    out[0] = 0;
+    out[height - 1] = 0;
+}
+
+#endif
+
+static pthread_once_t isa_once = PTHREAD_ONCE_INIT;
+static int isa_limit = 3;
+
+static void isa_parse(void) {
+    const char* cap = getenv("ERODE_ISA");
+    if (!cap || !*cap) return;
+    if (strcmp(cap, "scalar") == 0) isa_limit = 0;
+    else if (strcmp(cap, "sse2") == 0) isa_limit = 1;
+    else if (strcmp(cap, "avx2") == 0) isa_limit = 2;
+    else if (strcmp(cap, "avx512") != 0) printf("Warning: ERODE_ISA=%s is not scalar, sse2, avx2 or avx512, ignored\n", cap);
+}
+
+// ERODE_ISA=scalar|sse2|avx2|avx512 caps the kernels every module selects,
+// e.g. for comparisons: 0 for scalar up to 3 for avx512. Parsed once.
+int erode_isa_limit(void) {
+    pthread_once(&isa_once, isa_parse);
+    return isa_limit;
+}
+
+static pthread_once_t row_once = PTHREAD_ONCE_INIT;
+static erode_row_fn selected_row_kernel = erode_row_scalar;
+static const char* selected_row_isa = "scalar";
+
+static void row_select(void) {
+#ifdef ERODE_X86
+    int limit = erode_isa_limit();
+    __builtin_cpu_init();
+    if (limit >= 3 && __builtin_cpu_supports("avx512bw")) {
+        selected_row_kernel = erode_row_avx512;
+        selected_row_isa = "avx512";
+    } else if (limit >= 2 && __builtin_cpu_supports("avx2")) {
+        selected_row_kernel = erode_row_avx2;
+        selected_row_isa = "avx2";
+    } else if (limit >= 1 && __builtin_cpu_supports("sse2")) {
+        selected_row_kernel = erode_row_sse2;
+        selected_row_isa = "sse2";
+    }
+#endif
+}
+
+// Pick the widest row kernel the CPU supports (cpuid via __builtin_cpu_supports)
+// up to the ERODE_ISA cap. Safe to call from several threads at once.
+erode_row_fn erode_row_select(void) {
+    pthread_once(&row_once, row_select);
+    return selected_row_kernel;
+}
+
+const char* erode_row_isa(void) {
+    erode_row_select();
+    return selected_row_isa;
+}
+
+// Erode src into dst using the selected row kernel. Same output as erode().
+void erode_simd(int width, int height, unsigned char src[width][height], unsigned char dst[width][height]) {
+    erode_row_fn kernel = erode_row_select();
+    if (width <= 0 || height <= 0) return;
+    memset(dst[0], 0, height);
+    for (int x = 1; x < width - 1; x++) {
+        kernel(src[x - 1], src[x], src[x + 1], dst[x], height);
+    }
+    memset(dst[width - 1], 0, height);
+}
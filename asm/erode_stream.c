@@ -0,0 +1,309 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "erode.h"
+#include "image.h"
+
+// Out-of-core erosion of images that do not fit in memory. The image is read
+// from the file in strips of rows, each with one halo row above and below so
+// that every strip erodes on its own. Three stages overlap:
+//
+//   reader:  strip i + 1 is read into the other input buffer,
+//   compute: strip i is eroded from its input buffer into an output buffer,
+//   writer:  strip i - 1 is written from the other output buffer.
+//
+// With two buffers per direction the memory use is four strips, whatever the
+// image size. Pages of the input behind the reader and of the output behind
+// the writer are dropped from the page cache, so a scan larger than RAM does
+// not push everything else out of it either.
+
+#define STREAM_HALO 1   // rows above and below a strip needed by the 3x3 cross
+
+typedef struct {
+    int rows;                   // storage rows of the image
+    int cols;
+    int bottom_up;              // storage row x is display row rows - 1 - x
+    int strip_rows;
+    int strips;
+
+    int input_fd;
+    off_t input_offset;         // first stored row in the input file
+    size_t input_stride;
+    int output_fd;
+    off_t output_offset;
+    size_t output_stride;
+
+    unsigned char* input[2];    // strip_rows + 2 halo rows each
+    unsigned char* output[2];   // strip_rows each
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int read;                   // strips read, eroded and written so far
+    int eroded;
+    int written;
+    int failed;
+} stream_t;
+
+static double stream_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Rows [first, end) of strip i in storage order
+static void strip_range(const stream_t* s, int strip, int* first, int* end) {
+    *first = strip * s->strip_rows;
+    *end = *first + s->strip_rows < s->rows ? *first + s->strip_rows : s->rows;
+}
+
+// Wait until *counter >= target; returns -1 if another stage failed
+static int stream_wait(stream_t* s, const int* counter, int target) {
+    pthread_mutex_lock(&s->lock);
+    while (*counter < target && !s->failed) pthread_cond_wait(&s->changed, &s->lock);
+    int failed = s->failed;
+    pthread_mutex_unlock(&s->lock);
+    return failed ? -1 : 0;
+}
+
+static void stream_advance(stream_t* s, int* counter, int failed) {
+    pthread_mutex_lock(&s->lock);
+    if (failed) s->failed = 1;
+    else (*counter)++;
+    pthread_cond_broadcast(&s->changed);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static int read_fully(int fd, unsigned char* buffer, size_t length, off_t offset) {
+    while (length > 0) {
+        ssize_t n = pread(fd, buffer, length, offset);
+        if (n <= 0) return -1;
+        buffer += n;
+        length -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int write_fully(int fd, const unsigned char* buffer, size_t length, off_t offset) {
+    while (length > 0) {
+        ssize_t n = pwrite(fd, buffer, length, offset);
+        if (n <= 0) return -1;
+        buffer += n;
+        length -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static void* reader_main(void* p) {
+    stream_t* s = p;
+    for (int i = 0; i < s->strips; i++) {
+        // Buffer i & 1 is free once strip i - 2 has been eroded
+        if (stream_wait(s, &s->eroded, i - 1)) break;
+        int first, end;
+        strip_range(s, i, &first, &end);
+        int top = first > 0 ? first - STREAM_HALO : 0;
+        int bottom = end < s->rows ? end + STREAM_HALO : s->rows;
+        // Buffer row 0 is the halo row above the strip, also for the first strip
+        unsigned char* buffer = s->input[i & 1] + (size_t)(top - first + STREAM_HALO) * s->input_stride;
+        off_t offset = s->input_offset + (off_t)top * s->input_stride;
+        if (read_fully(s->input_fd, buffer, (size_t)(bottom - top) * s->input_stride, offset)) {
+            printf("Error: Cannot read rows %d to %d of the input\n", top, bottom - 1);
+            stream_advance(s, &s->read, 1);
+            break;
+        }
+        // Everything above the halo of this strip has been read for good
+        if (top > 0) posix_fadvise(s->input_fd, s->input_offset, (off_t)top * s->input_stride, POSIX_FADV_DONTNEED);
+        stream_advance(s, &s->read, 0);
+    }
+    return NULL;
+}
+
+static void* writer_main(void* p) {
+    stream_t* s = p;
+    off_t previous = 0, previous_length = 0;
+    for (int i = 0; i < s->strips; i++) {
+        if (stream_wait(s, &s->eroded, i + 1)) break;
+        int first, end;
+        strip_range(s, i, &first, &end);
+        // A bottom-up input is written top-down, so the strip lands mirrored
+        int row = s->bottom_up ? s->rows - end : first;
+        off_t offset = s->output_offset + (off_t)row * s->output_stride;
+        off_t length = (off_t)(end - first) * s->output_stride;
+        if (write_fully(s->output_fd, s->output[i & 1], length, offset)) {
+            printf("Error: Cannot write rows %d to %d of the output\n", row, row + end - first - 1);
+            stream_advance(s, &s->written, 1);
+            break;
+        }
+        // Start writeback of this strip, and wait for the previous one so its
+        // pages can be dropped; dirty pages stay bounded to about two strips
+        sync_file_range(s->output_fd, offset, length, SYNC_FILE_RANGE_WRITE);
+        if (previous_length) {
+            sync_file_range(s->output_fd, previous, previous_length,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(s->output_fd, previous, previous_length, POSIX_FADV_DONTNEED);
+        }
+        previous = offset;
+        previous_length = length;
+        stream_advance(s, &s->written, 0);
+    }
+    return NULL;
+}
+
+// The kernels write 0/1, scale to 0/255 as erode_file() does and count the
+// foreground, eight pixels at a time: with bytes of 0 or 1 the popcount of a
+// word is the count, and times 255 cannot carry into the next byte
+static size_t scale_row(unsigned char* row, int cols) {
+    size_t count = 0;
+    int y = 0;
+    for (; y + 8 <= cols; y += 8) {
+        uint64_t word;
+        memcpy(&word, row + y, 8);
+        count += __builtin_popcountll(word);
+        word *= 255;
+        memcpy(row + y, &word, 8);
+    }
+    for (; y < cols; y++) {
+        count += row[y];
+        row[y] = -row[y];
+    }
+    return count;
+}
+
+// Erode the strips as they arrive; runs on the calling thread
+static int compute_strips(stream_t* s, erode_stream_stats_t* stats) {
+    erode_row_fn kernel = erode_row_select();
+    for (int i = 0; i < s->strips; i++) {
+        double wait_start = stream_now();
+        // Input strip i is read, and output buffer i & 1 has been written out
+        if (stream_wait(s, &s->read, i + 1) || stream_wait(s, &s->written, i - 1)) return -1;
+        double start = stream_now();
+        stats->stall_seconds += start - wait_start;
+
+        int first, end;
+        strip_range(s, i, &first, &end);
+        const unsigned char* input = s->input[i & 1];
+        unsigned char* output = s->output[i & 1];
+        for (int x = first; x < end; x++) {
+            const unsigned char* cur = input + (size_t)(x - first + STREAM_HALO) * s->input_stride;
+            int slot = s->bottom_up ? end - 1 - x : x - first;
+            unsigned char* out = output + (size_t)slot * s->output_stride;
+            if (x == 0 || x == s->rows - 1) {
+                memset(out, 0, s->cols);
+                continue;
+            }
+            kernel(cur - s->input_stride, cur, cur + s->input_stride, out, s->cols);
+            stats->foreground += scale_row(out, s->cols);
+        }
+        stats->compute_seconds += stream_now() - start;
+        stream_advance(s, &s->eroded, 0);
+    }
+    return 0;
+}
+
+// Erode a PGM or 8-bit grey BMP file into a PGM or BMP file in strips of rows,
+// using at most memory_limit bytes of buffers (0: ERODE_STREAM_DEFAULT_MEMORY).
+// The result is the same as erode_file(). Returns -1 on any error.
+int erode_stream(const char* input_file, const char* output_file, size_t memory_limit, erode_stream_stats_t* stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (memory_limit == 0) memory_limit = ERODE_STREAM_DEFAULT_MEMORY;
+
+    // Only the headers are parsed; the mappings are dropped before any pixel is touched
+    image_t header;
+    if (image_map(&header, input_file, IMAGE_MAP_RAW)) return -1;
+    stream_t s;
+    memset(&s, 0, sizeof(s));
+    s.rows = header.rows;
+    s.cols = header.cols;
+    s.bottom_up = header.bottom_up;
+    s.input_stride = header.stride;
+    s.input_offset = header.data - (unsigned char*)header.base;
+    int channels = header.channels;
+    image_free(&header);
+    if (channels != 1) {
+        printf("Error: %s has %d channels, erosion needs a binary (single channel) image\n", input_file, channels);
+        return -1;
+    }
+
+    image_format_t format = image_format_from_path(output_file);
+    if (format != IMAGE_FORMAT_PGM && format != IMAGE_FORMAT_BMP) {
+        printf("Error: Streaming writes PGM or BMP files, not %s\n", output_file);
+        return -1;
+    }
+    if (image_create_file(&header, output_file, format, s.rows, s.cols, 1)) return -1;
+    s.output_stride = header.stride;
+    s.output_offset = header.data - (unsigned char*)header.base;
+    image_free(&header);
+
+    // Two input strips with their halo rows and two output strips
+    size_t fixed = 2 * 2 * STREAM_HALO * s.input_stride;
+    size_t per_row = 2 * s.input_stride + 2 * s.output_stride;
+    if (memory_limit < fixed + per_row) {
+        printf("Error: A memory limit of %zu bytes is too small, %dx%d needs at least %zu\n",
+               memory_limit, s.cols, s.rows, fixed + per_row);
+        return -1;
+    }
+    s.strip_rows = (memory_limit - fixed) / per_row;
+    if (s.strip_rows > s.rows) s.strip_rows = s.rows;
+    s.strips = (s.rows + s.strip_rows - 1) / s.strip_rows;
+    stats->rows = s.rows;
+    stats->cols = s.cols;
+    stats->strip_rows = s.strip_rows;
+    stats->strips = s.strips;
+    stats->buffer_bytes = fixed + per_row * s.strip_rows;
+
+    s.input_fd = open(input_file, O_RDONLY);
+    s.output_fd = open(output_file, O_WRONLY);
+    int result = -1;
+    if (s.input_fd < 0 || s.output_fd < 0) {
+        printf("Error: Cannot open %s\n", s.input_fd < 0 ? input_file : output_file);
+        goto done;
+    }
+    posix_fadvise(s.input_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    for (int b = 0; b < 2; b++) {
+        // calloc, so the row padding of a BMP output stays zero
+        s.input[b] = malloc((s.strip_rows + 2 * STREAM_HALO) * s.input_stride);
+        s.output[b] = calloc(s.strip_rows, s.output_stride);
+        if (!s.input[b] || !s.output[b]) {
+            printf("Error: Cannot allocate strip buffers\n");
+            goto done;
+        }
+    }
+
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.changed, NULL);
+    pthread_t reader, writer;
+    double start = stream_now();
+    int have_reader = pthread_create(&reader, NULL, reader_main, &s) == 0;
+    int have_writer = have_reader && pthread_create(&writer, NULL, writer_main, &s) == 0;
+    if (have_writer) {
+        result = compute_strips(&s, stats);
+    } else {
+        printf("Error: Cannot start the I/O threads\n");
+    }
+    if (result) stream_advance(&s, &s.eroded, 1);
+    if (have_reader) pthread_join(reader, NULL);
+    if (have_writer) pthread_join(writer, NULL);
+    if (s.failed) result = -1;
+    if (result == 0 && fsync(s.output_fd) != 0) {
+        printf("Error: Cannot flush %s\n", output_file);
+        result = -1;
+    }
+    stats->seconds = stream_now() - start;
+    pthread_cond_destroy(&s.changed);
+    pthread_mutex_destroy(&s.lock);
+
+done:
+    if (s.input_fd >= 0) close(s.input_fd);
+    if (s.output_fd >= 0) close(s.output_fd);
+    for (int b = 0; b < 2; b++) {
+        free(s.input[b]);
+        free(s.output[b]);
+    }
+    return result;
+}
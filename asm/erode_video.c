@@ -0,0 +1,216 @@
+#include <stdlib.h>
+#include <string.h>
+#include "erode.h"
+
+// Incremental erosion of a stream of frames. The eroder keeps the previous
+// input and output. A new frame is compared with the previous input eight
+// pixels at a time; changed pixels are copied in and, with their one-pixel
+// cross neighbourhood, marked dirty in a bitmap of 8-pixel groups. Only the
+// dirty groups are eroded again, so the cost of a frame follows the size of
+// the change. Rows that did not change at all are rejected with one memcmp.
+
+#define GROUP 8     // pixels per dirty bit
+
+struct erode_video {
+    int width;
+    int height;
+    int frames;
+    unsigned char* input;       // previous frame, width x height
+    unsigned char* output;      // its erosion, 0/1 as written by erode()
+    unsigned char* scratch;     // one row of kernel output
+    uint64_t* dirty;            // words_per_row bitmap words per row, bit g = pixels [8g, 8g + 8)
+    int words_per_row;
+    int dirty_first;            // rows with dirty bits, empty if first > last
+    int dirty_last;
+    size_t recomputed;          // output pixels eroded for the last frame
+    erode_row_fn kernel;
+};
+
+erode_video_t* erode_video_create(int width, int height) {
+    if (width <= 0 || height <= 0) return NULL;
+    erode_video_t* video = calloc(1, sizeof(erode_video_t));
+    if (!video) return NULL;
+    size_t pixels = (size_t)width * height;
+    int groups = (height + GROUP - 1) / GROUP;
+    video->width = width;
+    video->height = height;
+    video->words_per_row = (groups + 63) / 64;
+    video->input = malloc(pixels);
+    video->output = malloc(pixels);
+    video->scratch = malloc(height);
+    video->dirty = calloc((size_t)width * video->words_per_row, sizeof(uint64_t));
+    if (!video->input || !video->output || !video->scratch || !video->dirty) {
+        erode_video_destroy(video);
+        return NULL;
+    }
+    video->dirty_first = width;
+    video->dirty_last = -1;
+    video->kernel = erode_row_select();
+    return video;
+}
+
+void erode_video_destroy(erode_video_t* video) {
+    if (!video) return;
+    free(video->input);
+    free(video->output);
+    free(video->scratch);
+    free(video->dirty);
+    free(video);
+}
+
+const unsigned char* erode_video_output(const erode_video_t* video) {
+    return video->output;
+}
+
+size_t erode_video_recomputed(const erode_video_t* video) {
+    return video->recomputed;
+}
+
+// Set bits [first, end) of a row of the dirty bitmap
+static void set_bits(uint64_t* row, int first, int end) {
+    while (first < end) {
+        int word = first / 64, bit = first % 64;
+        int count = end - first < 64 - bit ? end - first : 64 - bit;
+        row[word] |= (count == 64 ? ~(uint64_t)0 : (((uint64_t)1 << count) - 1)) << bit;
+        first += count;
+    }
+}
+
+// Input pixels [first, end) of row x changed: the output pixels whose cross
+// reaches them are the same columns widened by one in rows x - 1 to x + 1.
+// The border rows and columns stay 0 and are never dirty.
+static void mark_changed(erode_video_t* video, int x, int first, int end) {
+    first = first > 1 ? first - 1 : 1;
+    end = end < video->height - 1 ? end + 1 : video->height - 1;
+    if (first >= end) return;
+    int top = x > 1 ? x - 1 : 1;
+    int bottom = x < video->width - 2 ? x + 1 : video->width - 2;
+    for (int row = top; row <= bottom; row++) {
+        set_bits(video->dirty + (size_t)row * video->words_per_row, first / GROUP, (end + GROUP - 1) / GROUP);
+    }
+    if (top < video->dirty_first) video->dirty_first = top;
+    if (bottom > video->dirty_last) video->dirty_last = bottom;
+}
+
+// Erode output pixels [first, end) of row x from the current input
+static void erode_span(erode_video_t* video, int x, int first, int end) {
+    int height = video->height;
+    const unsigned char* cur = video->input + (size_t)x * height;
+    // The kernel clears the two ends of what it is given, so it gets one
+    // more pixel on each side unless that is the real border column
+    int from = first > 0 ? first - 1 : 0;
+    int to = end < height ? end + 1 : height;
+    video->kernel(cur - height + from, cur + from, cur + height + from, video->scratch, to - from);
+    memcpy(video->output + (size_t)x * height + first, video->scratch + first - from, end - first);
+    video->recomputed += end - first;
+}
+
+// First bit at or after `bit` that is set (or clear), words * 64 if none
+static int find_bit(const uint64_t* row, int words, int bit, int set) {
+    int w = bit / 64;
+    if (w >= words) return words * 64;
+    uint64_t flip = set ? 0 : ~(uint64_t)0;
+    uint64_t bits = (row[w] ^ flip) & (~(uint64_t)0 << (bit % 64));
+    while (!bits) {
+        if (++w >= words) return words * 64;
+        bits = row[w] ^ flip;
+    }
+    return w * 64 + __builtin_ctzll(bits);
+}
+
+// Erode every run of dirty groups and clear the bitmap
+static void erode_dirty(erode_video_t* video) {
+    int words = video->words_per_row;
+    for (int x = video->dirty_first; x <= video->dirty_last; x++) {
+        uint64_t* row = video->dirty + (size_t)x * words;
+        int group = 0;
+        while ((group = find_bit(row, words, group, 1)) < words * 64) {
+            int end = find_bit(row, words, group, 0);
+            erode_span(video, x, group * GROUP, end * GROUP < video->height ? end * GROUP : video->height);
+            group = end;
+        }
+        memset(row, 0, words * sizeof(uint64_t));
+    }
+    video->dirty_first = video->width;
+    video->dirty_last = -1;
+}
+
+// Erode the first frame completely
+static void first_frame(erode_video_t* video, const unsigned char* frame) {
+    int width = video->width, height = video->height;
+    memcpy(video->input, frame, (size_t)width * height);
+    erode_simd(width, height, (unsigned char (*)[height])video->input, (unsigned char (*)[height])video->output);
+    video->recomputed = (size_t)width * height;
+    video->frames = 1;
+}
+
+// Take the next frame, find what changed since the previous one and erode
+// only that. The output is the same as erode() of the frame.
+int erode_video_frame(erode_video_t* video, int width, int height, const unsigned char frame[width][height]) {
+    if (width != video->width || height != video->height) return -1;
+    if (video->frames == 0) {
+        first_frame(video, &frame[0][0]);
+        return 0;
+    }
+    video->recomputed = 0;
+    int words = height / 8;
+    for (int x = 0; x < width; x++) {
+        unsigned char* old = video->input + (size_t)x * height;
+        const unsigned char* new = frame[x];
+        if (memcmp(old, new, height) == 0) continue;
+        // Spans of differing words, copied and marked together
+        int first = -1;
+        for (int w = 0; w <= words; w++) {
+            int y = w * 8;
+            int changed = 0;
+            if (w < words) {
+                uint64_t a, b;
+                memcpy(&a, old + y, 8);
+                memcpy(&b, new + y, 8);
+                changed = a != b;
+            } else if (y < height) {
+                changed = memcmp(old + y, new + y, height - y) != 0;
+            }
+            if (changed && first < 0) first = y;
+            if (!changed && first >= 0) {
+                memcpy(old + first, new + first, y - first);
+                mark_changed(video, x, first, y);
+                first = -1;
+            }
+        }
+        if (first >= 0) {
+            memcpy(old + first, new + first, height - first);
+            mark_changed(video, x, first, height);
+        }
+    }
+    erode_dirty(video);
+    video->frames++;
+    return 0;
+}
+
+// Take the next frame when the caller knows what changed: only the pixels
+// inside the rectangles are read from it. Pixels outside them must equal the
+// previous frame, or the output will not match erode() of the frame.
+int erode_video_update(erode_video_t* video, int width, int height, const unsigned char frame[width][height],
+                       const erode_rect_t* rects, int count) {
+    if (width != video->width || height != video->height) return -1;
+    if (video->frames == 0) {
+        first_frame(video, &frame[0][0]);
+        return 0;
+    }
+    video->recomputed = 0;
+    for (int i = 0; i < count; i++) {
+        int top = rects[i].x > 0 ? rects[i].x : 0;
+        int bottom = rects[i].x + rects[i].rows < width ? rects[i].x + rects[i].rows : width;
+        int first = rects[i].y > 0 ? rects[i].y : 0;
+        int end = rects[i].y + rects[i].cols < height ? rects[i].y + rects[i].cols : height;
+        if (first >= end) continue;
+        for (int x = top; x < bottom; x++) {
+            memcpy(video->input + (size_t)x * height + first, frame[x] + first, end - first);
+            mark_changed(video, x, first, end);
+        }
+    }
+    erode_dirty(video);
+    video->frames++;
+    return 0;
+}
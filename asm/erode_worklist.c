@@ -0,0 +1,196 @@
+#include <stdlib.h>
+#include <string.h>
+#include "erode.h"
+
+// Repeated cross erosion driven by a worklist of boundary pixels. Only a
+// foreground pixel with a background neighbour, or one on the image border,
+// is removed by a step, and a pixel only becomes such a boundary pixel when a
+// neighbour was removed in the step before. So every foreground pixel enters
+// the worklist once, when it becomes boundary, and leaves it in the next
+// step: one queue of at most the foreground pixels, consumed a level per
+// step, replaces a full-frame pass per step.
+//
+// Cells are detected as they vanish: the pixels removed in a step are split
+// into 8-connected groups, and a group with no surviving pixel around it was
+// a whole blob that is now gone. Its centre, size and step are recorded.
+
+// Pixel states, kept in a copy with a background frame of one pixel so that
+// no neighbour needs a bounds check
+enum {
+    PIXEL_BACKGROUND,
+    PIXEL_FOREGROUND,   // not yet on the boundary
+    PIXEL_QUEUED,       // on the worklist, removed by the next step
+    PIXEL_REMOVED,      // removed by the current step, not yet grouped
+    PIXEL_DONE          // removed earlier, or grouped
+};
+
+static int add_cell(erode_cells_t* cells, const erode_cell_t* cell) {
+    if (cells->count == cells->capacity) {
+        int capacity = cells->capacity ? 2 * cells->capacity : 64;
+        erode_cell_t* grown = realloc(cells->cells, capacity * sizeof(erode_cell_t));
+        if (!grown) return -1;
+        cells->cells = grown;
+        cells->capacity = capacity;
+    }
+    cells->cells[cells->count++] = *cell;
+    return 0;
+}
+
+void erode_cells_free(erode_cells_t* cells) {
+    free(cells->cells);
+    memset(cells, 0, sizeof(*cells));
+}
+
+// Group the pixels removed by `step` that are 8-connected to `seed`, and
+// record them as a cell if no foreground pixel is left next to them. `group`
+// has room for every pixel of the worklist.
+static int group_removed(unsigned char* state, uint32_t stride, uint32_t seed, uint32_t* group, int step,
+                         erode_cells_t* cells) {
+    const int32_t offsets[8] = {
+        -(int32_t)stride - 1, -(int32_t)stride, -(int32_t)stride + 1, -1, 1,
+        (int32_t)stride - 1, (int32_t)stride, (int32_t)stride + 1
+    };
+    size_t count = 0, next = 0;
+    group[count++] = seed;
+    state[seed] = PIXEL_DONE;
+    int survivor = 0;
+    while (next < count) {
+        uint32_t p = group[next++];
+        for (int n = 0; n < 8; n++) {
+            uint32_t q = p + offsets[n];
+            survivor |= state[q] == PIXEL_FOREGROUND;
+            if (state[q] == PIXEL_REMOVED) {
+                state[q] = PIXEL_DONE;
+                group[count++] = q;
+            }
+        }
+    }
+    if (survivor) return 0;
+
+    // Only vanished groups need their coordinates
+    double sum_x = 0, sum_y = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t x = group[i] / stride;
+        sum_x += x;
+        sum_y += group[i] - x * stride;
+    }
+    erode_cell_t cell = {(int)(sum_x / count + 0.5) - 1, (int)(sum_y / count + 0.5) - 1, step, count};
+    return add_cell(cells, &cell);
+}
+
+// Offset of the next non-zero byte of row[from, end), or end; background is
+// skipped a word at a time
+static int next_set(const unsigned char* row, int from, int end) {
+    while (from + 8 <= end) {
+        uint64_t word;
+        memcpy(&word, row + from, 8);
+        if (word) return from + __builtin_ctzll(word) / 8;
+        from += 8;
+    }
+    while (from < end && !row[from]) from++;
+    return from;
+}
+
+static int queue_push(uint32_t** queue, size_t* tail, size_t* capacity, uint32_t p) {
+    if (*tail == *capacity) {
+        uint32_t* grown = realloc(*queue, 2 * *capacity * sizeof(uint32_t));
+        if (!grown) return -1;
+        *queue = grown;
+        *capacity *= 2;
+    }
+    (*queue)[(*tail)++] = p;
+    return 0;
+}
+
+// Erode binary_image in place until nothing changes, or for at most
+// max_steps steps (0: no limit). The image ends up as erode() applied that
+// many times, with 0/1 pixels. If cells is given, every blob is recorded
+// there as it vanishes (cells->cells is allocated, free it with
+// erode_cells_free()). Returns the number of steps that removed pixels, or
+// -1 if the worklist cannot be allocated or the image has 2^32 pixels or more.
+int erode_worklist(int width, int height, unsigned char binary_image[width][height], int max_steps, erode_cells_t* cells) {
+    if (cells) memset(cells, 0, sizeof(*cells));
+    if (width <= 0 || height <= 0) return 0;
+
+    // The state starts as zero pages, only those around foreground get touched
+    uint32_t stride = height + 2;
+    size_t padded = (size_t)(width + 2) * stride;
+    if (padded > UINT32_MAX) return -1;
+    size_t capacity = 4096, tail = 0;
+    unsigned char* state = calloc(padded, 1);
+    uint32_t* queue = malloc(capacity * sizeof(uint32_t));
+    uint32_t* group = NULL;
+    int steps = 0, result = 0;
+    if (!state || !queue) {
+        result = -1;
+        goto done;
+    }
+
+    // Mark the foreground, and queue the first boundary: foreground on the
+    // image border or next to background, as erode() clears both
+    for (int x = 0; x < width; x++) {
+        unsigned char* row = binary_image[x];
+        for (int y = next_set(row, 0, height); y < height; y = next_set(row, y + 1, height)) {
+            row[y] = 1;
+            uint32_t p = (x + 1) * stride + y + 1;
+            if (x == 0 || y == 0 || x == width - 1 || y == height - 1 || !binary_image[x - 1][y] ||
+                !binary_image[x + 1][y] || !row[y - 1] || !row[y + 1]) {
+                state[p] = PIXEL_QUEUED;
+                if (queue_push(&queue, &tail, &capacity, p)) {
+                    result = -1;
+                    goto done;
+                }
+            } else {
+                state[p] = PIXEL_FOREGROUND;
+            }
+        }
+    }
+
+    size_t head = 0;
+    while (head < tail && (max_steps <= 0 || steps < max_steps)) {
+        size_t level_end = tail;
+        steps++;
+        for (size_t i = head; i < level_end; i++) state[queue[i]] = PIXEL_REMOVED;
+
+        if (cells) {
+            // A group is at most the pixels of this level
+            free(group);
+            group = malloc((level_end - head) * sizeof(uint32_t));
+            if (!group) {
+                result = -1;
+                break;
+            }
+            for (size_t i = head; i < level_end && result == 0; i++) {
+                if (state[queue[i]] == PIXEL_REMOVED) result = group_removed(state, stride, queue[i], group, steps, cells);
+            }
+            if (result) break;
+        }
+
+        // Foreground next to a removed pixel is the next boundary
+        for (size_t i = head; i < level_end && result == 0; i++) {
+            uint32_t p = queue[i];
+            uint32_t neighbours[4] = {p - stride, p + stride, p - 1, p + 1};
+            for (int n = 0; n < 4; n++) {
+                uint32_t q = neighbours[n];
+                if (state[q] == PIXEL_FOREGROUND) {
+                    state[q] = PIXEL_QUEUED;
+                    result = queue_push(&queue, &tail, &capacity, q);
+                }
+            }
+        }
+        head = level_end;
+        if (result) break;
+    }
+
+    // Everything taken off the worklist was removed
+    for (size_t i = 0; i < head; i++) {
+        uint32_t x = queue[i] / stride;
+        binary_image[x - 1][queue[i] - x * stride - 1] = 0;
+    }
+
+done:
+    free(state);
+    free(queue);
+    free(group);
+    return result ? -1 : steps;
+}
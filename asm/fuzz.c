@@ -0,0 +1,426 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "assembler.h"
+#include "erode.h"
+#include "image.h"
+#include "sim.h"
+
+// Differential fuzzer for erosion programs. Generates random, structured and
+// edge-case images, runs the program on each with the simulator and compares
+// the output image against erode(). Images are numbered, and image i is built
+// from a generator state seeded with (seed, i) only, so any image can be
+// reproduced with --seed and --first. The first failing image found is shrunk
+// to a minimal failing case by turning white pixels black while it still
+// fails, then printed and written as a PGM file.
+//
+// The memory model is the one of sim.c and generator.c: the image from
+// address 0, the output image at sim_output_offset() (or --output), zero on
+// entry. Only addresses up to the end of the output image are cleared between
+// images, which is all the erosion programs touch.
+//
+// Build: gcc -O2 -pthread -DERODE_NO_MAIN -DASSEMBLER_NO_MAIN -DSIM_NO_MAIN -o fuzz
+//            asm/fuzz.c asm/assembler.c asm/sim.c asm/erode*.c asm/image.c
+
+#define CLAIM_IMAGES    256     // images a worker claims at once
+#define PATTERN_COUNT   9
+
+typedef struct {
+    const sim_program_t* program;
+    int rows;
+    int cols;
+    int output;
+    uint64_t seed;
+    uint64_t first;
+    uint64_t count;
+    uint64_t max_cycles;
+
+    uint64_t next;              // next unclaimed image
+    uint64_t done;
+    uint64_t cycles;
+    uint64_t failing;           // lowest failing image, UINT64_MAX if none
+    uint64_t pattern_runs[PATTERN_COUNT];
+} fuzz_t;
+
+static const char* const pattern_names[PATTERN_COUNT] = {
+    "noise", "cells", "border", "pixels", "checkerboard", "stripes", "rectangles", "solid", "sparse-holes"
+};
+
+// splitmix64, small and good enough to decorrelate neighbouring seeds
+static uint64_t next_random(uint64_t* state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static int random_below(uint64_t* state, int n) {
+    return n > 0 ? (int)(next_random(state) % (uint64_t)n) : 0;
+}
+
+static void fill_rect(int rows, int cols, unsigned char* pixels, int x0, int y0, int x1, int y1, unsigned char value) {
+    for (int x = x0 < 0 ? 0 : x0; x < rows && x <= x1; x++) {
+        for (int y = y0 < 0 ? 0 : y0; y < cols && y <= y1; y++) pixels[(size_t)x * cols + y] = value;
+    }
+}
+
+// Image `index` of the run, returns its pattern
+static int make_image(const fuzz_t* fuzz, uint64_t index, unsigned char* pixels) {
+    int rows = fuzz->rows, cols = fuzz->cols;
+    size_t size = (size_t)rows * cols;
+    uint64_t state = fuzz->seed ^ (index * 0xD1B54A32D192ED03ull);
+    next_random(&state);
+    int pattern = (int)(index % PATTERN_COUNT);
+    memset(pixels, 0, size);
+
+    switch (pattern) {
+        case 0: {
+            // Uniform noise with a random density, from nearly empty to nearly full
+            uint64_t threshold = next_random(&state);
+            for (size_t i = 0; i < size; i++) pixels[i] = next_random(&state) < threshold ? 255 : 0;
+            break;
+        }
+        case 1:
+            fill_cells(rows, cols, (unsigned char (*)[cols])pixels, 1 + random_below(&state, 1 + (int)(size / 200)),
+                       (unsigned int)next_random(&state));
+            break;
+        case 2: {
+            // White image with some border rows and columns cleared, or a
+            // frame of a random thickness touching the border
+            memset(pixels, 255, size);
+            int thickness = 1 + random_below(&state, 3);
+            unsigned char value = random_below(&state, 2) ? 0 : 255;
+            if (value == 255) memset(pixels, 0, size);
+            int sides = random_below(&state, 16);
+            if (sides & 1) fill_rect(rows, cols, pixels, 0, 0, thickness - 1, cols - 1, value);
+            if (sides & 2) fill_rect(rows, cols, pixels, rows - thickness, 0, rows - 1, cols - 1, value);
+            if (sides & 4) fill_rect(rows, cols, pixels, 0, 0, rows - 1, thickness - 1, value);
+            if (sides & 8) fill_rect(rows, cols, pixels, 0, cols - thickness, rows - 1, cols - 1, value);
+            break;
+        }
+        case 3: {
+            // A few isolated pixels and crosses, often on or next to the border
+            int count = 1 + random_below(&state, 8);
+            for (int i = 0; i < count; i++) {
+                int edge = random_below(&state, 3);
+                int x = edge == 0 ? random_below(&state, 2) * (rows - 1) : random_below(&state, rows);
+                int y = edge == 1 ? random_below(&state, 2) * (cols - 1) : random_below(&state, cols);
+                if (random_below(&state, 2)) {
+                    fill_rect(rows, cols, pixels, x - 1, y, x + 1, y, 255);
+                    fill_rect(rows, cols, pixels, x, y - 1, x, y + 1, 255);
+                } else {
+                    pixels[(size_t)x * cols + y] = 255;
+                }
+            }
+            break;
+        }
+        case 4: {
+            int period_x = 1 + random_below(&state, 4), period_y = 1 + random_below(&state, 4);
+            int phase = random_below(&state, 2);
+            for (int x = 0; x < rows; x++) {
+                for (int y = 0; y < cols; y++) {
+                    pixels[(size_t)x * cols + y] = ((x / period_x + y / period_y + phase) & 1) ? 255 : 0;
+                }
+            }
+            break;
+        }
+        case 5: {
+            int vertical = random_below(&state, 2);
+            int on = 1 + random_below(&state, 4), off = 1 + random_below(&state, 3);
+            int phase = random_below(&state, on + off);
+            for (int x = 0; x < rows; x++) {
+                for (int y = 0; y < cols; y++) {
+                    int t = (vertical ? y : x) + phase;
+                    pixels[(size_t)x * cols + y] = t % (on + off) < on ? 255 : 0;
+                }
+            }
+            break;
+        }
+        case 6: {
+            int count = 1 + random_below(&state, 6);
+            for (int i = 0; i < count; i++) {
+                int x = random_below(&state, rows), y = random_below(&state, cols);
+                fill_rect(rows, cols, pixels, x, y, x + random_below(&state, 6), y + random_below(&state, 6),
+                          random_below(&state, 4) ? 255 : 0);
+            }
+            break;
+        }
+        case 7:
+            // All black, all white, or white but for one pixel
+            if (random_below(&state, 3)) memset(pixels, 255, size);
+            if (pixels[0] && random_below(&state, 2)) pixels[random_below(&state, (int)size)] = 0;
+            break;
+        default: {
+            // Mostly white with single-pixel holes, the case where every check passes but one
+            memset(pixels, 255, size);
+            int count = 1 + random_below(&state, 4);
+            for (int i = 0; i < count; i++) pixels[random_below(&state, (int)size)] = 0;
+            break;
+        }
+    }
+    return pattern;
+}
+
+// Runs the program on one image. Returns the number of output pixels that
+// differ from erode(), or -1 if the program did not halt. expected is scratch.
+static int run_image(const fuzz_t* fuzz, const unsigned char* pixels, uint32_t* memory, unsigned char* expected,
+                     uint64_t* cycles) {
+    int rows = fuzz->rows, cols = fuzz->cols;
+    size_t size = (size_t)rows * cols;
+    memset(memory, 0, (fuzz->output + size) * sizeof(uint32_t));
+    for (size_t i = 0; i < size; i++) memory[i] = pixels[i];
+
+    sim_result_t result;
+    sim_run(fuzz->program, memory, fuzz->max_cycles, &result);
+    if (cycles) *cycles = result.cycles;
+    if (!result.halted) return -1;
+
+    memcpy(expected, pixels, size);
+    erode(rows, cols, 0, (unsigned char (*)[cols])expected, NULL);
+    int mismatches = 0;
+    for (size_t i = 0; i < size; i++) mismatches += (memory[fuzz->output + i] != 0) != (expected[i] != 0);
+    return mismatches;
+}
+
+static void fuzz_job(void* arg, int index, int count) {
+    (void)index;
+    (void)count;
+    fuzz_t* fuzz = arg;
+    size_t size = (size_t)fuzz->rows * fuzz->cols;
+    uint32_t* memory = calloc(SIM_MEMORY_WORDS, sizeof(uint32_t));
+    unsigned char* pixels = malloc(size);
+    unsigned char* expected = malloc(size);
+    uint64_t runs[PATTERN_COUNT] = {0};
+    uint64_t done = 0, cycles = 0;
+
+    while (memory && pixels && expected) {
+        uint64_t start = __atomic_fetch_add(&fuzz->next, CLAIM_IMAGES, __ATOMIC_RELAXED);
+        // Stop at the end, or once an earlier image has failed
+        if (start >= fuzz->count || start > __atomic_load_n(&fuzz->failing, __ATOMIC_RELAXED)) break;
+        uint64_t end = start + CLAIM_IMAGES < fuzz->count ? start + CLAIM_IMAGES : fuzz->count;
+        for (uint64_t i = start; i < end; i++) {
+            runs[make_image(fuzz, fuzz->first + i, pixels)]++;
+            uint64_t image_cycles;
+            int status = run_image(fuzz, pixels, memory, expected, &image_cycles);
+            done++;
+            cycles += image_cycles;
+            if (status != 0) {
+                // Keep the lowest failing index, so the result does not depend on scheduling
+                uint64_t failing = __atomic_load_n(&fuzz->failing, __ATOMIC_RELAXED);
+                while (i < failing && !__atomic_compare_exchange_n(&fuzz->failing, &failing, i, 0,
+                                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                }
+                break;
+            }
+        }
+    }
+
+    __atomic_fetch_add(&fuzz->done, done, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&fuzz->cycles, cycles, __ATOMIC_RELAXED);
+    for (int p = 0; p < PATTERN_COUNT; p++) __atomic_fetch_add(&fuzz->pattern_runs[p], runs[p], __ATOMIC_RELAXED);
+    free(memory);
+    free(pixels);
+    free(expected);
+}
+
+// Turns white pixels black while the image still fails: blocks of rows and
+// columns first, halving the block size down to single pixels, and repeating
+// until nothing more can be removed
+static int shrink(const fuzz_t* fuzz, unsigned char* pixels, uint32_t* memory, unsigned char* expected) {
+    int rows = fuzz->rows, cols = fuzz->cols;
+    size_t size = (size_t)rows * cols;
+    unsigned char* saved = malloc(size);
+    if (!saved) return -1;
+    int tries = 0;
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int block = rows > cols ? rows : cols; block >= 1; block /= 2) {
+            for (int x = 0; x < rows; x += block) {
+                for (int y = 0; y < cols; y += block) {
+                    int white = 0;
+                    for (int i = x; i < x + block && i < rows; i++) {
+                        for (int j = y; j < y + block && j < cols; j++) white += pixels[(size_t)i * cols + j] != 0;
+                    }
+                    if (!white) continue;
+                    memcpy(saved, pixels, size);
+                    fill_rect(rows, cols, pixels, x, y, x + block - 1, y + block - 1, 0);
+                    tries++;
+                    if (run_image(fuzz, pixels, memory, expected, NULL) != 0) changed = 1;
+                    else memcpy(pixels, saved, size);
+                }
+            }
+        }
+    }
+    free(saved);
+    return tries;
+}
+
+static void print_failure(const fuzz_t* fuzz, const unsigned char* pixels, uint32_t* memory, unsigned char* expected) {
+    int rows = fuzz->rows, cols = fuzz->cols;
+    uint64_t cycles;
+    int status = run_image(fuzz, pixels, memory, expected, &cycles);
+    if (status < 0) {
+        printf("The program does not halt within %llu cycles\n", (unsigned long long)fuzz->max_cycles);
+    } else {
+        printf("%d output pixels differ after %llu cycles\n", status, (unsigned long long)cycles);
+    }
+    // Input, then program output and erode() side by side: # white, . black,
+    // ! where the program is white and erode() black, ? the other way round
+    printf("%-*s   output\n", cols, "input");
+    for (int x = 0; x < rows; x++) {
+        for (int y = 0; y < cols; y++) putchar(pixels[(size_t)x * cols + y] ? '#' : '.');
+        printf("   ");
+        for (int y = 0; y < cols; y++) {
+            size_t i = (size_t)x * cols + y;
+            int got = status >= 0 && memory[fuzz->output + i] != 0, want = expected[i] != 0;
+            putchar(got == want ? (got ? '#' : '.') : (got ? '!' : '?'));
+        }
+        printf("\n");
+    }
+}
+
+static int save_failure(const fuzz_t* fuzz, const unsigned char* pixels, const char* path) {
+    image_t img;
+    if (image_alloc(&img, fuzz->rows, fuzz->cols, 1, 0)) return -1;
+    memcpy(img.data, pixels, (size_t)fuzz->rows * fuzz->cols);
+    int status = image_save(&img, path);
+    image_free(&img);
+    if (status == 0) printf("Minimal failing image written to %s\n", path);
+    return status;
+}
+
+static int load_program(sim_program_t* program, const char* path) {
+    size_t length = strlen(path);
+    if (length < 4 || strcmp(path + length - 4, ".asm") != 0) return sim_load(program, path);
+    asm_program_t words;
+    if (asm_assemble_file(path, &words)) {
+        asm_program_free(&words);
+        return -1;
+    }
+    int status = sim_decode(program, words.words, words.count);
+    asm_program_free(&words);
+    return status;
+}
+
+static void usage(const char* name) {
+    printf("Usage: %s [options] <program.bin|asm>\n", name);
+    printf("  --size RxC        image size the program is written for (default 20x20)\n");
+    printf("  --count N         images to run (default 1000000)\n");
+    printf("  --seed N          seed of the run (default 1)\n");
+    printf("  --first N         index of the first image, to reproduce a failure (default 0)\n");
+    printf("  --output N        address of the output image (default %d, or right after a larger image)\n", SIM_OUTPUT_BASE);
+    printf("  --max-cycles N    cycles before a run counts as hanging (default 64 per pixel + 100000)\n");
+    printf("  --threads N       worker threads (default: one per CPU)\n");
+    printf("  --save FILE       where to write the minimal failing image (default fuzz_fail.pgm)\n");
+}
+
+int main(int argc, char* argv[]) {
+    fuzz_t fuzz;
+    memset(&fuzz, 0, sizeof(fuzz));
+    fuzz.rows = fuzz.cols = 20;
+    fuzz.output = -1;
+    fuzz.seed = 1;
+    fuzz.count = 1000000;
+    fuzz.failing = UINT64_MAX;
+    int threads = 0;
+    const char* program_file = NULL;
+    const char* save = "fuzz_fail.pgm";
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) != 0) {
+            if (program_file) {
+                usage(argv[0]);
+                return 1;
+            }
+            program_file = argv[i];
+            continue;
+        }
+        const char* value = i + 1 < argc ? argv[++i] : NULL;
+        if (!value) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (strcmp(argv[i - 1], "--count") == 0) fuzz.count = strtoull(value, NULL, 10);
+        else if (strcmp(argv[i - 1], "--seed") == 0) fuzz.seed = strtoull(value, NULL, 0);
+        else if (strcmp(argv[i - 1], "--first") == 0) fuzz.first = strtoull(value, NULL, 10);
+        else if (strcmp(argv[i - 1], "--output") == 0) fuzz.output = atoi(value);
+        else if (strcmp(argv[i - 1], "--max-cycles") == 0) fuzz.max_cycles = strtoull(value, NULL, 10);
+        else if (strcmp(argv[i - 1], "--threads") == 0) threads = atoi(value);
+        else if (strcmp(argv[i - 1], "--save") == 0) save = value;
+        else if (strcmp(argv[i - 1], "--size") == 0) {
+            if (sscanf(value, "%dx%d", &fuzz.rows, &fuzz.cols) != 2 || fuzz.rows <= 0 || fuzz.cols <= 0) {
+                printf("Error: Invalid image size %s\n", value);
+                return 1;
+            }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!program_file) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    long size = (long)fuzz.rows * fuzz.cols;
+    if (fuzz.output < 0 && size <= SIM_MEMORY_WORDS / 2) fuzz.output = sim_output_offset((int)size);
+    if (fuzz.output < size || fuzz.output + size > SIM_MEMORY_WORDS) {
+        printf("Error: %dx%d image does not fit below the output at %d\n", fuzz.rows, fuzz.cols, fuzz.output);
+        return 1;
+    }
+    if (fuzz.max_cycles == 0) fuzz.max_cycles = 64 * (uint64_t)size + 100000;
+
+    sim_program_t program;
+    if (load_program(&program, program_file)) return 1;
+    fuzz.program = &program;
+
+    erode_pool_t* pool = erode_pool_create(threads);
+    if (!pool) {
+        printf("Error: Cannot create thread pool\n");
+        return 1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    erode_pool_run(pool, fuzz_job, &fuzz);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+
+    printf("%llu images in %.2f s on %d threads (%.0f images/s, %.1f M instructions/s)\n",
+           (unsigned long long)fuzz.done, seconds, erode_pool_threads(pool), seconds > 0 ? fuzz.done / seconds : 0.0,
+           seconds > 0 ? fuzz.cycles / seconds * 1e-6 : 0.0);
+    for (int p = 0; p < PATTERN_COUNT; p++) {
+        printf("  %-13s %llu\n", pattern_names[p], (unsigned long long)fuzz.pattern_runs[p]);
+    }
+    erode_pool_destroy(pool);
+
+    int status = 0;
+    if (fuzz.failing != UINT64_MAX) {
+        uint64_t index = fuzz.first + fuzz.failing;
+        uint32_t* memory = calloc(SIM_MEMORY_WORDS, sizeof(uint32_t));
+        unsigned char* pixels = malloc(size);
+        unsigned char* expected = malloc(size);
+        if (!memory || !pixels || !expected) return 1;
+        int pattern = make_image(&fuzz, index, pixels);
+        printf("\nImage %llu (%s, reproduce with --seed %llu --first %llu --count 1) fails:\n",
+               (unsigned long long)index, pattern_names[pattern], (unsigned long long)fuzz.seed,
+               (unsigned long long)index);
+        print_failure(&fuzz, pixels, memory, expected);
+        int tries = shrink(&fuzz, pixels, memory, expected);
+        int white = 0;
+        for (long i = 0; i < size; i++) white += pixels[i] != 0;
+        printf("\nShrunk in %d runs to %d white pixel%s:\n", tries, white, white == 1 ? "" : "s");
+        print_failure(&fuzz, pixels, memory, expected);
+        save_failure(&fuzz, pixels, save);
+        free(memory);
+        free(pixels);
+        free(expected);
+        status = 1;
+    } else {
+        printf("No mismatches\n");
+    }
+    sim_free(&program);
+    return status;
+}
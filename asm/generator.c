@@ -0,0 +1,604 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "assembler.h"
+#include "erode.h"
+#include "image.h"
+#include "sim.h"
+
+// Erosion program generator. Emits CPUTop assembly for any image size in
+// several variants, runs each one on sample images with the simulator (the
+// CPU is single-cycle, so executed instructions are clock cycles), checks the
+// result against erode() and keeps the variant with the fewest cycles.
+//
+// The image is stored row by row from address 0, and the output image is
+// written from sim_output_offset(), which must be zero on entry: like the
+// hand-written programs, only surviving pixels are stored (as 255).
+//
+// Variants:
+// - loop:ORDER             one loop over the interior pixels; the five cross
+//                          pixels are checked in ORDER and the first zero skips
+//                          to the next pixel
+// - unrolled:ORDER         the same checks with every row fully unrolled, so
+//                          the column is an immediate and there is no
+//                          per-pixel loop overhead
+// - reuse:ORDER            walks each row with a small state machine that
+//                          remembers which horizontal neighbours are already
+//                          known to be set, so a set pixel costs one new load
+//                          in the row plus the pixels above and below (in
+//                          ORDER), and a zero skips up to three pixels at once
+// - unrolled-reuse:ORDER   the state machine with rows unrolled, where the
+//                          state is the code position
+//
+// The unrolled variants unroll one row, about 11 (unrolled) or 19
+// (unrolled-reuse) instructions per column, so rows longer than about 5900 or
+// 3400 pixels exceed the 65536-word program memory and those variants are
+// skipped. The loop and reuse variants fit at every size.
+//
+// Build: gcc -O2 -pthread -DERODE_NO_MAIN -DASSEMBLER_NO_MAIN -DSIM_NO_MAIN -o generator
+//            asm/generator.c asm/assembler.c asm/sim.c asm/erode*.c asm/image.c
+
+#define SAMPLE_IMAGES   3
+
+typedef enum {
+    GEN_LOOP,
+    GEN_UNROLLED,
+    GEN_REUSE,
+    GEN_UNROLLED_REUSE,
+    GEN_KIND_COUNT
+} gen_kind_t;
+
+static const char* const kind_names[GEN_KIND_COUNT] = {"loop", "unrolled", "reuse", "unrolled-reuse"};
+
+typedef struct {
+    gen_kind_t kind;
+    char order[6];          // cross pixels c/u/d/l/r, or u/d for the reuse variants
+} gen_variant_t;
+
+typedef struct {
+    int rows;
+    int cols;
+    int output;
+} gen_layout_t;
+
+// Growing source text
+typedef struct {
+    char* text;
+    size_t length;
+    size_t capacity;
+    int failed;
+} source_t;
+
+__attribute__((format(printf, 2, 3)))
+static void emit(source_t* src, const char* format, ...) {
+    if (src->failed) return;
+    for (;;) {
+        va_list args;
+        va_start(args, format);
+        int needed = vsnprintf(src->text + src->length, src->capacity - src->length, format, args);
+        va_end(args);
+        if (needed < 0) {
+            src->failed = 1;
+            return;
+        }
+        if (src->length + needed < src->capacity) {
+            src->length += needed;
+            return;
+        }
+        size_t capacity = src->capacity ? 2 * src->capacity : 4096;
+        while (capacity <= src->length + needed) capacity *= 2;
+        char* text = realloc(src->text, capacity);
+        if (!text) {
+            src->failed = 1;
+            return;
+        }
+        src->text = text;
+        src->capacity = capacity;
+    }
+}
+
+// Address offset of a cross pixel relative to the centre
+static int cross_offset(char pixel, int cols) {
+    switch (pixel) {
+        case 'u': return -cols;
+        case 'd': return cols;
+        case 'l': return -1;
+        case 'r': return 1;
+        default:  return 0;
+    }
+}
+
+static void emit_constants(source_t* src, int first, int row_last, int image_last) {
+    emit(src, "ADDI $r1, $r0, 255      # r1 = constant 255\n");
+    emit(src, "ADDI $r2, $r0, %d       # r2 = current pixel or row\n", first);
+    if (row_last >= 0) emit(src, "ADDI $r3, $r0, %d       # r3 = last interior pixel of the row\n", row_last);
+    emit(src, "ADDI $r5, $r0, %d       # r5 = last interior pixel or row\n", image_last);
+}
+
+static void generate_loop(source_t* src, const gen_layout_t* layout, const char* order) {
+    int cols = layout->cols;
+    emit_constants(src, cols + 1, 2 * cols - 2, (layout->rows - 2) * cols + cols - 2);
+    emit(src, "pixel:\n");
+    for (const char* p = order; *p; p++) {
+        emit(src, "LOAD $r4, %d($r2)\n", cross_offset(*p, cols));
+        emit(src, "BEQ $r4, $r0, next\n");
+    }
+    emit(src, "STORE $r1, %d($r2)\n", layout->output);
+    emit(src, "next:\n");
+    emit(src, "ADDI $r2, $r2, 1\n");
+    emit(src, "BGE $r3, $r2, pixel\n");
+    emit(src, "ADDI $r2, $r2, 2       # skip the right and left border\n");
+    emit(src, "ADDI $r3, $r3, %d\n", cols);
+    emit(src, "BGE $r5, $r3, pixel\n");
+    emit(src, "END\n");
+}
+
+static void generate_unrolled(source_t* src, const gen_layout_t* layout, const char* order) {
+    int cols = layout->cols;
+    emit_constants(src, cols, -1, (layout->rows - 2) * cols);
+    emit(src, "row:\n");
+    for (int x = 1; x <= cols - 2; x++) {
+        emit(src, "p%d:\n", x);
+        for (const char* p = order; *p; p++) {
+            emit(src, "LOAD $r4, %d($r2)\n", x + cross_offset(*p, cols));
+            emit(src, "BEQ $r4, $r0, p%d\n", x + 1);
+        }
+        emit(src, "STORE $r1, %d($r2)\n", layout->output + x);
+    }
+    emit(src, "p%d:\n", cols - 1);
+    emit(src, "ADDI $r2, $r2, %d\n", cols);
+    emit(src, "BGE $r5, $r2, row\n");
+    emit(src, "END\n");
+}
+
+// States of the row walk at pixel x:
+//   s0: nothing known
+//   s1: pixel x - 1 is set
+//   s2: pixels x - 1 and x are set
+// A zero at x + 1 clears x, x + 1 and x + 2 (s0 at x + 3), a zero at x clears
+// x and x + 1 (s1 at x + 2, since x + 1 is set), a zero at x - 1 clears x (s2
+// at x + 1). After the vertical checks the walk continues in s2 at x + 1.
+static void generate_reuse(source_t* src, const gen_layout_t* layout, const char* order) {
+    int cols = layout->cols;
+    emit_constants(src, cols + 1, 2 * cols - 2, (layout->rows - 2) * cols + cols - 2);
+    emit(src, "s0:\n");
+    emit(src, "LOAD $r4, 1($r2)\n");
+    emit(src, "BEQ $r4, $r0, skip3\n");
+    emit(src, "LOAD $r4, 0($r2)\n");
+    emit(src, "BEQ $r4, $r0, skip2\n");
+    emit(src, "LOAD $r4, -1($r2)\n");
+    emit(src, "BEQ $r4, $r0, skip1\n");
+    emit(src, "JUMP vertical\n");
+    emit(src, "s1:\n");
+    emit(src, "LOAD $r4, 1($r2)\n");
+    emit(src, "BEQ $r4, $r0, skip3\n");
+    emit(src, "LOAD $r4, 0($r2)\n");
+    emit(src, "BEQ $r4, $r0, skip2\n");
+    emit(src, "JUMP vertical\n");
+    emit(src, "s2:\n");
+    emit(src, "LOAD $r4, 1($r2)\n");
+    emit(src, "BEQ $r4, $r0, skip3\n");
+    emit(src, "vertical:\n");
+    for (const char* p = order; *p; p++) {
+        emit(src, "LOAD $r4, %d($r2)\n", cross_offset(*p, cols));
+        emit(src, "BEQ $r4, $r0, skip1\n");
+    }
+    emit(src, "STORE $r1, %d($r2)\n", layout->output);
+    emit(src, "skip1:\n");
+    emit(src, "ADDI $r2, $r2, 1\n");
+    emit(src, "BGE $r3, $r2, s2\n");
+    emit(src, "JUMP row_end\n");
+    emit(src, "skip3:\n");
+    emit(src, "ADDI $r2, $r2, 3\n");
+    emit(src, "BGE $r3, $r2, s0\n");
+    emit(src, "JUMP row_end\n");
+    emit(src, "skip2:\n");
+    emit(src, "ADDI $r2, $r2, 2\n");
+    emit(src, "BGE $r3, $r2, s1\n");
+    emit(src, "row_end:\n");
+    emit(src, "ADDI $r2, $r3, 3       # first interior pixel of the next row\n");
+    emit(src, "ADDI $r3, $r3, %d\n", cols);
+    emit(src, "BGE $r5, $r3, s0\n");
+    emit(src, "END\n");
+}
+
+// Label of state `state` at column x, or the end of the row past the last
+// interior column
+static const char* state_label(char* label, size_t size, char state, int x, int cols) {
+    if (x > cols - 2) snprintf(label, size, "row_end");
+    else snprintf(label, size, "%c%d", state, x);
+    return label;
+}
+
+// The reuse state machine with the row unrolled. The s2 blocks and vertical
+// checks are laid out in column order so that the common path falls through;
+// s0 and s1 blocks jump to the vertical checks of their column.
+static void generate_unrolled_reuse(source_t* src, const gen_layout_t* layout, const char* order) {
+    int cols = layout->cols;
+    char a[32], b[32], c[32];
+    emit_constants(src, cols, -1, (layout->rows - 2) * cols);
+    emit(src, "row:\n");
+    for (int x = 1; x <= cols - 2; x++) {
+        if (x == 1) {
+            // A row starts in s0, which falls into the column 1 checks
+            emit(src, "a1:\n");
+            emit(src, "LOAD $r4, 2($r2)\n");
+            emit(src, "BEQ $r4, $r0, %s\n", state_label(a, sizeof(a), 'a', 4, cols));
+            emit(src, "LOAD $r4, 1($r2)\n");
+            emit(src, "BEQ $r4, $r0, %s\n", state_label(b, sizeof(b), 'b', 3, cols));
+            emit(src, "LOAD $r4, 0($r2)\n");
+            emit(src, "BEQ $r4, $r0, %s\n", state_label(c, sizeof(c), 'c', 2, cols));
+        } else {
+            emit(src, "c%d:\n", x);
+            emit(src, "LOAD $r4, %d($r2)\n", x + 1);
+            emit(src, "BEQ $r4, $r0, %s\n", state_label(a, sizeof(a), 'a', x + 3, cols));
+        }
+        emit(src, "v%d:\n", x);
+        for (const char* p = order; *p; p++) {
+            emit(src, "LOAD $r4, %d($r2)\n", x + cross_offset(*p, cols));
+            emit(src, "BEQ $r4, $r0, %s\n", state_label(c, sizeof(c), 'c', x + 1, cols));
+        }
+        emit(src, "STORE $r1, %d($r2)\n", layout->output + x);
+    }
+    emit(src, "row_end:\n");
+    emit(src, "ADDI $r2, $r2, %d\n", cols);
+    emit(src, "BGE $r5, $r2, row\n");
+    emit(src, "END\n");
+
+    // s0 (a) and s1 (b) blocks
+    for (int x = 2; x <= cols - 2; x++) {
+        for (int state = 0; state < 2; state++) {
+            emit(src, "%c%d:\n", state ? 'b' : 'a', x);
+            emit(src, "LOAD $r4, %d($r2)\n", x + 1);
+            emit(src, "BEQ $r4, $r0, %s\n", state_label(a, sizeof(a), 'a', x + 3, cols));
+            emit(src, "LOAD $r4, %d($r2)\n", x);
+            emit(src, "BEQ $r4, $r0, %s\n", state_label(b, sizeof(b), 'b', x + 2, cols));
+            if (state == 0) {
+                emit(src, "LOAD $r4, %d($r2)\n", x - 1);
+                emit(src, "BEQ $r4, $r0, %s\n", state_label(c, sizeof(c), 'c', x + 1, cols));
+            }
+            emit(src, "JUMP v%d\n", x);
+        }
+    }
+}
+
+static int generate(source_t* src, const gen_layout_t* layout, const gen_variant_t* variant) {
+    memset(src, 0, sizeof(*src));
+    emit(src, "# %dx%d erosion, %s:%s, output at %d\n", layout->rows, layout->cols,
+         kind_names[variant->kind], variant->order, layout->output);
+    if (layout->rows < 3 || layout->cols < 3) {
+        emit(src, "END                     # no interior pixels\n");
+    } else {
+        switch (variant->kind) {
+            case GEN_LOOP:           generate_loop(src, layout, variant->order); break;
+            case GEN_UNROLLED:       generate_unrolled(src, layout, variant->order); break;
+            case GEN_REUSE:          generate_reuse(src, layout, variant->order); break;
+            case GEN_UNROLLED_REUSE: generate_unrolled_reuse(src, layout, variant->order); break;
+            default: break;
+        }
+    }
+    return src->failed ? -1 : 0;
+}
+
+// Sample image and the expected output
+typedef struct {
+    unsigned char* pixels;
+    unsigned char* expected;
+} sample_t;
+
+typedef struct {
+    uint64_t cycles;        // total over the samples
+    int instructions;
+    int correct;
+} gen_score_t;
+
+// Instructions in a generated source: every line that is not a label, a
+// comment or blank (labels are always on their own line)
+static int count_instructions(const source_t* src) {
+    int count = 0;
+    const char* end = src->text + src->length;
+    for (const char* line = src->text; line < end;) {
+        const char* next = memchr(line, '\n', end - line);
+        if (!next) next = end;
+        const char* last = NULL;
+        for (const char* c = line; c < next && *c != '#'; c++) {
+            if (*c != ' ' && *c != '\t' && *c != '\r') last = c;
+        }
+        if (last && *last != ':') count++;
+        line = next + 1;
+    }
+    return count;
+}
+
+// Assemble and simulate a variant on every sample. Returns 1 if the program
+// does not fit in program memory (score->instructions is then its length),
+// -1 if it does not assemble.
+static int evaluate(const gen_layout_t* layout, const gen_variant_t* variant, const sample_t* samples, int sample_count,
+                    uint32_t* memory, gen_score_t* score) {
+    source_t src;
+    asm_program_t words;
+    sim_program_t program;
+    if (generate(&src, layout, variant)) {
+        free(src.text);
+        return -1;
+    }
+    score->instructions = count_instructions(&src);
+    if (score->instructions > ASM_MAX_INSTRUCTIONS) {
+        free(src.text);
+        return 1;
+    }
+    int errors = asm_assemble(src.text, src.length, &words);
+    free(src.text);
+    if (errors || sim_decode(&program, words.words, words.count)) {
+        asm_program_free(&words);
+        return -1;
+    }
+
+    size_t size = (size_t)layout->rows * layout->cols;
+    score->cycles = 0;
+    score->instructions = words.count;
+    score->correct = 1;
+    for (int s = 0; s < sample_count; s++) {
+        memset(memory, 0, SIM_MEMORY_WORDS * sizeof(uint32_t));
+        for (size_t i = 0; i < size; i++) memory[i] = samples[s].pixels[i];
+        sim_result_t result;
+        sim_run(&program, memory, 0, &result);
+        score->cycles += result.cycles;
+        for (size_t i = 0; i < size; i++) {
+            if ((memory[layout->output + i] != 0) != (samples[s].expected[i] != 0)) score->correct = 0;
+        }
+    }
+    sim_free(&program);
+    asm_program_free(&words);
+    return 0;
+}
+
+// Every permutation of `pixels`, in lexicographic order
+static int permutations(const char* pixels, char (*out)[6]) {
+    int n = (int)strlen(pixels);
+    char p[6];
+    strcpy(p, pixels);
+    int count = 0;
+    for (;;) {
+        strcpy(out[count++], p);
+        int i = n - 2;
+        while (i >= 0 && p[i] >= p[i + 1]) i--;
+        if (i < 0) return count;
+        int j = n - 1;
+        while (p[j] <= p[i]) j--;
+        char t = p[i]; p[i] = p[j]; p[j] = t;
+        for (int a = i + 1, b = n - 1; a < b; a++, b--) {
+            t = p[a]; p[a] = p[b]; p[b] = t;
+        }
+    }
+}
+
+static int parse_variant(const char* name, gen_variant_t* variant) {
+    const char* colon = strchr(name, ':');
+    size_t kind_length = colon ? (size_t)(colon - name) : strlen(name);
+    for (int k = 0; k < GEN_KIND_COUNT; k++) {
+        if (strlen(kind_names[k]) == kind_length && strncmp(name, kind_names[k], kind_length) == 0) {
+            variant->kind = k;
+            const char* order = colon ? colon + 1 : (k == GEN_LOOP || k == GEN_UNROLLED ? "cudlr" : "ud");
+            const char* pixels = k == GEN_LOOP || k == GEN_UNROLLED ? "cdlru" : "du";
+            char sorted[6];
+            if (strlen(order) != strlen(pixels)) return -1;
+            strcpy(sorted, order);
+            // The order must use every pixel exactly once
+            for (size_t i = 0; sorted[i]; i++) {
+                for (size_t j = i + 1; sorted[j]; j++) {
+                    if (sorted[j] < sorted[i]) { char t = sorted[i]; sorted[i] = sorted[j]; sorted[j] = t; }
+                }
+            }
+            if (strcmp(sorted, pixels) != 0) return -1;
+            strcpy(variant->order, order);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static unsigned char* load_sample(const char* path, const gen_layout_t* layout) {
+    image_t img;
+    if (image_map(&img, path, 0)) return NULL;
+    unsigned char* pixels = NULL;
+    if (img.channels != 1 || img.rows != layout->rows || img.cols != layout->cols) {
+        printf("Error: %s is not a %dx%d grayscale image\n", path, layout->rows, layout->cols);
+    } else if ((pixels = malloc((size_t)img.rows * img.cols))) {
+        for (int x = 0; x < img.rows; x++) {
+            memcpy(pixels + (size_t)x * img.cols, img.data + x * img.stride, img.cols);
+        }
+    }
+    image_free(&img);
+    return pixels;
+}
+
+static void usage(const char* name) {
+    printf("Usage: %s <rows>x<cols> <output.asm> [options] [sample.bmp|pgm|pbm ...]\n", name);
+    printf("  --bin FILE        also write the assembled program\n");
+    printf("  --variant NAME    use this variant instead of searching, e.g. loop:cudlr or unrolled-reuse:ud\n");
+    printf("  --output N        address of the output image (default %d, or right after a larger image)\n", SIM_OUTPUT_BASE);
+    printf("  --list            print the cycles of every variant\n");
+    printf("Without sample images the variants are scored on %d generated cell images.\n", SAMPLE_IMAGES);
+}
+
+int main(int argc, char* argv[]) {
+    gen_layout_t layout = {0, 0, -1};
+    const char* asm_file = NULL;
+    const char* bin_file = NULL;
+    const char* forced = NULL;
+    int list = 0;
+    const char** sample_files = calloc(argc, sizeof(char*));
+    int sample_file_count = 0;
+    if (!sample_files) return 1;
+
+    for (int i = 1; i < argc; i++) {
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "--list") == 0) list = 1;
+        else if (strcmp(argv[i], "--bin") == 0 && value) bin_file = argv[++i];
+        else if (strcmp(argv[i], "--variant") == 0 && value) forced = argv[++i];
+        else if (strcmp(argv[i], "--output") == 0 && value) layout.output = atoi(argv[++i]);
+        else if (strncmp(argv[i], "--", 2) == 0) {
+            usage(argv[0]);
+            return 1;
+        } else if (!layout.rows) {
+            if (sscanf(argv[i], "%dx%d", &layout.rows, &layout.cols) != 2 || layout.rows <= 0 || layout.cols <= 0) {
+                printf("Error: Invalid image size %s\n", argv[i]);
+                return 1;
+            }
+        } else if (!asm_file) asm_file = argv[i];
+        else sample_files[sample_file_count++] = argv[i];
+    }
+    if (!asm_file) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Loop bounds are compared signed, so pixel addresses must fit in 15 bits;
+    // load and store addresses wrap at 16 bits and can use the whole memory
+    int size = layout.rows * layout.cols;
+    if (layout.output < 0) layout.output = sim_output_offset(size);
+    if (size > 32767 || layout.output < size || layout.output + size > SIM_MEMORY_WORDS) {
+        printf("Error: A %dx%d image with the output at %d does not fit in data memory\n",
+               layout.rows, layout.cols, layout.output);
+        return 1;
+    }
+
+    int sample_count = sample_file_count ? sample_file_count : SAMPLE_IMAGES;
+    sample_t* samples = calloc(sample_count, sizeof(sample_t));
+    uint32_t* memory = malloc(SIM_MEMORY_WORDS * sizeof(uint32_t));
+    if (!samples || !memory) return 1;
+    for (int s = 0; s < sample_count; s++) {
+        if (sample_file_count) {
+            samples[s].pixels = load_sample(sample_files[s], &layout);
+        } else if ((samples[s].pixels = malloc(size))) {
+            fill_cells(layout.rows, layout.cols, (unsigned char (*)[layout.cols])samples[s].pixels, 1 + size / 2250, s + 1);
+        }
+        samples[s].expected = malloc(size);
+        if (!samples[s].pixels || !samples[s].expected) return 1;
+        memcpy(samples[s].expected, samples[s].pixels, size);
+        erode(layout.rows, layout.cols, 0, (unsigned char (*)[layout.cols])samples[s].expected, NULL);
+    }
+
+    // Candidate variants: every check order for the plain variants, both
+    // vertical orders for the reuse variants
+    static char orders5[120][6], orders2[2][6];
+    int count5 = permutations("cdlru", orders5);
+    int count2 = permutations("du", orders2);
+    int candidate_count = forced ? 1 : 2 * count5 + 2 * count2;
+    gen_variant_t* candidates = malloc(candidate_count * sizeof(gen_variant_t));
+    if (!candidates) return 1;
+    if (forced) {
+        if (parse_variant(forced, &candidates[0])) {
+            printf("Error: Unknown variant %s\n", forced);
+            return 1;
+        }
+    } else {
+        int n = 0;
+        for (int k = 0; k < GEN_KIND_COUNT; k++) {
+            int reuse = k == GEN_REUSE || k == GEN_UNROLLED_REUSE;
+            for (int i = 0; i < (reuse ? count2 : count5); i++) {
+                candidates[n].kind = k;
+                strcpy(candidates[n].order, reuse ? orders2[i] : orders5[i]);
+                n++;
+            }
+        }
+    }
+
+    // The unrolled variants grow with the image and can exceed program
+    // memory; those are left out and the best of the rest is kept
+    int best = -1;
+    gen_score_t best_score = {0, 0, 0};
+    gen_score_t family_best[GEN_KIND_COUNT];
+    int family_index[GEN_KIND_COUNT] = {-1, -1, -1, -1};
+    int family_size[GEN_KIND_COUNT] = {0, 0, 0, 0};
+    for (int i = 0; i < candidate_count; i++) {
+        gen_score_t score;
+        int status = evaluate(&layout, &candidates[i], samples, sample_count, memory, &score);
+        if (status < 0) {
+            printf("Error: Variant %s:%s does not assemble\n", kind_names[candidates[i].kind], candidates[i].order);
+            return 1;
+        }
+        if (status > 0) {
+            if (list) {
+                printf("%-16s %-6s %8d instructions, does not fit in program memory\n", kind_names[candidates[i].kind],
+                       candidates[i].order, score.instructions);
+            }
+            family_size[candidates[i].kind] = score.instructions;
+            continue;
+        }
+        if (!score.correct) {
+            printf("Error: Variant %s:%s differs from erode()\n", kind_names[candidates[i].kind], candidates[i].order);
+            return 1;
+        }
+        if (list) {
+            printf("%-16s %-6s %8d instructions %12llu cycles\n", kind_names[candidates[i].kind], candidates[i].order,
+                   score.instructions, (unsigned long long)score.cycles);
+        }
+        // Fewest cycles, then the shorter program
+        gen_kind_t kind = candidates[i].kind;
+        if (family_index[kind] < 0 || score.cycles < family_best[kind].cycles) {
+            family_index[kind] = i;
+            family_best[kind] = score;
+        }
+        if (best < 0 || score.cycles < best_score.cycles ||
+            (score.cycles == best_score.cycles && score.instructions < best_score.instructions)) {
+            best = i;
+            best_score = score;
+        }
+    }
+
+    for (int k = 0; k < GEN_KIND_COUNT; k++) {
+        if (family_index[k] < 0) {
+            if (family_size[k]) {
+                printf("%-16s %-6s %8d instructions, over the %d of program memory\n", kind_names[k], "",
+                       family_size[k], ASM_MAX_INSTRUCTIONS);
+            }
+            continue;
+        }
+        const gen_variant_t* v = &candidates[family_index[k]];
+        printf("%-16s %-6s %8d instructions %12llu cycles%s\n", kind_names[k], v->order, family_best[k].instructions,
+               (unsigned long long)family_best[k].cycles, family_index[k] == best ? "  <- selected" : "");
+    }
+
+    if (best < 0) {
+        printf("Error: No variant for %dx%d fits in %d instructions of program memory\n", layout.rows, layout.cols,
+               ASM_MAX_INSTRUCTIONS);
+        return 1;
+    }
+
+    source_t src;
+    if (generate(&src, &layout, &candidates[best])) return 1;
+    FILE* file = fopen(asm_file, "w");
+    if (!file || fwrite(src.text, 1, src.length, file) != src.length) {
+        printf("Error: Cannot create output file %s\n", asm_file);
+        return 1;
+    }
+    fclose(file);
+    if (bin_file) {
+        asm_program_t words;
+        if (asm_assemble(src.text, src.length, &words)) return 1;
+        file = fopen(bin_file, "wb");
+        if (!file || fwrite(words.words, sizeof(uint32_t), words.count, file) != (size_t)words.count) {
+            printf("Error: Cannot create output file %s\n", bin_file);
+            return 1;
+        }
+        fclose(file);
+        asm_program_free(&words);
+    }
+    printf("Wrote %s:%s for %dx%d to %s, %llu cycles on %d sample image%s\n", kind_names[candidates[best].kind],
+           candidates[best].order, layout.rows, layout.cols, asm_file, (unsigned long long)best_score.cycles,
+           sample_count, sample_count == 1 ? "" : "s");
+
+    free(src.text);
+    for (int s = 0; s < sample_count; s++) {
+        free(samples[s].pixels);
+        free(samples[s].expected);
+    }
+    free(samples);
+    free(candidates);
+    free(memory);
+    free(sample_files);
+    return 0;
+}
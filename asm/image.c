@@ -0,0 +1,489 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "image.h"
+
+#define IMAGE_ALIGNMENT     64
+#define HUGE_PAGE_SIZE      ((size_t)2 << 20)
+
+#define BMP_FILE_HEADER     14
+#define BMP_INFO_HEADER     40
+#define BMP_PALETTE         1024
+
+enum {
+    STORAGE_NONE,
+    STORAGE_MALLOC,
+    STORAGE_MMAP
+};
+
+static uint32_t read_u32(const unsigned char* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t read_u16(const unsigned char* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static void write_u32(unsigned char* p, uint32_t v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+static void write_u16(unsigned char* p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+}
+
+// Allocate an uninitialised image with contiguous rows and a cache line
+// aligned first pixel. With IMAGE_HUGE_PAGES the pixels come from an anonymous
+// mapping backed by explicit huge pages, or transparent huge pages as fallback.
+int image_alloc(image_t* img, int rows, int cols, int channels, int flags) {
+    memset(img, 0, sizeof(image_t));
+    if (rows <= 0 || cols <= 0 || channels <= 0) return -1;
+    img->rows = rows;
+    img->cols = cols;
+    img->channels = channels;
+    img->stride = (size_t)cols * channels;
+    size_t size = img->stride * rows;
+
+    if (flags & IMAGE_HUGE_PAGES) {
+        size_t mapped = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        void* p = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p == MAP_FAILED) {
+            p = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p != MAP_FAILED) madvise(p, mapped, MADV_HUGEPAGE);
+        }
+        if (p != MAP_FAILED) {
+            img->storage = STORAGE_MMAP;
+            img->base = p;
+            img->size = mapped;
+            img->data = p;
+            return 0;
+        }
+    }
+
+    void* p;
+    if (posix_memalign(&p, IMAGE_ALIGNMENT, size) != 0) return -1;
+    img->storage = STORAGE_MALLOC;
+    img->base = p;
+    img->size = size;
+    img->data = p;
+    return 0;
+}
+
+void image_free(image_t* img) {
+    if (img->storage == STORAGE_MMAP) {
+        munmap(img->base, img->size);
+    } else if (img->storage == STORAGE_MALLOC) {
+        free(img->base);
+    }
+    memset(img, 0, sizeof(image_t));
+}
+
+int image_is_contiguous(const image_t* img) {
+    return img->stride == (size_t)img->cols * img->channels;
+}
+
+// Contiguous heap copy of any image, e.g. a padded BMP mapping
+int image_copy(image_t* dst, const image_t* src, int flags) {
+    if (image_alloc(dst, src->rows, src->cols, src->channels, flags)) return -1;
+    dst->bottom_up = src->bottom_up;
+    for (int x = 0; x < src->rows; x++) {
+        memcpy(dst->data + x * dst->stride, src->data + x * src->stride, dst->stride);
+    }
+    return 0;
+}
+
+image_format_t image_format_from_path(const char* path) {
+    const char* dot = strrchr(path, '.');
+    if (!dot) return IMAGE_FORMAT_UNKNOWN;
+    if (strcasecmp(dot, ".bmp") == 0) return IMAGE_FORMAT_BMP;
+    if (strcasecmp(dot, ".pgm") == 0) return IMAGE_FORMAT_PGM;
+    if (strcasecmp(dot, ".pbm") == 0) return IMAGE_FORMAT_PBM;
+    return IMAGE_FORMAT_UNKNOWN;
+}
+
+// Read the next decimal field of a PNM header, skipping whitespace and comments
+static int pnm_field(const unsigned char* bytes, size_t size, size_t* pos, int* value) {
+    while (*pos < size) {
+        if (bytes[*pos] == '#') {
+            while (*pos < size && bytes[*pos] != '\n') (*pos)++;
+        } else if (isspace(bytes[*pos])) {
+            (*pos)++;
+        } else {
+            break;
+        }
+    }
+    if (*pos >= size || !isdigit(bytes[*pos])) return -1;
+    long v = 0;
+    while (*pos < size && isdigit(bytes[*pos])) {
+        v = v * 10 + (bytes[*pos] - '0');
+        if (v > 1000000000) return -1;
+        (*pos)++;
+    }
+    *value = (int)v;
+    return 0;
+}
+
+static int map_bmp(image_t* img, unsigned char* bytes, size_t size, const char* path, int raw) {
+    if (size < BMP_FILE_HEADER + BMP_INFO_HEADER) {
+        printf("Error: Truncated BMP header in %s\n", path);
+        return -1;
+    }
+    uint32_t offset = read_u32(bytes + 10);
+    uint32_t info_size = read_u32(bytes + 14);
+    // The fields below are those of BITMAPINFOHEADER; the older 12-byte core
+    // header has them elsewhere
+    if (info_size < BMP_INFO_HEADER || info_size > size - BMP_FILE_HEADER) {
+        printf("Error: Unsupported BMP header in %s (info header of %u bytes)\n", path, info_size);
+        return -1;
+    }
+    int32_t width = (int32_t)read_u32(bytes + 18);
+    int32_t height = (int32_t)read_u32(bytes + 22);
+    uint16_t bpp = read_u16(bytes + 28);
+    uint32_t compression = read_u32(bytes + 30);
+    uint32_t colors = read_u32(bytes + 46);
+
+    if ((bpp != 8 && bpp != 24) || compression != 0 || width <= 0 || height == 0 || height == INT32_MIN) {
+        printf("Error: Unsupported BMP in %s (only uncompressed 8 and 24 bit)\n", path);
+        return -1;
+    }
+    int rows = height < 0 ? -height : height;
+    int channels = bpp / 8;
+    size_t stride = ((size_t)width * channels + 3) & ~(size_t)3;
+    if (offset > size || stride * rows > size - offset) {
+        printf("Error: Truncated BMP pixel data in %s\n", path);
+        return -1;
+    }
+
+    img->rows = rows;
+    img->cols = width;
+    img->channels = channels;
+    img->stride = stride;
+    img->data = bytes + offset;
+    img->bottom_up = height > 0;
+
+    if (bpp == 8) {
+        // Indices are used as grey levels directly when the palette is the
+        // identity ramp. Any other palette is resolved into a copy.
+        if (colors == 0 || colors > 256) colors = 256;
+        const unsigned char* palette = bytes + BMP_FILE_HEADER + info_size;
+        if (palette + colors * 4 > bytes + offset) {
+            printf("Error: Truncated BMP palette in %s\n", path);
+            return -1;
+        }
+        int identity = 1;
+        for (uint32_t i = 0; i < colors; i++) {
+            identity &= palette[4 * i] == i && palette[4 * i + 1] == i && palette[4 * i + 2] == i;
+        }
+        if (!identity && raw) {
+            printf("Error: %s has a colour palette, convert it to grey levels first\n", path);
+            return -1;
+        }
+        if (!identity) {
+            unsigned char grey[256] = {0};
+            for (uint32_t i = 0; i < colors; i++) {
+                grey[i] = (palette[4 * i] * 29 + palette[4 * i + 1] * 150 + palette[4 * i + 2] * 77) >> 8;
+            }
+            image_t copy;
+            if (image_alloc(&copy, rows, width, 1, 0)) return -1;
+            copy.bottom_up = img->bottom_up;
+            for (int x = 0; x < rows; x++) {
+                const unsigned char* src = img->data + x * stride;
+                unsigned char* dst = copy.data + x * copy.stride;
+                for (int y = 0; y < width; y++) dst[y] = grey[src[y]];
+            }
+            *img = copy;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int map_pnm(image_t* img, unsigned char* bytes, size_t size, const char* path, int raw) {
+    int packed = bytes[1] == '4';
+    size_t pos = 2;
+    int cols, rows, maxval = 1;
+    if (pnm_field(bytes, size, &pos, &cols) || pnm_field(bytes, size, &pos, &rows) ||
+        (!packed && pnm_field(bytes, size, &pos, &maxval)) || pos >= size || cols <= 0 || rows <= 0) {
+        printf("Error: Bad PNM header in %s\n", path);
+        return -1;
+    }
+    pos++;  // single whitespace before the raster
+    if (maxval > 255) {
+        printf("Error: Only 8-bit PGM is supported (%s has maxval %d)\n", path, maxval);
+        return -1;
+    }
+    size_t stride = packed ? ((size_t)cols + 7) / 8 : (size_t)cols;
+    if (stride * rows > size - pos) {
+        printf("Error: Truncated PNM raster in %s\n", path);
+        return -1;
+    }
+
+    if (!packed) {
+        img->rows = rows;
+        img->cols = cols;
+        img->channels = 1;
+        img->stride = stride;
+        img->data = bytes + pos;
+        return 0;
+    }
+
+    if (raw) {
+        printf("Error: %s is a PBM, its bits cannot be used in place\n", path);
+        return -1;
+    }
+    // PBM: 1 bits are black, unpack to 0 and white to 255
+    image_t copy;
+    if (image_alloc(&copy, rows, cols, 1, 0)) return -1;
+    for (int x = 0; x < rows; x++) {
+        const unsigned char* src = bytes + pos + x * stride;
+        unsigned char* dst = copy.data + x * copy.stride;
+        for (int y = 0; y < cols; y++) {
+            dst[y] = (src[y >> 3] & (0x80 >> (y & 7))) ? 0 : 255;
+        }
+    }
+    *img = copy;
+    return 1;
+}
+
+// Returns 0 with the pixels in bytes, 1 if converted into a heap image, -1 on errors
+static int parse_image(image_t* img, unsigned char* bytes, size_t size, const char* path, int raw) {
+    if (size >= 2 && bytes[0] == 'B' && bytes[1] == 'M') return map_bmp(img, bytes, size, path, raw);
+    if (size >= 3 && bytes[0] == 'P' && (bytes[1] == '5' || bytes[1] == '4')) return map_pnm(img, bytes, size, path, raw);
+    printf("Error: Unknown image format in %s\n", path);
+    return -1;
+}
+
+// Parse a BMP, PGM or PBM file that is already in memory, e.g. read into a
+// reused buffer. BMP and PGM pixels point into bytes, which must outlive the
+// image, and nothing is allocated; PBM and palette BMPs are converted into a
+// heap image as image_map() does (or rejected with IMAGE_MAP_RAW).
+// image_free() releases only what the conversion allocated.
+int image_parse(image_t* img, unsigned char* bytes, size_t size, const char* path, int flags) {
+    memset(img, 0, sizeof(image_t));
+    return parse_image(img, bytes, size, path, flags & IMAGE_MAP_RAW) < 0 ? -1 : 0;
+}
+
+// Map a BMP, PGM or PBM file. BMP and PGM pixels are used in place in the
+// mapping, with no parsing or copying of the raster; PBM and palette BMPs are
+// converted into a heap image, or rejected with IMAGE_MAP_RAW. The mapping is
+// private (copy on write) unless IMAGE_MAP_SHARED is given, in which case
+// in-place kernels update the file.
+int image_map(image_t* img, const char* path, int flags) {
+    memset(img, 0, sizeof(image_t));
+    int shared = flags & IMAGE_MAP_SHARED;
+    int fd = open(path, shared ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        printf("Error: Cannot open input file %s\n", path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 3) {
+        printf("Error: Cannot read input file %s\n", path);
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    unsigned char* bytes = mmap(NULL, size, PROT_READ | PROT_WRITE, shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (bytes == MAP_FAILED) {
+        printf("Error: Cannot map input file %s\n", path);
+        return -1;
+    }
+    madvise(bytes, size, MADV_SEQUENTIAL);
+
+    int result = parse_image(img, bytes, size, path, flags & IMAGE_MAP_RAW);
+    if (result == 0) {
+        img->storage = STORAGE_MMAP;
+        img->base = bytes;
+        img->size = size;
+        return 0;
+    }
+    // Converted into a heap copy, or failed
+    munmap(bytes, size);
+    return result > 0 ? 0 : -1;
+}
+
+// Header of a BMP or PGM file of the given size into `header` (at most
+// IMAGE_HEADER_MAX bytes); rows are top-down. Returns the header length and
+// sets the row stride, or 0 if the format cannot hold the channels.
+#define IMAGE_HEADER_MAX (BMP_FILE_HEADER + BMP_INFO_HEADER + BMP_PALETTE)
+
+static size_t image_header(unsigned char* header, image_format_t format, int rows, int cols, int channels, size_t* stride) {
+    if (format == IMAGE_FORMAT_PGM && channels == 1) {
+        *stride = cols;
+        return snprintf((char*)header, IMAGE_HEADER_MAX, "P5\n%d %d\n255\n", cols, rows);
+    }
+    if (format != IMAGE_FORMAT_BMP || (channels != 1 && channels != 3)) return 0;
+    *stride = ((size_t)cols * channels + 3) & ~(size_t)3;
+    size_t length = BMP_FILE_HEADER + BMP_INFO_HEADER + (channels == 1 ? BMP_PALETTE : 0);
+    memset(header, 0, length);
+    header[0] = 'B';
+    header[1] = 'M';
+    write_u32(header + 2, length + *stride * rows);
+    write_u32(header + 10, length);
+    write_u32(header + 14, BMP_INFO_HEADER);
+    write_u32(header + 18, cols);
+    write_u32(header + 22, (uint32_t)-rows);     // negative height: top-down rows
+    write_u16(header + 26, 1);
+    write_u16(header + 28, channels * 8);
+    write_u32(header + 34, *stride * rows);
+    write_u32(header + 38, 2835);                // 72 dpi
+    write_u32(header + 42, 2835);
+    if (channels == 1) {
+        write_u32(header + 46, 256);
+        unsigned char* palette = header + BMP_FILE_HEADER + BMP_INFO_HEADER;
+        for (int i = 0; i < 256; i++) {
+            palette[4 * i] = palette[4 * i + 1] = palette[4 * i + 2] = i;
+        }
+    }
+    return length;
+}
+
+// Create a BMP or PGM file of the given size and map it, so kernels can write
+// their output straight into the file. The file is written top-down.
+int image_create_file(image_t* img, const char* path, image_format_t format, int rows, int cols, int channels) {
+    memset(img, 0, sizeof(image_t));
+    if (rows <= 0 || cols <= 0) return -1;
+
+    unsigned char header_bytes[IMAGE_HEADER_MAX];
+    size_t stride;
+    size_t header = image_header(header_bytes, format, rows, cols, channels, &stride);
+    if (!header) {
+        printf("Error: Cannot create %s, unsupported format or channel count\n", path);
+        return -1;
+    }
+    size_t size = header + stride * rows;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("Error: Cannot create output file %s\n", path);
+        return -1;
+    }
+    if (ftruncate(fd, size) != 0) {
+        printf("Error: Cannot resize output file %s\n", path);
+        close(fd);
+        return -1;
+    }
+    unsigned char* bytes = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (bytes == MAP_FAILED) {
+        printf("Error: Cannot map output file %s\n", path);
+        return -1;
+    }
+    memcpy(bytes, header_bytes, header);
+
+    img->rows = rows;
+    img->cols = cols;
+    img->channels = channels;
+    img->stride = stride;
+    img->data = bytes + header;
+    img->storage = STORAGE_MMAP;
+    img->base = bytes;
+    img->size = size;
+    return 0;
+}
+
+#define SAVE_ROWS 64     // rows gathered into one writev()
+
+// Write all of iov[0..count), resuming after short writes
+static int write_all(int fd, struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) return -1;
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+static int save_pbm(const image_t* img, int fd) {
+    char header[64];
+    struct iovec iov = {header, snprintf(header, sizeof(header), "P4\n%d %d\n", img->cols, img->rows)};
+    if (write_all(fd, &iov, 1)) return -1;
+    // Bits are packed into a stack chunk, flushed when full
+    unsigned char chunk[1 << 14];
+    size_t used = 0;
+    for (int i = 0; i < img->rows; i++) {
+        int x = img->bottom_up ? img->rows - 1 - i : i;
+        const unsigned char* src = img->data + x * img->stride;
+        for (int y = 0; y < img->cols; y += 8) {
+            unsigned char bits = 0;
+            for (int b = 0; b < 8 && y + b < img->cols; b++) {
+                if (!src[(y + b) * img->channels]) bits |= 0x80 >> b;
+            }
+            chunk[used++] = bits;
+            if (used == sizeof(chunk)) {
+                iov = (struct iovec){chunk, used};
+                if (write_all(fd, &iov, 1)) return -1;
+                used = 0;
+            }
+        }
+    }
+    iov = (struct iovec){chunk, used};
+    return write_all(fd, &iov, 1);
+}
+
+// Write an image, format chosen by the file extension. Rows are written in
+// display order, so a bottom-up BMP keeps its orientation in any format.
+// Rows go to the file with writev() straight from the image, so saving
+// allocates nothing.
+int image_save(const image_t* img, const char* path) {
+    image_format_t format = image_format_from_path(path);
+    unsigned char header[IMAGE_HEADER_MAX];
+    size_t stride = 0, header_size = 0;
+    if (format != IMAGE_FORMAT_PBM) {
+        header_size = image_header(header, format, img->rows, img->cols, img->channels, &stride);
+        if (!header_size) {
+            printf("Error: Cannot create %s, unsupported format or channel count\n", path);
+            return -1;
+        }
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("Error: Cannot create output file %s\n", path);
+        return -1;
+    }
+
+    int failed;
+    if (format == IMAGE_FORMAT_PBM) {
+        failed = save_pbm(img, fd);
+    } else {
+        static const unsigned char padding[4] = {0};
+        size_t bytes = (size_t)img->cols * img->channels;
+        struct iovec iov[2 * SAVE_ROWS + 1] = {{header, header_size}};
+        int count = 1;
+        failed = 0;
+        for (int i = 0; i < img->rows && !failed; i++) {
+            int x = img->bottom_up ? img->rows - 1 - i : i;
+            iov[count++] = (struct iovec){img->data + x * img->stride, bytes};
+            if (stride > bytes) iov[count++] = (struct iovec){(void*)padding, stride - bytes};
+            if (count > 2 * SAVE_ROWS - 1 || i == img->rows - 1) {
+                failed = write_all(fd, iov, count);
+                count = 0;
+            }
+        }
+    }
+    if (close(fd) != 0) failed = -1;
+    if (failed) printf("Error: Cannot write output file %s\n", path);
+    return failed ? -1 : 0;
+}
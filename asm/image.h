@@ -0,0 +1,51 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stddef.h>
+
+// Runtime-sized image. Row x starts at data + x * stride and holds `cols`
+// pixels of `channels` bytes, so a contiguous single channel image can be
+// handed to the erosion kernels as (width, height) = (rows, cols) via
+// IMAGE_PIXELS(). Rows are in storage order: files are mapped as they are laid
+// out on disk, and bottom_up records that a BMP stores its last row first.
+typedef struct {
+    int rows;
+    int cols;
+    int channels;
+    size_t stride;          // bytes between rows, at least cols * channels
+    unsigned char* data;    // first stored row
+    int bottom_up;
+
+    // Backing storage, released by image_free()
+    int storage;
+    void* base;
+    size_t size;
+} image_t;
+
+typedef enum {
+    IMAGE_FORMAT_UNKNOWN,
+    IMAGE_FORMAT_BMP,       // 8-bit grayscale or 24-bit BGR, uncompressed
+    IMAGE_FORMAT_PGM,       // binary P5, 8-bit
+    IMAGE_FORMAT_PBM        // binary P4, unpacked to 0/255 bytes on load
+} image_format_t;
+
+// image_alloc() flags
+#define IMAGE_HUGE_PAGES    1   // back the pixels with 2 MB pages if the system allows it
+
+// image_map() flags
+#define IMAGE_MAP_SHARED    1   // writes go straight to the file instead of a private copy
+#define IMAGE_MAP_RAW       2   // fail on PBM and palette BMP instead of converting them into a heap copy
+
+#define IMAGE_PIXELS(img) ((unsigned char (*)[(img)->cols])(img)->data)
+
+int image_alloc(image_t* img, int rows, int cols, int channels, int flags);
+int image_map(image_t* img, const char* path, int flags);
+int image_parse(image_t* img, unsigned char* bytes, size_t size, const char* path, int flags);
+int image_create_file(image_t* img, const char* path, image_format_t format, int rows, int cols, int channels);
+int image_save(const image_t* img, const char* path);
+int image_copy(image_t* dst, const image_t* src, int flags);
+int image_is_contiguous(const image_t* img);
+image_format_t image_format_from_path(const char* path);
+void image_free(image_t* img);
+
+#endif
@@ -0,0 +1,467 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "erode.h"
+#include "image.h"
+#include "sim.h"
+
+// Memory-access traces of the erosion, and a trace-driven simulator of
+// caches and row line buffers for sizing a faster CPUTop/DataMemory.
+//
+// Capture runs one image either through the C erode(), whose accesses are
+// reported by its trace hook (the input copied to a temporary image, every
+// tap of the cross read from it, the result stored back), or through an
+// assembled program on the simulator, recording every LOAD and STORE word
+// address. Simulation reads the trace and reports, for every configuration,
+// the load hit rate and the stall cycles against a memory without any cache.
+//
+// Build: gcc -O2 -pthread -DERODE_NO_MAIN -DERODE_TRACE -DSIM_NO_MAIN -o memtrace asm/memtrace.c asm/sim.c asm/erode*.c asm/image.c
+
+#ifndef ERODE_TRACE
+#error "erode() reports its accesses only when built with -DERODE_TRACE"
+#endif
+
+// Trace file: this header (host byte order), then one record per access in
+// program order: the varint of (zigzag(address - previous) << 1 | store),
+// where previous is the address of the last access of the same kind. Loads
+// and stores each walk their own image, so most records are one byte.
+#define TRACE_MAGIC "EMT1"
+
+typedef struct {
+    char magic[4];
+    uint32_t unit;          // bytes per address: 1 for the C kernel, 4 for DataMemory words
+    uint32_t rows;
+    uint32_t cols;
+    uint64_t source;        // address of pixel [0][0] of the image the neighbourhoods are read from
+    uint64_t row_length;    // addresses from one row of that image to the next
+    uint64_t count;         // records
+} trace_header_t;
+
+typedef struct {
+    FILE* file;
+    trace_header_t header;
+    uint64_t previous[2];       // last load and store address
+    size_t used;
+    unsigned char buffer[1 << 16];
+} trace_writer_t;
+
+static void trace_flush(trace_writer_t* trace) {
+    fwrite(trace->buffer, 1, trace->used, trace->file);
+    trace->used = 0;
+}
+
+static void trace_access(trace_writer_t* trace, uint64_t address, int store) {
+    if (trace->used > sizeof(trace->buffer) - 10) trace_flush(trace);
+    store = store != 0;
+    int64_t delta = (int64_t)(address - trace->previous[store]);
+    uint64_t value = ((((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63)) << 1) | store;
+    while (value >= 0x80) {
+        trace->buffer[trace->used++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    trace->buffer[trace->used++] = (unsigned char)value;
+    trace->previous[store] = address;
+    trace->header.count++;
+}
+
+static void sim_access(void* context, uint32_t address, int store) {
+    trace_access(context, address, store);
+}
+
+static void erode_access(void* context, erode_trace_image_t image, size_t offset, int store) {
+    trace_writer_t* trace = context;
+    trace_access(trace, (image == ERODE_TRACE_TEMP ? trace->header.source : 0) + offset, store);
+}
+
+// Run erode() itself with its access hook recording every pixel load and
+// store: the image at address 0, the temporary copy after it on the next
+// 64-byte boundary
+static void trace_erode(trace_writer_t* trace, int width, int height, unsigned char binary_image[width][height]) {
+    trace->header.source = ((uint64_t)width * height + 63) & ~(uint64_t)63;
+    erode_trace_context = trace;
+    erode_trace_hook = erode_access;
+    erode(width, height, 0, binary_image, NULL);
+    erode_trace_hook = NULL;
+    erode_trace_context = NULL;
+}
+
+// Read an input image as rows * cols bytes, or generate a cell image
+static unsigned char* load_pixels(const char* path, int* rows, int* cols) {
+    if (!path) {
+        unsigned char* pixels = malloc((size_t)*rows * *cols);
+        if (pixels) fill_cells(*rows, *cols, (unsigned char (*)[*cols])pixels, 1 + *rows * *cols / 2250, 1);
+        return pixels;
+    }
+    image_t img;
+    if (image_map(&img, path, 0)) return NULL;
+    unsigned char* pixels = NULL;
+    if (img.channels != 1) {
+        printf("Error: %s is not a grayscale image\n", path);
+    } else if ((pixels = malloc((size_t)img.rows * img.cols))) {
+        for (int x = 0; x < img.rows; x++) memcpy(pixels + (size_t)x * img.cols, img.data + x * img.stride, img.cols);
+        *rows = img.rows;
+        *cols = img.cols;
+    }
+    image_free(&img);
+    return pixels;
+}
+
+static int capture(const char* output_file, const char* program_file, const char* image_file, int rows, int cols) {
+    unsigned char* pixels = load_pixels(image_file, &rows, &cols);
+    if (!pixels) return 1;
+    size_t size = (size_t)rows * cols;
+    unsigned char* expected = malloc(size);
+    trace_writer_t* trace = calloc(1, sizeof(trace_writer_t));
+    if (!expected || !trace) {
+        free(pixels);
+        free(expected);
+        free(trace);
+        return 1;
+    }
+    memcpy(expected, pixels, size);
+    erode(rows, cols, 0, (unsigned char (*)[cols])expected, NULL);
+
+    int result = 1;
+    int regular = 0;
+    trace->file = fopen(output_file, "wb");
+    if (!trace->file) {
+        printf("Error: Cannot create output file %s\n", output_file);
+        goto done;
+    }
+    // Only a regular file is removed again on errors, never e.g. /dev/null
+    struct stat output_stat;
+    regular = fstat(fileno(trace->file), &output_stat) == 0 && S_ISREG(output_stat.st_mode);
+    memcpy(trace->header.magic, TRACE_MAGIC, 4);
+    trace->header.rows = rows;
+    trace->header.cols = cols;
+    trace->header.row_length = cols;
+    fwrite(&trace->header, sizeof(trace_header_t), 1, trace->file);
+
+    int matches = 1;
+    if (program_file) {
+        // The memory layout of sim.c: pixels from word 0, the output after them
+        sim_program_t program;
+        int output = sim_output_offset((int)(size < SIM_MEMORY_WORDS ? size : SIM_MEMORY_WORDS));
+        if (output + size > SIM_MEMORY_WORDS) {
+            printf("Error: %dx%d image does not fit in data memory\n", rows, cols);
+            goto done;
+        }
+        if (sim_load(&program, program_file)) goto done;
+        uint32_t* memory = calloc(SIM_MEMORY_WORDS, sizeof(uint32_t));
+        if (!memory) {
+            printf("Error: Cannot allocate data memory\n");
+            sim_free(&program);
+            goto done;
+        }
+        sim_result_t run;
+        for (size_t i = 0; i < size; i++) memory[i] = pixels[i];
+        trace->header.unit = 4;
+        if (sim_run_traced(&program, memory, 0, &run, sim_access, trace)) {
+            printf("Error: Cannot allocate the traced copy of %s\n", program_file);
+            free(memory);
+            sim_free(&program);
+            goto done;
+        }
+        for (size_t i = 0; i < size; i++) matches &= (memory[output + i] != 0) == (expected[i] != 0);
+        printf("%s: %llu cycles%s\n", program_file, (unsigned long long)run.cycles, run.halted ? "" : ", did not halt");
+        free(memory);
+        sim_free(&program);
+    } else {
+        trace->header.unit = 1;
+        trace_erode(trace, rows, cols, (unsigned char (*)[cols])pixels);
+        matches = memcmp(pixels, expected, size) == 0;
+    }
+    trace_flush(trace);
+
+    // The count is known now
+    long bytes = ftell(trace->file);
+    fseek(trace->file, 0, SEEK_SET);
+    fwrite(&trace->header, sizeof(trace_header_t), 1, trace->file);
+    int failed = ferror(trace->file);
+    failed |= fclose(trace->file) != 0;
+    trace->file = NULL;
+    if (failed) {
+        printf("Error: Cannot write output file %s\n", output_file);
+        if (regular) remove(output_file);
+        goto done;
+    }
+    printf("%dx%d image, %llu accesses in %ld bytes (%.2f bytes per access), output %s erode()\n", cols, rows,
+           (unsigned long long)trace->header.count, bytes,
+           trace->header.count ? (double)(bytes - sizeof(trace_header_t)) / trace->header.count : 0.0,
+           matches ? "matches" : "differs from");
+    result = matches ? 0 : 1;
+
+done:
+    // Still open here only on errors: do not leave a partial trace behind
+    if (trace->file) {
+        fclose(trace->file);
+        if (regular) remove(output_file);
+    }
+    free(trace);
+    free(pixels);
+    free(expected);
+    return result;
+}
+
+// Set-associative cache with LRU replacement. Loads allocate; stores are
+// written through and posted without allocating, so only loads stall.
+typedef struct {
+    size_t size;            // bytes
+    int line;               // bytes
+    int ways;
+    size_t sets;
+    uint64_t* tags;         // sets * ways, line number + 1, 0 = empty
+    uint64_t* used;         // last access of each way
+    uint64_t clock;
+    uint64_t load_hits;
+    uint64_t load_misses;
+} cache_t;
+
+// Line buffer of the last `rows` rows of the source image: a load from a
+// buffered row hits, any other row of the source image is read in as a
+// burst and replaces the oldest one. Loads outside the source go to memory.
+typedef struct {
+    int rows;
+    int64_t* held;          // buffered row numbers, -1 = empty
+    int oldest;
+    uint64_t load_hits;
+    uint64_t row_fills;
+    uint64_t other_loads;
+} line_buffer_t;
+
+static int cache_init(cache_t* cache, size_t size, int line, int ways) {
+    memset(cache, 0, sizeof(*cache));
+    if (line <= 0 || ways <= 0 || size < (size_t)line * ways || size % ((size_t)line * ways)) return -1;
+    cache->size = size;
+    cache->line = line;
+    cache->ways = ways;
+    cache->sets = size / ((size_t)line * ways);
+    cache->tags = calloc(cache->sets * ways, sizeof(uint64_t));
+    cache->used = calloc(cache->sets * ways, sizeof(uint64_t));
+    return cache->tags && cache->used ? 0 : -1;
+}
+
+static void cache_access(cache_t* cache, uint64_t byte_address, int store) {
+    uint64_t tag = byte_address / cache->line + 1;
+    size_t set = (size_t)(tag % cache->sets) * cache->ways;
+    uint64_t* tags = cache->tags + set;
+    uint64_t* used = cache->used + set;
+    cache->clock++;
+    int victim = 0;
+    for (int way = 0; way < cache->ways; way++) {
+        if (tags[way] == tag) {
+            used[way] = cache->clock;
+            cache->load_hits += !store;
+            return;
+        }
+        if (used[way] < used[victim]) victim = way;
+    }
+    if (store) return;
+    cache->load_misses++;
+    tags[victim] = tag;
+    used[victim] = cache->clock;
+}
+
+static void line_buffer_access(line_buffer_t* buffer, const trace_header_t* header, uint64_t address, int store) {
+    if (store) return;
+    uint64_t end = header->source + (uint64_t)header->rows * header->row_length;
+    if (address < header->source || address >= end) {
+        buffer->other_loads++;
+        return;
+    }
+    int64_t row = (int64_t)((address - header->source) / header->row_length);
+    for (int i = 0; i < buffer->rows; i++) {
+        if (buffer->held[i] == row) {
+            buffer->load_hits++;
+            return;
+        }
+    }
+    buffer->row_fills++;
+    buffer->held[buffer->oldest] = row;
+    buffer->oldest = (buffer->oldest + 1) % buffer->rows;
+}
+
+// Cycles to read `bytes` from memory: the latency, then a word per cycle
+static uint64_t fill_cycles(int penalty, uint64_t bytes) {
+    uint64_t words = (bytes + 3) / 4;
+    return penalty + (words > 1 ? words - 1 : 0);
+}
+
+static void report(const char* model, uint64_t loads, uint64_t stores, uint64_t hits, uint64_t stalls, int penalty) {
+    uint64_t baseline = loads * penalty;
+    printf("%s,%llu,%llu,%llu,%.4f,%llu,%llu,%lld\n", model, (unsigned long long)loads, (unsigned long long)stores,
+           (unsigned long long)hits, loads ? (double)hits / loads : 0.0, (unsigned long long)stalls,
+           (unsigned long long)baseline, (long long)(baseline - stalls));
+}
+
+static int simulate(const char* input_file, cache_t* caches, int cache_count, line_buffer_t* buffers, int buffer_count,
+                    int penalty) {
+    int fd = open(input_file, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(trace_header_t)) {
+        printf("Error: Cannot read trace %s\n", input_file);
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    size_t size = st.st_size;
+    const unsigned char* bytes = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (bytes == MAP_FAILED) {
+        printf("Error: Cannot map trace %s\n", input_file);
+        return 1;
+    }
+    madvise((void*)bytes, size, MADV_SEQUENTIAL);
+    trace_header_t header;
+    memcpy(&header, bytes, sizeof(header));
+    if (memcmp(header.magic, TRACE_MAGIC, 4) != 0 || header.unit == 0 || header.row_length == 0) {
+        printf("Error: %s is not a memory trace\n", input_file);
+        munmap((void*)bytes, size);
+        return 1;
+    }
+
+    uint64_t loads = 0, stores = 0, count = 0;
+    uint64_t previous[2] = {0, 0};
+    size_t pos = sizeof(header);
+    while (pos < size && count < header.count) {
+        uint64_t value = 0;
+        int shift = 0;
+        while (pos < size && bytes[pos] & 0x80) {
+            value |= (uint64_t)(bytes[pos++] & 0x7F) << shift;
+            shift += 7;
+        }
+        if (pos == size) break;
+        value |= (uint64_t)bytes[pos++] << shift;
+        int store = value & 1;
+        uint64_t zigzag = value >> 1;
+        uint64_t address = previous[store] + (uint64_t)((int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1));
+        previous[store] = address;
+        count++;
+        loads += !store;
+        stores += store;
+        for (int i = 0; i < cache_count; i++) cache_access(&caches[i], address * header.unit, store);
+        for (int i = 0; i < buffer_count; i++) line_buffer_access(&buffers[i], &header, address, store);
+    }
+    munmap((void*)bytes, size);
+    if (count != header.count) {
+        printf("Error: Trace %s is truncated\n", input_file);
+        return 1;
+    }
+
+    fprintf(stderr, "%s: %ux%u image, %s addresses, %llu loads, %llu stores, miss penalty %d cycles\n", input_file,
+            header.cols, header.rows, header.unit == 1 ? "byte" : "word", (unsigned long long)loads,
+            (unsigned long long)stores, penalty);
+    printf("model,loads,stores,load_hits,hit_rate,stall_cycles,uncached_stall_cycles,saved_cycles\n");
+    char model[64];
+    for (int i = 0; i < cache_count; i++) {
+        cache_t* cache = &caches[i];
+        snprintf(model, sizeof(model), "cache %zuB/%dB/%d-way", cache->size, cache->line, cache->ways);
+        report(model, loads, stores, cache->load_hits, cache->load_misses * fill_cycles(penalty, cache->line), penalty);
+    }
+    for (int i = 0; i < buffer_count; i++) {
+        line_buffer_t* buffer = &buffers[i];
+        uint64_t row_bytes = header.row_length * header.unit;
+        snprintf(model, sizeof(model), "line buffer %d rows", buffer->rows);
+        // Loads served by a row fill count as misses, not hits
+        report(model, loads, stores, buffer->load_hits,
+               buffer->row_fills * fill_cycles(penalty, row_bytes) + buffer->other_loads * penalty, penalty);
+    }
+    return 0;
+}
+
+static void usage(const char* name) {
+    printf("Usage: %s [--program program.bin] [--size RxC | --image image.bmp|pgm|pbm] <output.trace>\n", name);
+    printf("       %s --simulate [--cache SIZE:LINE:WAYS ...] [--line-buffer ROWS ...] [--miss-penalty N] <input.trace>\n", name);
+    printf("  --program FILE      trace the LOAD/STORE word addresses of an assembled program (default: erode())\n");
+    printf("  --size RxC          size of the generated cell image (default 20x20)\n");
+    printf("  --cache S:L:W       S-byte cache of L-byte lines and W ways, repeatable\n");
+    printf("  --line-buffer N     line buffer of N image rows, repeatable\n");
+    printf("  --miss-penalty N    cycles before the first word arrives from memory (default 10)\n");
+    printf("Without --cache or --line-buffer, a range of caches and 2 to 4 row buffers is simulated.\n");
+}
+
+int main(int argc, char* argv[]) {
+    const char* program_file = NULL;
+    const char* image_file = NULL;
+    const char* file = NULL;
+    int rows = 20, cols = 20, penalty = 10, simulating = 0;
+    cache_t caches[32];
+    line_buffer_t buffers[32];
+    int cache_count = 0, buffer_count = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--simulate") == 0) {
+            simulating = 1;
+            continue;
+        }
+        if (strncmp(argv[i], "--", 2) != 0) {
+            file = argv[i];
+            continue;
+        }
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!value) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (strcmp(argv[i], "--program") == 0) program_file = value;
+        else if (strcmp(argv[i], "--image") == 0) image_file = value;
+        else if (strcmp(argv[i], "--miss-penalty") == 0) penalty = atoi(value);
+        else if (strcmp(argv[i], "--size") == 0) {
+            if (sscanf(value, "%dx%d", &rows, &cols) != 2 || rows <= 0 || cols <= 0) {
+                printf("Error: Invalid image size %s\n", value);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--cache") == 0) {
+            size_t size;
+            int line, ways;
+            if (cache_count == 32 || sscanf(value, "%zu:%d:%d", &size, &line, &ways) != 3 ||
+                cache_init(&caches[cache_count], size, line, ways)) {
+                printf("Error: Invalid cache %s\n", value);
+                return 1;
+            }
+            cache_count++;
+        } else if (strcmp(argv[i], "--line-buffer") == 0) {
+            int held = atoi(value);
+            if (buffer_count == 32 || held <= 0) {
+                printf("Error: Invalid line buffer %s\n", value);
+                return 1;
+            }
+            buffers[buffer_count].rows = held;
+            buffer_count++;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+        i++;
+    }
+    if (!file || penalty < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!simulating) return capture(file, program_file, image_file, rows, cols);
+
+    if (cache_count == 0 && buffer_count == 0) {
+        for (size_t size = 256; size <= 65536; size *= 4) {
+            if (cache_init(&caches[cache_count++], size, 64, 4)) return 1;
+        }
+        for (int held = 2; held <= 4; held++) buffers[buffer_count++].rows = held;
+    }
+    for (int i = 0; i < buffer_count; i++) {
+        int held = buffers[i].rows;
+        memset(&buffers[i], 0, sizeof(line_buffer_t));
+        buffers[i].rows = held;
+        buffers[i].held = malloc(held * sizeof(int64_t));
+        if (!buffers[i].held) return 1;
+        for (int j = 0; j < held; j++) buffers[i].held[j] = -1;
+    }
+    int result = simulate(file, caches, cache_count, buffers, buffer_count, penalty);
+    for (int i = 0; i < cache_count; i++) {
+        free(caches[i].tags);
+        free(caches[i].used);
+    }
+    for (int i = 0; i < buffer_count; i++) free(buffers[i].held);
+    return result;
+}
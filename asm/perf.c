@@ -0,0 +1,148 @@
+#include <linux/perf_event.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "perf.h"
+
+const char* const perf_counter_names[PERF_COUNTER_COUNT] = {
+    "cycles", "instructions", "branch_misses", "l1d_misses", "llc_misses", "task_clock_ns"
+};
+
+perf_session_t* perf_erode_session;
+
+#define CACHE_READ_MISS(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} counter_events[PERF_COUNTER_COUNT] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    {PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_LL)},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+};
+
+static int open_counter(perf_counter_t counter, int group) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counter_events[counter].type;
+    attr.config = counter_events[counter].config;
+    attr.disabled = group < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    if (counter != PERF_TASK_CLOCK) attr.read_format |= PERF_FORMAT_GROUP;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+int perf_open(perf_session_t* session, int regions) {
+    memset(session, 0, sizeof(*session));
+    session->group = session->clock = -1;
+    for (int c = 0; c < PERF_TASK_CLOCK; c++) session->hardware[c] = session->fds[c] = -1;
+    session->regions = calloc(regions, sizeof(perf_region_t));
+    if (!session->regions) return -1;
+    session->region_count = regions;
+
+    // The hardware counters form one group, so they count over exactly the
+    // same instructions; the first one that opens leads it
+    for (int c = 0; c < PERF_TASK_CLOCK; c++) {
+        int fd = session->fds[c] = open_counter(c, session->group);
+        if (fd < 0) continue;
+        if (session->group < 0) session->group = fd;
+        session->hardware[c] = session->hardware_count++;
+    }
+    session->clock = open_counter(PERF_TASK_CLOCK, -1);
+
+    if (session->group >= 0) ioctl(session->group, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    if (session->clock >= 0) ioctl(session->clock, PERF_EVENT_IOC_ENABLE, 0);
+    return session->group < 0 && session->clock < 0 ? -1 : 0;
+}
+
+void perf_close(perf_session_t* session) {
+    for (int c = 0; c < PERF_TASK_CLOCK; c++) {
+        if (session->hardware[c] >= 0) close(session->fds[c]);
+    }
+    if (session->clock >= 0) close(session->clock);
+    free(session->regions);
+    session->regions = NULL;
+    session->group = session->clock = -1;
+    for (int c = 0; c < PERF_TASK_CLOCK; c++) session->hardware[c] = session->fds[c] = -1;
+}
+
+int perf_available(const perf_session_t* session, perf_counter_t counter) {
+    if (counter == PERF_TASK_CLOCK) return session->clock >= 0;
+    return session->hardware[counter] >= 0;
+}
+
+// Raw counts in counter order, then the group's enabled and running times
+static void read_counters(const perf_session_t* session, uint64_t raw[PERF_COUNTER_COUNT + 2]) {
+    memset(raw, 0, (PERF_COUNTER_COUNT + 2) * sizeof(uint64_t));
+    if (session->group >= 0) {
+        uint64_t data[3 + PERF_TASK_CLOCK];     // nr, time enabled, time running, values
+        if (read(session->group, data, sizeof(data)) > 0) {
+            for (int c = 0; c < PERF_TASK_CLOCK; c++) {
+                if (session->hardware[c] >= 0) raw[c] = data[3 + session->hardware[c]];
+            }
+            raw[PERF_COUNTER_COUNT] = data[1];
+            raw[PERF_COUNTER_COUNT + 1] = data[2];
+        }
+    }
+    if (session->clock >= 0) {
+        uint64_t data[3];
+        if (read(session->clock, data, sizeof(data)) > 0) raw[PERF_TASK_CLOCK] = data[0];
+    }
+}
+
+void perf_begin(perf_session_t* session, int region) {
+    read_counters(session, session->regions[region].start);
+}
+
+void perf_end(perf_session_t* session, int region) {
+    uint64_t now[PERF_COUNTER_COUNT + 2];
+    read_counters(session, now);
+    perf_region_t* r = &session->regions[region];
+    uint64_t enabled = now[PERF_COUNTER_COUNT] - r->start[PERF_COUNTER_COUNT];
+    uint64_t running = now[PERF_COUNTER_COUNT + 1] - r->start[PERF_COUNTER_COUNT + 1];
+    // Scale up if the kernel multiplexed the group with other events
+    double scale = running > 0 ? (double)enabled / running : 1.0;
+    for (int c = 0; c < PERF_TASK_CLOCK; c++) r->values[c] += (now[c] - r->start[c]) * scale;
+    r->values[PERF_TASK_CLOCK] += now[PERF_TASK_CLOCK] - r->start[PERF_TASK_CLOCK];
+    r->calls++;
+}
+
+void perf_reset(perf_session_t* session) {
+    for (int i = 0; i < session->region_count; i++) {
+        session->regions[i].calls = 0;
+        memset(session->regions[i].values, 0, sizeof(session->regions[i].values));
+    }
+}
+
+void perf_write_csv_header(FILE* file, const char* prefix_columns) {
+    fprintf(file, "%s,region,calls", prefix_columns);
+    for (int c = 0; c < PERF_COUNTER_COUNT; c++) fprintf(file, ",%s", perf_counter_names[c]);
+    fprintf(file, ",ipc\n");
+}
+
+void perf_write_csv(const perf_session_t* session, FILE* file, const char* prefix, const char* const region_names[]) {
+    for (int i = 0; i < session->region_count; i++) {
+        const perf_region_t* r = &session->regions[i];
+        if (r->calls == 0) continue;
+        fprintf(file, "%s,%s,%llu", prefix, region_names[i], (unsigned long long)r->calls);
+        for (int c = 0; c < PERF_COUNTER_COUNT; c++) {
+            if (perf_available(session, c)) fprintf(file, ",%.0f", r->values[c] / r->calls);
+            else fprintf(file, ",");
+        }
+        if (perf_available(session, PERF_CYCLES) && perf_available(session, PERF_INSTRUCTIONS) &&
+            r->values[PERF_CYCLES] > 0) {
+            fprintf(file, ",%.3f\n", r->values[PERF_INSTRUCTIONS] / r->values[PERF_CYCLES]);
+        } else {
+            fprintf(file, ",\n");
+        }
+    }
+}
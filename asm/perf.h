@@ -0,0 +1,86 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Hardware performance counters per code region, read with perf_event_open.
+// The counters count this thread in user space only. Counters the machine or
+// the kernel settings (perf_event_paranoid) do not allow are reported as
+// unavailable; the task clock is a software counter and works everywhere.
+
+typedef enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_BRANCH_MISSES,
+    PERF_L1D_MISSES,        // L1 data cache read misses
+    PERF_LLC_MISSES,        // last level cache read misses
+    PERF_TASK_CLOCK,        // ns on the CPU
+    PERF_COUNTER_COUNT
+} perf_counter_t;
+
+// Regions of erode(), counted when it is built with -DERODE_PERF
+typedef enum {
+    PERF_ERODE_COPY,        // copy into temp_image
+    PERF_ERODE_INTERIOR,    // neighbour checks of the interior pixels
+    PERF_ERODE_BORDER,      // clearing the border rows and columns
+    PERF_ERODE_REGIONS
+} perf_erode_region_t;
+
+typedef struct {
+    uint64_t calls;
+    double values[PERF_COUNTER_COUNT];      // summed over calls, scaled if the counters were multiplexed
+    uint64_t start[PERF_COUNTER_COUNT + 2]; // raw counts and enabled/running times at perf_begin()
+} perf_region_t;
+
+typedef struct {
+    int group;              // hardware counters, read together
+    int clock;              // task clock
+    int fds[PERF_TASK_CLOCK];       // hardware counter descriptors, -1 if unavailable
+    int hardware[PERF_TASK_CLOCK];  // position in the group read, -1 if unavailable
+    int hardware_count;
+    int region_count;
+    perf_region_t* regions;
+} perf_session_t;
+
+extern const char* const perf_counter_names[PERF_COUNTER_COUNT];
+
+int perf_open(perf_session_t* session, int regions);
+void perf_close(perf_session_t* session);
+int perf_available(const perf_session_t* session, perf_counter_t counter);
+void perf_begin(perf_session_t* session, int region);
+void perf_end(perf_session_t* session, int region);
+void perf_reset(perf_session_t* session);
+
+// Writes the header, or one row per region with calls, the counters (empty
+// if unavailable) and the IPC, each line starting with `prefix`
+void perf_write_csv_header(FILE* file, const char* prefix_columns);
+void perf_write_csv(const perf_session_t* session, FILE* file, const char* prefix, const char* const region_names[]);
+
+// Session erode() reports to; no counting while NULL
+extern perf_session_t* perf_erode_session;
+
+// Counts the rest of the enclosing block as `region` of perf_erode_session
+typedef struct {
+    perf_session_t* session;
+    int region;
+} perf_scope_t;
+
+static inline perf_scope_t perf_scope_begin(perf_session_t* session, int region) {
+    if (session) perf_begin(session, region);
+    return (perf_scope_t){session, region};
+}
+
+static inline void perf_scope_end(perf_scope_t* scope) {
+    if (scope->session) perf_end(scope->session, scope->region);
+}
+
+#ifdef ERODE_PERF
+#define PERF_SCOPE(region) \
+    perf_scope_t perf_scope_##region __attribute__((cleanup(perf_scope_end))) = \
+        perf_scope_begin(perf_erode_session, region)
+#else
+#define PERF_SCOPE(region)
+#endif
+
+#endif
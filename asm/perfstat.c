@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "erode.h"
+#include "image.h"
+#include "perf.h"
+
+// Hardware counter profile of the erosion kernels. Every kernel is run on
+// every pattern and size, and cycles, instructions, branch misses, L1D and
+// LLC read misses, the task clock and the IPC are reported per call as CSV:
+// for the whole call of each kernel, and for the copy, interior and border
+// phases of erode(). Only the calling thread is counted, so the parallel
+// kernel is left out.
+//
+// Build: gcc -O2 -pthread -DERODE_NO_MAIN -DERODE_PERF -o perfstat asm/perfstat.c asm/perf.c asm/erode*.c asm/image.c
+
+#define DEFAULT_REPS    10
+#define REGION_TOTAL    PERF_ERODE_REGIONS
+#define REGION_COUNT    (PERF_ERODE_REGIONS + 1)
+
+static const char* const region_names[REGION_COUNT] = {"copy", "interior", "border", "total"};
+
+static const int default_sizes[] = {5, 10, 15, 20, 64, 256, 950, 2048, 4096};
+
+typedef struct {
+    int width;
+    int height;
+    image_t input;
+    image_t work;
+    packed_image_t packed_src;
+    packed_image_t packed_dst;
+} perf_ctx_t;
+
+typedef struct {
+    const char* name;
+    void (*run)(perf_ctx_t* ctx);
+} perf_kernel_t;
+
+static void run_reference(perf_ctx_t* ctx) {
+    erode(ctx->width, ctx->height, 0, IMAGE_PIXELS(&ctx->work), NULL);
+}
+
+static void run_packed(perf_ctx_t* ctx) {
+    erode_packed(&ctx->packed_src, &ctx->packed_dst);
+}
+
+static void run_simd(perf_ctx_t* ctx) {
+    erode_simd(ctx->width, ctx->height, IMAGE_PIXELS(&ctx->input), IMAGE_PIXELS(&ctx->work));
+}
+
+static void run_inplace(perf_ctx_t* ctx) {
+    erode_inplace(ctx->width, ctx->height, IMAGE_PIXELS(&ctx->work));
+}
+
+static const perf_kernel_t kernels[] = {
+    {"reference", run_reference},
+    {"packed", run_packed},
+    {"simd", run_simd},
+    {"inplace", run_inplace},
+};
+
+// The patterns of the benchmark in RDTSC.c
+static const char* patterns[] = {"black", "white", "cells"};
+
+static void fill_pattern(int pattern, int width, int height, unsigned char binary_image[width][height]) {
+    if (pattern == 2) fill_cells(width, height, binary_image, width * height / 2250 + 1, 1);
+    else memset(binary_image, pattern ? 255 : 0, (size_t)width * height);
+}
+
+static int in_list(const char* list, const char* name) {
+    if (!list) return 1;
+    size_t length = strlen(name);
+    for (const char* p = list; (p = strstr(p, name)) != NULL; p += length) {
+        if ((p == list || p[-1] == ',') && (p[length] == ',' || p[length] == '\0')) return 1;
+    }
+    return 0;
+}
+
+static void usage(const char* prog) {
+    printf("Usage: %s [options]\n", prog);
+    printf("  --min <n>         smallest image size (default 5)\n");
+    printf("  --max <n>         largest image size (default 4096)\n");
+    printf("  --kernels <list>  comma separated: reference,packed,simd,inplace\n");
+    printf("  --patterns <list> comma separated: black,white,cells\n");
+    printf("  --reps <n>        counted runs per kernel, pattern and size (default %d)\n", DEFAULT_REPS);
+    printf("  --csv <file>      write results to file instead of stdout\n");
+}
+
+int main(int argc, char* argv[]) {
+    int min_size = 5, max_size = 4096, reps = DEFAULT_REPS;
+    const char* kernel_list = NULL;
+    const char* pattern_list = NULL;
+    const char* csv_file = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!value) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (strcmp(argv[i], "--min") == 0) min_size = atoi(value);
+        else if (strcmp(argv[i], "--max") == 0) max_size = atoi(value);
+        else if (strcmp(argv[i], "--reps") == 0) reps = atoi(value);
+        else if (strcmp(argv[i], "--kernels") == 0) kernel_list = value;
+        else if (strcmp(argv[i], "--patterns") == 0) pattern_list = value;
+        else if (strcmp(argv[i], "--csv") == 0) csv_file = value;
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+        i++;
+    }
+    if (reps < 1) reps = 1;
+
+    perf_session_t session;
+    if (perf_open(&session, REGION_COUNT)) {
+        printf("Error: Cannot open any performance counter (see /proc/sys/kernel/perf_event_paranoid)\n");
+        return 1;
+    }
+    fprintf(stderr, "Counters:");
+    for (int c = 0; c < PERF_COUNTER_COUNT; c++) {
+        fprintf(stderr, " %s%s", perf_counter_names[c], perf_available(&session, c) ? "" : " (unavailable)");
+    }
+    fprintf(stderr, "\n");
+
+    FILE* csv = csv_file ? fopen(csv_file, "w") : stdout;
+    if (!csv) {
+        printf("Error: Cannot create output file %s\n", csv_file);
+        return 1;
+    }
+    perf_write_csv_header(csv, "kernel,pattern,width,height");
+
+    perf_ctx_t ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    for (size_t s = 0; s < sizeof(default_sizes) / sizeof(default_sizes[0]); s++) {
+        int size = default_sizes[s];
+        if (size < min_size || size > max_size) continue;
+        ctx.width = ctx.height = size;
+        if (image_alloc(&ctx.input, size, size, 1, IMAGE_HUGE_PAGES) ||
+            image_alloc(&ctx.work, size, size, 1, IMAGE_HUGE_PAGES) ||
+            packed_image_alloc(&ctx.packed_src, size, size) || packed_image_alloc(&ctx.packed_dst, size, size)) {
+            printf("Error: Cannot allocate %dx%d images\n", size, size);
+            return 1;
+        }
+
+        for (int p = 0; p < (int)(sizeof(patterns) / sizeof(patterns[0])); p++) {
+            if (!in_list(pattern_list, patterns[p])) continue;
+            fill_pattern(p, size, size, IMAGE_PIXELS(&ctx.input));
+            pack_image(size, size, IMAGE_PIXELS(&ctx.input), &ctx.packed_src);
+
+            for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+                if (!in_list(kernel_list, kernels[k].name)) continue;
+                // One uncounted run to warm the caches and fault the pages in
+                memcpy(ctx.work.data, ctx.input.data, (size_t)size * size);
+                kernels[k].run(&ctx);
+
+                perf_reset(&session);
+                perf_erode_session = &session;
+                for (int r = 0; r < reps; r++) {
+                    memcpy(ctx.work.data, ctx.input.data, (size_t)size * size);
+                    perf_begin(&session, REGION_TOTAL);
+                    kernels[k].run(&ctx);
+                    perf_end(&session, REGION_TOTAL);
+                }
+                perf_erode_session = NULL;
+
+                char prefix[128];
+                snprintf(prefix, sizeof(prefix), "%s,%s,%d,%d", kernels[k].name, patterns[p], size, size);
+                perf_write_csv(&session, csv, prefix, region_names);
+                fflush(csv);
+            }
+        }
+
+        image_free(&ctx.input);
+        image_free(&ctx.work);
+        packed_image_free(&ctx.packed_src);
+        packed_image_free(&ctx.packed_dst);
+    }
+
+    perf_close(&session);
+    if (csv != stdout) fclose(csv);
+    return 0;
+}
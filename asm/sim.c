@@ -0,0 +1,474 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "erode.h"
+#include "image.h"
+#include "sim.h"
+
+// Instruction-set simulator for CPUTop. The program is decoded once into
+// threaded code: each instruction holds the address of its handler, and every
+// handler ends by jumping straight to the next instruction's handler.
+//
+// Semantics follow the RTL exactly:
+// - LOAD/STORE address memory at (rs + sign-extended immediate) & 0xFFFF,
+//   STORE writes rt, LOAD/ADDI/SUBI write rt
+// - BEQ/BGE compare rs with rt (BGE signed) and branch to the absolute
+//   address in the immediate, JUMP likewise
+// - register 0 reads as zero and ignores writes, other indices wrap to 8 registers
+// - opcodes ControlUnit does not decode are no-ops, words past the end of the
+//   program are zero, i.e. END
+// - one instruction per clock cycle, counted the way CPUTopTester counts them
+//
+// Build: gcc -O2 -pthread -DERODE_NO_MAIN -o sim asm/sim.c asm/erode*.c asm/image.c
+
+// Register slots: the 8 registers, a constant zero read for $r0, and a sink
+// for writes to $r0, so no handler has to test for register 0
+#define SLOT_ZERO       SIM_REGISTERS
+#define SLOT_SINK       (SIM_REGISTERS + 1)
+#define SLOT_COUNT      (SIM_REGISTERS + 2)
+
+enum {
+    HANDLER_END,
+    HANDLER_NOP,
+    HANDLER_LOAD,
+    HANDLER_STORE,
+    HANDLER_ADDI,
+    HANDLER_BEQ,
+    HANDLER_BGE,
+    HANDLER_JUMP,
+    HANDLER_WRAP,
+    HANDLER_LOAD_TRACED,
+    HANDLER_STORE_TRACED,
+    HANDLER_COUNT
+};
+
+struct sim_insn {
+    const void* handler;
+    uint8_t rs;             // read slot
+    uint8_t rt;             // read slot
+    uint8_t dst;            // write slot
+    uint32_t imm;           // sign-extended immediate, negated for SUBI
+    uint32_t target;        // branch/jump target as an index into code
+};
+
+static inline int read_slot(int reg) {
+    return reg == 0 ? SLOT_ZERO : reg % SIM_REGISTERS;
+}
+
+static inline int write_slot(int reg) {
+    return reg == 0 ? SLOT_SINK : reg % SIM_REGISTERS;
+}
+
+// The interpreter. Called with `handlers` set it only hands out its table of
+// handler addresses, which sim_decode() stores in the decoded instructions.
+static void sim_exec(const sim_program_t* program, uint32_t* memory, uint64_t max_cycles, sim_result_t* result,
+                     sim_access_fn access, void* context, const void* const** handlers) {
+    static const void* const table[HANDLER_COUNT] = {
+        [HANDLER_END] = &&op_end,
+        [HANDLER_NOP] = &&op_nop,
+        [HANDLER_LOAD] = &&op_load,
+        [HANDLER_STORE] = &&op_store,
+        [HANDLER_ADDI] = &&op_addi,
+        [HANDLER_BEQ] = &&op_beq,
+        [HANDLER_BGE] = &&op_bge,
+        [HANDLER_JUMP] = &&op_jump,
+        [HANDLER_WRAP] = &&op_wrap,
+        [HANDLER_LOAD_TRACED] = &&op_load_traced,
+        [HANDLER_STORE_TRACED] = &&op_store_traced,
+    };
+    if (handlers) {
+        *handlers = table;
+        return;
+    }
+
+    uint32_t regs[SLOT_COUNT] = {0};
+    const sim_insn_t* code = program->code;
+    const sim_insn_t* ip = code;
+    uint64_t budget = max_cycles ? max_cycles : UINT64_MAX;
+    uint64_t executed = 0;
+    int halted = 0;
+
+#define DISPATCH() goto *ip->handler
+#define RETIRE(next)                                    \
+    do {                                                \
+        ip = (next);                                    \
+        if (++executed == budget) goto limit;           \
+        DISPATCH();                                     \
+    } while (0)
+
+    DISPATCH();
+
+op_load:
+    regs[ip->dst] = memory[(regs[ip->rs] + ip->imm) & 0xFFFF];
+    RETIRE(ip + 1);
+op_store:
+    memory[(regs[ip->rs] + ip->imm) & 0xFFFF] = regs[ip->rt];
+    RETIRE(ip + 1);
+op_addi:
+    regs[ip->dst] = regs[ip->rs] + ip->imm;
+    RETIRE(ip + 1);
+op_beq:
+    RETIRE(regs[ip->rs] == regs[ip->rt] ? code + ip->target : ip + 1);
+op_bge:
+    RETIRE((int32_t)regs[ip->rs] >= (int32_t)regs[ip->rt] ? code + ip->target : ip + 1);
+op_jump:
+    RETIRE(code + ip->target);
+op_nop:
+    RETIRE(ip + 1);
+op_wrap:
+    // The PC is 16 bits, so running off a full program memory continues at 0
+    ip = code;
+    DISPATCH();
+op_load_traced:
+    access(context, (regs[ip->rs] + ip->imm) & 0xFFFF, 0);
+    goto op_load;
+op_store_traced:
+    access(context, (regs[ip->rs] + ip->imm) & 0xFFFF, 1);
+    goto op_store;
+op_end:
+    halted = 1;
+limit:
+#undef RETIRE
+#undef DISPATCH
+
+    // The tester steps the clock once before it first samples done
+    result->cycles = executed ? executed : 1;
+    result->halted = halted;
+    memcpy(result->registers, regs, sizeof(result->registers));
+}
+
+// Decode `count` instruction words. Returns -1 on an invalid length or
+// allocation failure.
+int sim_decode(sim_program_t* program, const uint32_t* words, int count) {
+    if (count < 0 || count > SIM_PROGRAM_WORDS) return -1;
+    const void* const* handlers;
+    sim_exec(NULL, NULL, 0, NULL, NULL, NULL, &handlers);
+
+    program->length = count;
+    program->code = calloc((size_t)count + 1, sizeof(sim_insn_t));
+    if (!program->code) return -1;
+
+    for (int pc = 0; pc < count; pc++) {
+        uint32_t word = words[pc];
+        int opcode = word >> 26;
+        int rs = (word >> 21) & 0x1F;
+        int rt = (word >> 16) & 0x1F;
+        uint32_t imm = (uint32_t)(int32_t)(int16_t)(word & 0xFFFF);
+        uint32_t target = word & 0xFFFF;
+
+        sim_insn_t* insn = &program->code[pc];
+        insn->rs = read_slot(rs);
+        insn->rt = read_slot(rt);
+        insn->dst = write_slot(rt);
+        insn->imm = imm;
+        insn->target = target < (uint32_t)count ? target : (uint32_t)count;
+
+        int handler;
+        switch (opcode) {
+            case SIM_OP_END:   handler = HANDLER_END; break;
+            case SIM_OP_LOAD:  handler = HANDLER_LOAD; break;
+            case SIM_OP_STORE: handler = HANDLER_STORE; break;
+            case SIM_OP_ADDI:  handler = HANDLER_ADDI; break;
+            case SIM_OP_SUBI:  handler = HANDLER_ADDI; insn->imm = 0u - imm; break;
+            case SIM_OP_BEQ:   handler = HANDLER_BEQ; break;
+            case SIM_OP_BGE:   handler = HANDLER_BGE; break;
+            case SIM_OP_JUMP:  handler = HANDLER_JUMP; break;
+            default:           handler = HANDLER_NOP; break;
+        }
+        insn->handler = handlers[handler];
+    }
+    // Program memory past the last word reads as END, unless it is full
+    program->code[count].handler = handlers[count == SIM_PROGRAM_WORDS ? HANDLER_WRAP : HANDLER_END];
+    return 0;
+}
+
+// Read and decode a .bin written by assembler.c
+int sim_load(sim_program_t* program, const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        printf("Error: Cannot open program %s\n", path);
+        return -1;
+    }
+    uint32_t* words = malloc(SIM_PROGRAM_WORDS * sizeof(uint32_t));
+    if (!words) {
+        fclose(file);
+        return -1;
+    }
+    size_t bytes = fread(words, 1, SIM_PROGRAM_WORDS * sizeof(uint32_t), file);
+    int extra = fgetc(file) != EOF;
+    fclose(file);
+    if (extra) {
+        printf("Error: Program %s is larger than %d words\n", path, SIM_PROGRAM_WORDS);
+        free(words);
+        return -1;
+    }
+    // A truncated file would otherwise lose its last instruction silently
+    if (bytes % sizeof(uint32_t) != 0) {
+        printf("Error: Program %s ends with a partial word\n", path);
+        free(words);
+        return -1;
+    }
+    int result = sim_decode(program, words, (int)(bytes / sizeof(uint32_t)));
+    free(words);
+    return result;
+}
+
+void sim_free(sim_program_t* program) {
+    free(program->code);
+    program->code = NULL;
+    program->length = 0;
+}
+
+// Run the program on `memory` until END or `max_cycles` (0 for no limit)
+void sim_run(const sim_program_t* program, uint32_t memory[SIM_MEMORY_WORDS], uint64_t max_cycles, sim_result_t* result) {
+    sim_exec(program, memory, max_cycles, result, NULL, NULL, NULL);
+}
+
+// Run like sim_run(), calling access() for every LOAD and STORE in program
+// order. The traced handlers live in a copy of the code, so untraced runs
+// do not pay for them. Returns -1 if the copy cannot be allocated.
+int sim_run_traced(const sim_program_t* program, uint32_t memory[SIM_MEMORY_WORDS], uint64_t max_cycles,
+                   sim_result_t* result, sim_access_fn access, void* context) {
+    const void* const* handlers;
+    sim_exec(NULL, NULL, 0, NULL, NULL, NULL, &handlers);
+    sim_program_t traced;
+    traced.length = program->length;
+    traced.code = malloc(((size_t)program->length + 1) * sizeof(sim_insn_t));
+    if (!traced.code) return -1;
+    memcpy(traced.code, program->code, ((size_t)program->length + 1) * sizeof(sim_insn_t));
+    for (int pc = 0; pc < traced.length; pc++) {
+        if (traced.code[pc].handler == handlers[HANDLER_LOAD]) traced.code[pc].handler = handlers[HANDLER_LOAD_TRACED];
+        if (traced.code[pc].handler == handlers[HANDLER_STORE]) traced.code[pc].handler = handlers[HANDLER_STORE_TRACED];
+    }
+    sim_exec(&traced, memory, max_cycles, result, access, context, NULL);
+    sim_free(&traced);
+    return 0;
+}
+
+#ifndef SIM_NO_MAIN
+
+// One input image: a file, or a generated cell image when path is NULL
+typedef struct {
+    const char* path;
+    unsigned int seed;
+    sim_result_t result;
+    int status;             // 0 ok, 1 differs from erode(), -1 error
+} sim_image_t;
+
+typedef struct {
+    const sim_program_t* program;
+    sim_image_t* images;
+    int count;
+    int next;               // next unclaimed image
+    int rows;               // size of generated images
+    int cols;
+    int output_offset;      // -1 for sim_output_offset() of each image
+    uint64_t max_cycles;
+    int check;
+    const char* dump;
+} sim_batch_t;
+
+// Read an input image as rows * cols bytes
+static unsigned char* load_image(const sim_batch_t* batch, const sim_image_t* image, int* rows, int* cols) {
+    if (!image->path) {
+        *rows = batch->rows;
+        *cols = batch->cols;
+        unsigned char* pixels = malloc((size_t)*rows * *cols);
+        if (pixels) fill_cells(*rows, *cols, (unsigned char (*)[*cols])pixels, 1 + *rows * *cols / 2250, image->seed);
+        return pixels;
+    }
+
+    image_t img;
+    if (image_map(&img, image->path, 0)) return NULL;
+    unsigned char* pixels = NULL;
+    if (img.channels != 1) {
+        printf("Error: %s is not a grayscale image\n", image->path);
+    } else if ((pixels = malloc((size_t)img.rows * img.cols))) {
+        for (int x = 0; x < img.rows; x++) {
+            memcpy(pixels + (size_t)x * img.cols, img.data + x * img.stride, img.cols);
+        }
+        *rows = img.rows;
+        *cols = img.cols;
+    }
+    image_free(&img);
+    return pixels;
+}
+
+static int dump_memory(const char* path, const uint32_t* memory) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        printf("Error: Cannot create output file %s\n", path);
+        return -1;
+    }
+    size_t written = fwrite(memory, sizeof(uint32_t), SIM_MEMORY_WORDS, file);
+    fclose(file);
+    return written == SIM_MEMORY_WORDS ? 0 : -1;
+}
+
+static int simulate_image(const sim_batch_t* batch, int index, uint32_t* memory) {
+    sim_image_t* image = &batch->images[index];
+    int rows, cols;
+    unsigned char* pixels = load_image(batch, image, &rows, &cols);
+    if (!pixels) return -1;
+
+    size_t size = (size_t)rows * cols;
+    int output = batch->output_offset;
+    if (output < 0 && size <= SIM_MEMORY_WORDS / 2) output = sim_output_offset((int)size);
+    if (output < 0 || size > (size_t)output || output + size > SIM_MEMORY_WORDS) {
+        printf("Error: %dx%d image does not fit below the output at %d\n", rows, cols, output);
+        free(pixels);
+        return -1;
+    }
+
+    memset(memory, 0, SIM_MEMORY_WORDS * sizeof(uint32_t));
+    for (size_t i = 0; i < size; i++) {
+        memory[i] = pixels[i];
+    }
+    sim_run(batch->program, memory, batch->max_cycles, &image->result);
+
+    int status = 0;
+    if (batch->check) {
+        unsigned char (*expected)[cols] = (unsigned char (*)[cols])pixels;
+        erode(rows, cols, 0, expected, NULL);
+        for (size_t i = 0; i < size && status == 0; i++) {
+            if ((memory[output + i] != 0) != (pixels[i] != 0)) status = 1;
+        }
+    }
+    if (batch->dump) {
+        char path[1024];
+        if (batch->count == 1) snprintf(path, sizeof(path), "%s", batch->dump);
+        else snprintf(path, sizeof(path), "%s.%d", batch->dump, index);
+        if (dump_memory(path, memory)) status = -1;
+    }
+    free(pixels);
+    return status;
+}
+
+// Workers claim images one at a time, so a slow image does not hold up a band
+static void simulate_job(void* arg, int index, int count) {
+    (void)index;
+    (void)count;
+    sim_batch_t* batch = arg;
+    uint32_t* memory = malloc(SIM_MEMORY_WORDS * sizeof(uint32_t));
+    for (;;) {
+        int i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+        if (i >= batch->count) break;
+        batch->images[i].status = memory ? simulate_image(batch, i, memory) : -1;
+    }
+    free(memory);
+}
+
+static void usage(const char* name) {
+    printf("Usage: %s [options] <program.bin> [image.bmp|pgm|pbm ...]\n", name);
+    printf("  --cells N         also simulate N generated cell images\n");
+    printf("  --size RxC        size of generated images (default 20x20)\n");
+    printf("  --output N        address of the output image (default %d, or right after a larger image)\n", SIM_OUTPUT_BASE);
+    printf("  --max-cycles N    stop each run after N cycles (default: no limit)\n");
+    printf("  --threads N       worker threads (default: one per CPU)\n");
+    printf("  --check           compare each output image against erode()\n");
+    printf("  --dump FILE       write the final data memory as %d little-endian words\n", SIM_MEMORY_WORDS);
+}
+
+int main(int argc, char* argv[]) {
+    sim_batch_t batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.rows = batch.cols = 20;
+    batch.output_offset = -1;
+    int cells = 0, threads = 0;
+    const char* program_file = NULL;
+
+    batch.images = calloc(argc, sizeof(sim_image_t));
+    if (!batch.images) return 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--check") == 0) {
+            batch.check = 1;
+            continue;
+        }
+        if (strncmp(argv[i], "--", 2) != 0) {
+            if (!program_file) program_file = argv[i];
+            else batch.images[batch.count++].path = argv[i];
+            continue;
+        }
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!value) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (strcmp(argv[i], "--cells") == 0) cells = atoi(value);
+        else if (strcmp(argv[i], "--output") == 0) batch.output_offset = atoi(value);
+        else if (strcmp(argv[i], "--max-cycles") == 0) batch.max_cycles = strtoull(value, NULL, 10);
+        else if (strcmp(argv[i], "--threads") == 0) threads = atoi(value);
+        else if (strcmp(argv[i], "--dump") == 0) batch.dump = value;
+        else if (strcmp(argv[i], "--size") == 0) {
+            if (sscanf(value, "%dx%d", &batch.rows, &batch.cols) != 2 || batch.rows <= 0 || batch.cols <= 0) {
+                printf("Error: Invalid image size %s\n", value);
+                return 1;
+            }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+        i++;
+    }
+    if (!program_file || batch.output_offset > SIM_MEMORY_WORDS) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    sim_program_t program;
+    if (sim_load(&program, program_file)) return 1;
+    batch.program = &program;
+
+    // Generated images go after the files, seeded 1, 2, ...
+    if (cells > 0 || batch.count == 0) {
+        if (cells <= 0) cells = 1;
+        sim_image_t* images = realloc(batch.images, ((size_t)batch.count + cells) * sizeof(sim_image_t));
+        if (!images) return 1;
+        batch.images = images;
+        for (int i = 0; i < cells; i++) {
+            memset(&batch.images[batch.count], 0, sizeof(sim_image_t));
+            batch.images[batch.count++].seed = i + 1;
+        }
+    }
+
+    erode_pool_t* pool = erode_pool_create(threads);
+    if (!pool) {
+        printf("Error: Cannot create thread pool\n");
+        return 1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    erode_pool_run(pool, simulate_job, &batch);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+
+    int failures = 0;
+    uint64_t total_cycles = 0;
+    printf("image,cycles,halted%s\n", batch.check ? ",matches_erode" : "");
+    for (int i = 0; i < batch.count; i++) {
+        sim_image_t* image = &batch.images[i];
+        char name[64];
+        if (!image->path) snprintf(name, sizeof(name), "cells:%u", image->seed);
+        if (image->status < 0) {
+            failures++;
+            continue;
+        }
+        total_cycles += image->result.cycles;
+        failures += image->status != 0 || !image->result.halted;
+        printf("%s,%llu,%d", image->path ? image->path : name, (unsigned long long)image->result.cycles, image->result.halted);
+        if (batch.check) printf(",%d", image->status == 0);
+        printf("\n");
+    }
+    fprintf(stderr, "%d images, %d threads, %llu cycles in %.3f s (%.1f M instructions/s)\n",
+            batch.count, erode_pool_threads(pool), (unsigned long long)total_cycles, seconds,
+            seconds > 0 ? total_cycles / seconds * 1e-6 : 0.0);
+
+    erode_pool_destroy(pool);
+    sim_free(&program);
+    free(batch.images);
+    return failures ? 1 : 0;
+}
+#endif
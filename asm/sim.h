@@ -0,0 +1,56 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+
+// Instruction-set simulator for CPUTop. Programs are the .bin files written by
+// assembler.c; data memory is 65536 32-bit words as in DataMemory.
+
+#define SIM_MEMORY_WORDS    65536
+#define SIM_PROGRAM_WORDS   65536
+#define SIM_REGISTERS       8
+
+// Opcodes decoded by ControlUnit, everything else executes as a no-op
+#define SIM_OP_LOAD     0x20
+#define SIM_OP_STORE    0x21
+#define SIM_OP_ADDI     0x22
+#define SIM_OP_SUBI     0x23
+#define SIM_OP_BEQ      0x24
+#define SIM_OP_BGE      0x25
+#define SIM_OP_JUMP     0x30
+#define SIM_OP_END      0x00
+
+// The erosion programs write their output image from address 400, right
+// after a 20x20 input, which is where CPUTopTester reads it. Larger images
+// put it directly after the input.
+#define SIM_OUTPUT_BASE     400
+
+static inline int sim_output_offset(int pixels) {
+    return pixels > SIM_OUTPUT_BASE ? pixels : SIM_OUTPUT_BASE;
+}
+
+typedef struct sim_insn sim_insn_t;
+
+// Pre-decoded program: every word turned into a handler address and operands
+typedef struct {
+    int length;             // instructions in the binary
+    sim_insn_t* code;       // length + 1 entries, the extra one is what follows the last word
+} sim_program_t;
+
+typedef struct {
+    uint64_t cycles;        // clock cycles as counted by CPUTopTester
+    int halted;             // reached END before the cycle limit
+    uint32_t registers[SIM_REGISTERS];
+} sim_result_t;
+
+// Called by sim_run_traced() for every LOAD and STORE with its word address
+typedef void (*sim_access_fn)(void* context, uint32_t address, int store);
+
+int sim_decode(sim_program_t* program, const uint32_t* words, int count);
+int sim_load(sim_program_t* program, const char* path);
+void sim_free(sim_program_t* program);
+void sim_run(const sim_program_t* program, uint32_t memory[SIM_MEMORY_WORDS], uint64_t max_cycles, sim_result_t* result);
+int sim_run_traced(const sim_program_t* program, uint32_t memory[SIM_MEMORY_WORDS], uint64_t max_cycles,
+                   sim_result_t* result, sim_access_fn access, void* context);
+
+#endif
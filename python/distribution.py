@@ -1,3 +1,5 @@
+import csv
+import sys
 import numpy as np
 import matplotlib.pyplot as plt
 from scipy import stats
@@ -243,6 +245,15 @@ if __name__ == "__main__":
     min_val = 4507741
     avg_val = 6845310
     max_val = 17116113
+
+    # Or take them from a bench CSV: python distribution.py bench.csv kernel pattern width
+    if len(sys.argv) > 4:
+        with open(sys.argv[1]) as f:
+            for row in csv.DictReader(f):
+                if row["kernel"] == sys.argv[2] and row["pattern"] == sys.argv[3] and row["width"] == sys.argv[4]:
+                    min_val = float(row["min_tsc_ticks"])
+                    avg_val = float(row["mean_tsc_ticks"])
+                    max_val = float(row["max_tsc_ticks"])
     
     print("Creating normal distribution from three points:")
     print(f"Minimum: {min_val}")
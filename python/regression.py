@@ -1,3 +1,5 @@
+import csv
+import sys
 import numpy as np
 import matplotlib.pyplot as plt
 from scipy.optimize import curve_fit
@@ -8,6 +10,15 @@ x = np.array([5, 10, 15, 20])
 #y = np.array([273, 1533, 3743, 6903])  # white
 y = np.array([100, 536, 1273, 2471]) # cells pattern
 
+# Or read them from a bench CSV: python regression.py bench.csv [kernel] [pattern]
+if len(sys.argv) > 1:
+    kernel = sys.argv[2] if len(sys.argv) > 2 else "reference"
+    pattern = sys.argv[3] if len(sys.argv) > 3 else "cells"
+    with open(sys.argv[1]) as f:
+        rows = [r for r in csv.DictReader(f) if r["kernel"] == kernel and r["pattern"] == pattern]
+    x = np.array([int(r["width"]) for r in rows])
+    y = np.array([float(r["median_tsc_ticks"]) for r in rows])
+
 
 # Define model functions
 def linear(x, m, c):
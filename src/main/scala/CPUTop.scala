@@ -1,7 +1,10 @@
 import chisel3._
 import chisel3.util._
+import firrtl.annotations.MemoryLoadFileType
 
-class CPUTop extends Module {
+// programFile and dataFile optionally preload the memories (see DataMemory)
+class CPUTop(programFile: String = "", dataFile: String = "",
+             fileType: MemoryLoadFileType.FileType = MemoryLoadFileType.Hex) extends Module {
   val io = IO(new Bundle {
     val done = Output(Bool ())
     val run = Input(Bool ())
@@ -21,8 +24,8 @@ class CPUTop extends Module {
 
   //Creating components
   val programCounter = Module(new ProgramCounter())
-  val dataMemory = Module(new DataMemory())
-  val programMemory = Module(new ProgramMemory())
+  val dataMemory = Module(new DataMemory(dataFile, fileType))
+  val programMemory = Module(new ProgramMemory(programFile, fileType))
   val registerFile = Module(new RegisterFile())
   val controlUnit = Module(new ControlUnit())
   val alu = Module(new ALU())
@@ -1,6 +1,10 @@
 import chisel3._
+import chisel3.util.experimental.loadMemoryFromFileInline
+import firrtl.annotations.MemoryLoadFileType
 
-class DataMemory extends Module {
+// initFile preloads the memory at elaboration time, as written by asm/bindump.c
+// (--hex for MemoryLoadFileType.Hex), so a test can skip poking it word by word
+class DataMemory(initFile: String = "", fileType: MemoryLoadFileType.FileType = MemoryLoadFileType.Hex) extends Module {
   val io = IO(new Bundle {
     val address = Input(UInt (16.W))
     val dataRead = Output(UInt (32.W))
@@ -16,6 +20,9 @@ class DataMemory extends Module {
   })
 
   val memory = Mem (65536 , UInt (32.W))
+  if (initFile.nonEmpty) {
+    loadMemoryFromFileInline(memory, initFile, fileType)
+  }
 
   when(io.testerEnable){
     //Tester mode
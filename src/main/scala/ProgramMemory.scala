@@ -1,6 +1,9 @@
 import chisel3._
+import chisel3.util.experimental.loadMemoryFromFileInline
+import firrtl.annotations.MemoryLoadFileType
 
-class ProgramMemory extends Module {
+// initFile preloads the program the same way as in DataMemory
+class ProgramMemory(initFile: String = "", fileType: MemoryLoadFileType.FileType = MemoryLoadFileType.Hex) extends Module {
   val io = IO(new Bundle {
     val address = Input(UInt (16.W))
     val instructionRead = Output(UInt (32.W))
@@ -14,6 +17,9 @@ class ProgramMemory extends Module {
   })
 
   val memory = Mem (65536 , UInt (32.W))
+  if (initFile.nonEmpty) {
+    loadMemoryFromFileInline(memory, initFile, fileType)
+  }
 
   when(io.testerEnable){
     //Tester mode
@@ -101,4 +101,52 @@ class CPUTopTester extends AnyFlatSpec with ChiselScalatestTester {
 
     }
   }
+
+  // The same run with both memories preloaded from files written by asm/bindump.c,
+  // so there is no poke loop. Regenerate them with:
+  //   ./assembler asm/20x20.asm 20x20.bin && ./bindump --hex 20x20.bin src/test/resources/program20x20.hex
+  //   ./bindump --hex --pad 800 src/test/scala/Images.scala:cellsImage src/test/resources/cells20x20.hex
+  it should "erode an image preloaded from init files" in {
+    test(new CPUTop("src/test/resources/program20x20.hex", "src/test/resources/cells20x20.hex")) { dut =>
+
+        dut.clock.setTimeout(0)
+
+        //Start the CPU straight away
+        dut.io.testerDataMemEnable.poke(false.B)
+        dut.io.testerProgMemEnable.poke(false.B)
+        dut.io.run.poke(true.B)
+        var running = true
+        var maxInstructions = 20000
+        var instructionsCounter = 0
+        while (running) {
+          dut.clock.step(1)
+          instructionsCounter += 1
+          running = dut.io.done.peekBoolean() == false && instructionsCounter < maxInstructions
+        }
+        dut.io.run.poke(false.B)
+        System.out.println("Clock cycles with preloaded memories: " + instructionsCounter)
+        assert(instructionsCounter < maxInstructions, "the program did not finish")
+
+        //Compare the processed image with the erosion of the input by the cross
+        val image = Images.cellsImage
+        def white(x: Int, y: Int) = image(x + 20 * y) == 255
+        for (i <- 0 to 799) {
+          dut.io.testerDataMemEnable.poke(true.B)
+          dut.io.testerDataMemWriteEnable.poke(false.B)
+          dut.io.testerDataMemAddress.poke(i)
+          val data = dut.io.testerDataMemDataRead.peekInt().toInt
+          val expected = if (i < 400) {
+            image(i)
+          } else {
+            val x = (i - 400) % 20
+            val y = (i - 400) / 20
+            val inside = x > 0 && x < 19 && y > 0 && y < 19
+            if (inside && white(x, y) && white(x - 1, y) && white(x + 1, y) && white(x, y - 1) && white(x, y + 1)) 255 else 0
+          }
+          assert(data == expected, s"address $i holds $data, expected $expected")
+          dut.clock.step(1)
+        }
+        dut.io.testerDataMemEnable.poke(false.B)
+    }
+  }
 }